@@ -27,6 +27,9 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdint.h>
 #include <assert.h>
 #include <float.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <htslib/sam.h>
 #include <htslib/kstring.h>
 #include <htslib/kfunc.h>
@@ -44,6 +47,7 @@ extern const char bam_nt16_nt4_table[];
 bcf_callaux_t *bcf_call_init(double theta, int min_baseQ)
 {
     bcf_callaux_t *bca;
+    int i;
     if (theta <= 0.) theta = CALL_DEFTHETA;
     bca = calloc(1, sizeof(bcf_callaux_t));
     bca->capQ = 60;
@@ -63,18 +67,21 @@ bcf_callaux_t *bcf_call_init(double theta, int min_baseQ)
     bca->alt_bq  = malloc(bca->nqual*sizeof(int));
     bca->fwd_mqs = malloc(bca->nqual*sizeof(int));
     bca->rev_mqs = malloc(bca->nqual*sizeof(int));
+    for (i = 0; i < 256; ++i)
+        bca->qual_bin[i] = (i < 59? i : 59)/60. * bca->nqual;
     return bca;
 }
 
 void bcf_call_destroy(bcf_callaux_t *bca)
 {
     if (bca == 0) return;
+    bcf_call_gap_destroy(bca);
     errmod_destroy(bca->e);
     if (bca->npos) { free(bca->ref_pos); free(bca->alt_pos); bca->npos = 0; }
     free(bca->ref_mq); free(bca->alt_mq); free(bca->ref_bq); free(bca->alt_bq);
     free(bca->fwd_mqs); free(bca->rev_mqs);
     bca->nqual = 0;
-    free(bca->bases); free(bca->inscns); free(bca);
+    free(bca->bases); free(bca->col_bq); free(bca->inscns); free(bca);
 }
 
 // position in the sequence with respect to the aligned part of the read
@@ -127,53 +134,44 @@ void bcf_callaux_clean(bcf_callaux_t *bca, bcf_call_t *call)
     if ( call->DPR ) memset(call->DPR,0,sizeof(int32_t)*(call->n+1)*B2B_MAX_ALLELES);
 }
 
+/* bits of bcf_callaux_t.col_flag */
+#define COL_REV  1  // read on the reverse strand
+#define COL_DIFF 2  // base or indel allele differs from the reference
+#define COL_REF  4  // base equals ref_base, for the bias tests
+
 /*
-    Notes:
-    - Called from bam_plcmd.c by mpileup. Amongst other things, sets the bcf_callret1_t.qsum frequencies
-        which are carried over via bcf_call_combine and bcf_call2bcf to the output BCF as the QS annotation.
-        Later it's used for multiallelic calling by bcftools -m
-    - ref_base is the 4-bit representation of the reference base. It is negative if we are looking at an indel.
- */
-/*
- * This function is called once for each sample.
- * _n is number of pilesups pl contributing reads to this sample
- * pl is pointer to array of _n pileups (one pileup per read)
- * ref_base is the 4-bit representation of the reference base. It is negative if we are looking at an indel.
- * bca is the settings to perform calls across all samples
- * r is the returned value of the call
+ * Column-gather stage of bcf_call_glfgen(): looks each read up once and
+ * stores what the calling and annotation passes need in the contiguous
+ * per-read arrays of bca (bases, col_*), so that those passes do not go
+ * back to the bam1_t records.  Returns the number of reads kept.
  */
-int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t *bca, bcf_callret1_t *r)
+static int gather_column(int _n, const bam_pileup1_t *pl, int ref_base, int ref4, int is_indel,
+                         bcf_callaux_t *bca, bcf_callret1_t *r)
 {
-    int i, n, ref4, is_indel, ori_depth = 0;
-
-    // clean from previous run
-    r->ori_depth = 0;
-    r->mq0 = 0;
-    memset(r->qsum,0,sizeof(float)*4);
-    memset(r->anno,0,sizeof(double)*16);
-    memset(r->p,0,sizeof(float)*25);
+    int i, n, ori_depth = 0;
 
-    if (ref_base >= 0) {
-        ref4 = bam_nt16_nt4_table[ref_base];
-        is_indel = 0;
-    } else ref4 = 4, is_indel = 1;
-    if (_n == 0) return -1;
-    // enlarge the bases array if necessary
+    // enlarge the per-read arrays if necessary
     if (bca->max_bases < _n) {
         bca->max_bases = _n;
         kroundup32(bca->max_bases);
         bca->bases = (uint16_t*)realloc(bca->bases, 2 * bca->max_bases);
+        bca->col_bq = (uint8_t*)realloc(bca->col_bq, 5 * bca->max_bases);
     }
-    // fill the bases array
+    bca->col_mq = bca->col_bq + bca->max_bases;
+    bca->col_dist = bca->col_mq + bca->max_bases;
+    bca->col_epos = bca->col_dist + bca->max_bases;
+    bca->col_flag = bca->col_epos + bca->max_bases;
+
     for (i = n = 0; i < _n; ++i) {
         const bam_pileup1_t *p = pl + i;
-        int q, b, mapQ, baseQ, is_diff, min_dist, seqQ;
+        const bam1_t *b = p->b;
+        int q, base, mapQ, baseQ, is_diff, min_dist, seqQ, len, pos;
         // set base
-        if (p->is_del || p->is_refskip || (p->b->core.flag&BAM_FUNMAP)) continue;
+        if (p->is_del || p->is_refskip || (b->core.flag&BAM_FUNMAP)) continue;
         ++ori_depth;
-        mapQ  = p->b->core.qual < 255? p->b->core.qual : DEF_MAPQ; // special case for mapQ==255
+        mapQ  = b->core.qual < 255? b->core.qual : DEF_MAPQ; // special case for mapQ==255
         if ( !mapQ ) r->mq0++;
-        baseQ = q = is_indel? p->aux&0xff : (int)bam_get_qual(p->b)[p->qpos]; // base/indel quality
+        baseQ = q = is_indel? p->aux&0xff : (int)bam_get_qual(b)[p->qpos]; // base/indel quality
         seqQ = is_indel? (p->aux>>8&0xff) : 99;
         if (q < bca->min_baseQ) continue;
         if (q > seqQ) q = seqQ;
@@ -182,54 +180,203 @@ int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t
         if (q > 63) q = 63;
         if (q < 4) q = 4;       // MQ=0 reads count as BQ=4
         if (!is_indel) {
-            b = bam_seqi(bam_get_seq(p->b), p->qpos); // base
-            b = bam_nt16_nt4_table[b? b : ref_base]; // b is the 2-bit base
-            is_diff = (ref4 < 4 && b == ref4)? 0 : 1;
+            base = bam_seqi(bam_get_seq(b), p->qpos); // base
+            base = bam_nt16_nt4_table[base? base : ref_base]; // base is the 2-bit base
+            is_diff = (ref4 < 4 && base == ref4)? 0 : 1;
         } else {
-            b = p->aux>>16&0x3f;
-            is_diff = (b != 0);
-        }
-        bca->bases[n++] = q<<5 | (int)bam_is_rev(p->b)<<4 | b;
-        // collect annotations
-        if (b < 4)
-        {
-            r->qsum[b] += q;
-            if ( r->DPR ) r->DPR[b]++;
+            base = p->aux>>16&0x3f;
+            is_diff = (base != 0);
         }
-        ++r->anno[0<<2|is_diff<<1|bam_is_rev(p->b)];
-        min_dist = p->b->core.l_qseq - 1 - p->qpos;
+        bca->bases[n] = q<<5 | (int)bam_is_rev(b)<<4 | base;
+        min_dist = b->core.l_qseq - 1 - p->qpos;
         if (min_dist > p->qpos) min_dist = p->qpos;
         if (min_dist > CAP_DIST) min_dist = CAP_DIST;
-        r->anno[1<<2|is_diff<<1|0] += baseQ;
-        r->anno[1<<2|is_diff<<1|1] += baseQ * baseQ;
-        r->anno[2<<2|is_diff<<1|0] += mapQ;
-        r->anno[2<<2|is_diff<<1|1] += mapQ * mapQ;
-        r->anno[3<<2|is_diff<<1|0] += min_dist;
-        r->anno[3<<2|is_diff<<1|1] += min_dist * min_dist;
-
-        // collect for bias tests
-        if ( baseQ > 59 ) baseQ = 59;
-        if ( mapQ > 59 ) mapQ = 59;
-        int len, pos = get_position(p, &len);
-        int epos = (double)pos/(len+1) * bca->npos;
-        int ibq  = baseQ/60. * bca->nqual;
-        int imq  = mapQ/60. * bca->nqual;
-        if ( bam_is_rev(p->b) ) bca->rev_mqs[imq]++;
+        pos = get_position(p, &len);
+        bca->col_bq[n] = baseQ;
+        bca->col_mq[n] = mapQ;
+        bca->col_dist[n] = min_dist;
+        bca->col_epos[n] = (double)pos/(len+1) * bca->npos;
+        bca->col_flag[n] = (bam_is_rev(b)? COL_REV : 0) | (is_diff? COL_DIFF : 0)
+            | (bam_seqi(bam_get_seq(b),p->qpos) == ref_base? COL_REF : 0);
+        ++n;
+    }
+    r->ori_depth = ori_depth;
+    return n;
+}
+
+#ifdef __SSE2__
+// adds the products of the bytes of x and y to the 32-bit lanes of acc
+static inline __m128i mul_add_epu8(__m128i acc, __m128i x, __m128i y)
+{
+    __m128i z = _mm_setzero_si128();
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(x, z), _mm_unpacklo_epi8(y, z)));
+    return _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(x, z), _mm_unpackhi_epi8(y, z)));
+}
+#endif
+
+/*
+ * Adds the annotation sums of gathered reads [i,end) to sum[]: reverse,
+ * baseQ, baseQ^2, mapQ, mapQ^2, minDist and minDist^2 at 1..7, and the
+ * read count and the same sums over the non-reference reads at 8..15.
+ * At most 65536 reads at a time, which keeps the 32-bit partial sums of
+ * squares (at most 255^2 each) from overflowing.
+ */
+static void column_sums(const bcf_callaux_t *bca, int i, int end, uint64_t *sum)
+{
+    const uint8_t *bq = bca->col_bq, *mq = bca->col_mq, *dist = bca->col_dist, *flag = bca->col_flag;
+    uint32_t s[16];
+    int k;
+
+    memset(s, 0, sizeof(s));
+#ifdef __SSE2__
+    {
+        __m128i sad[9], sq[6], zero = _mm_setzero_si128(), one = _mm_set1_epi8(1), two = _mm_set1_epi8(COL_DIFF);
+        uint64_t lane64[2];
+        uint32_t lane32[4];
+        for (k = 0; k < 9; ++k) sad[k] = zero;
+        for (k = 0; k < 6; ++k) sq[k] = zero;
+        for (; i + 16 <= end; i += 16) {
+            __m128i f = _mm_loadu_si128((const __m128i*)(flag + i));
+            __m128i m = _mm_cmpeq_epi8(_mm_and_si128(f, two), two); // 0xff for a non-ref read
+            __m128i rev = _mm_and_si128(f, one);
+            __m128i x = _mm_loadu_si128((const __m128i*)(bq + i));
+            __m128i y = _mm_loadu_si128((const __m128i*)(mq + i));
+            __m128i z = _mm_loadu_si128((const __m128i*)(dist + i));
+            __m128i xm = _mm_and_si128(x, m), ym = _mm_and_si128(y, m), zm = _mm_and_si128(z, m);
+            sad[0] = _mm_add_epi64(sad[0], _mm_sad_epu8(rev, zero));
+            sad[1] = _mm_add_epi64(sad[1], _mm_sad_epu8(x, zero));
+            sad[2] = _mm_add_epi64(sad[2], _mm_sad_epu8(y, zero));
+            sad[3] = _mm_add_epi64(sad[3], _mm_sad_epu8(z, zero));
+            sad[4] = _mm_add_epi64(sad[4], _mm_sad_epu8(_mm_and_si128(m, one), zero));
+            sad[5] = _mm_add_epi64(sad[5], _mm_sad_epu8(_mm_and_si128(rev, m), zero));
+            sad[6] = _mm_add_epi64(sad[6], _mm_sad_epu8(xm, zero));
+            sad[7] = _mm_add_epi64(sad[7], _mm_sad_epu8(ym, zero));
+            sad[8] = _mm_add_epi64(sad[8], _mm_sad_epu8(zm, zero));
+            sq[0] = mul_add_epu8(sq[0], x, x);
+            sq[1] = mul_add_epu8(sq[1], y, y);
+            sq[2] = mul_add_epu8(sq[2], z, z);
+            sq[3] = mul_add_epu8(sq[3], xm, x);
+            sq[4] = mul_add_epu8(sq[4], ym, y);
+            sq[5] = mul_add_epu8(sq[5], zm, z);
+        }
+        for (k = 0; k < 9; ++k) {
+            static const int sad_idx[9] = { 1, 2, 4, 6, 8, 9, 10, 12, 14 };
+            _mm_storeu_si128((__m128i*)lane64, sad[k]);
+            sum[sad_idx[k]] += lane64[0] + lane64[1];
+        }
+        for (k = 0; k < 6; ++k) {
+            static const int sq_idx[6] = { 3, 5, 7, 11, 13, 15 };
+            _mm_storeu_si128((__m128i*)lane32, sq[k]);
+            sum[sq_idx[k]] += (uint64_t)lane32[0] + lane32[1] + lane32[2] + lane32[3];
+        }
+    }
+#endif
+    for (; i < end; ++i) {
+        uint32_t d = flag[i]>>1 & 1, rev = flag[i] & COL_REV, x = bq[i], y = mq[i], z = dist[i];
+        s[1] += rev;   s[2] += x;   s[3] += x*x;   s[4] += y;   s[5] += y*y;   s[6] += z;   s[7] += z*z;
+        s[8] += d;     s[9] += rev*d; s[10] += x*d; s[11] += x*x*d; s[12] += y*d; s[13] += y*y*d; s[14] += z*d; s[15] += z*z*d;
+    }
+    for (k = 1; k < 16; ++k) sum[k] += s[k];
+}
+
+/*
+ * Sums the annotations of the n gathered reads into r.  Being whole
+ * numbers, the sums come out exactly as if added to r->anno one read at
+ * a time.
+ */
+static void column_anno(int n, const bcf_callaux_t *bca, bcf_callret1_t *r)
+{
+    const uint16_t *bases = bca->bases;
+    uint64_t sum[16];
+    uint32_t qsum[16], depth[16];
+    int i, k;
+
+    memset(sum, 0, sizeof(sum));
+    for (i = 0; i < n; i += 65536)
+        column_sums(bca, i, n - i > 65536? i + 65536 : n, sum);
+    sum[0] = n;
+    // anno[] is indexed by what<<2|is_diff<<1|x with x the strand for the depths, or squared for the sums
+    r->anno[0] = sum[0] - sum[8] - (sum[1] - sum[9]);  r->anno[1] = sum[1] - sum[9];
+    r->anno[2] = sum[8] - sum[9];                      r->anno[3] = sum[9];
+    for (k = 1; k < 4; ++k) {
+        r->anno[k<<2|0] = sum[2*k] - sum[8+2*k];
+        r->anno[k<<2|1] = sum[2*k+1] - sum[8+2*k+1];
+        r->anno[k<<2|2] = sum[8+2*k];
+        r->anno[k<<2|3] = sum[8+2*k+1];
+    }
+
+    memset(qsum, 0, sizeof(qsum));
+    memset(depth, 0, sizeof(depth));
+    for (i = 0; i < n; ++i) {
+        qsum[bases[i]&0xf] += bases[i]>>5;
+        ++depth[bases[i]&0xf];
+    }
+    for (i = 0; i < 4; ++i) {
+        r->qsum[i] = qsum[i];
+        if ( r->DPR ) r->DPR[i] += depth[i];
+    }
+}
+
+/* adds the n gathered reads to the histograms of the bias tests */
+static void column_bias(int n, bcf_callaux_t *bca)
+{
+    const uint8_t *bq = bca->col_bq, *mq = bca->col_mq, *epos = bca->col_epos, *flag = bca->col_flag;
+    int i;
+    for (i = 0; i < n; ++i) {
+        int ibq = bca->qual_bin[bq[i]], imq = bca->qual_bin[mq[i]];
+        if ( flag[i] & COL_REV ) bca->rev_mqs[imq]++;
         else bca->fwd_mqs[imq]++;
-        if ( bam_seqi(bam_get_seq(p->b),p->qpos) == ref_base )
+        if ( flag[i] & COL_REF )
         {
-            bca->ref_pos[epos]++;
+            bca->ref_pos[epos[i]]++;
             bca->ref_bq[ibq]++;
             bca->ref_mq[imq]++;
         }
         else
         {
-            bca->alt_pos[epos]++;
+            bca->alt_pos[epos[i]]++;
             bca->alt_bq[ibq]++;
             bca->alt_mq[imq]++;
         }
     }
-    r->ori_depth = ori_depth;
+}
+
+/*
+    Notes:
+    - Called from bam_plcmd.c by mpileup. Amongst other things, sets the bcf_callret1_t.qsum frequencies
+        which are carried over via bcf_call_combine and bcf_call2bcf to the output BCF as the QS annotation.
+        Later it's used for multiallelic calling by bcftools -m
+    - ref_base is the 4-bit representation of the reference base. It is negative if we are looking at an indel.
+    - The SNP and the indel pass go through the same stages: gather_column() collects the reads of the
+        column into the arrays of bca, which column_anno(), column_bias() and errmod_cal() then work on.
+ */
+/*
+ * This function is called once for each sample.
+ * _n is number of pilesups pl contributing reads to this sample
+ * pl is pointer to array of _n pileups (one pileup per read)
+ * ref_base is the 4-bit representation of the reference base. It is negative if we are looking at an indel.
+ * bca is the settings to perform calls across all samples
+ * r is the returned value of the call
+ */
+int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t *bca, bcf_callret1_t *r)
+{
+    int n, ref4, is_indel;
+
+    // clean from previous run
+    r->ori_depth = 0;
+    r->mq0 = 0;
+    memset(r->qsum,0,sizeof(float)*4);
+    memset(r->anno,0,sizeof(double)*16);
+    memset(r->p,0,sizeof(float)*25);
+
+    if (ref_base >= 0) {
+        ref4 = bam_nt16_nt4_table[ref_base];
+        is_indel = 0;
+    } else ref4 = 4, is_indel = 1;
+    if (_n == 0) return -1;
+    n = gather_column(_n, pl, ref_base, ref4, is_indel, bca, r);
+    column_anno(n, bca, r);
+    column_bias(n, bca);
     // glfgen
     errmod_cal(bca->e, n, 5, bca->bases, r->p); // calculate PL of each genotype
     return n;
@@ -677,12 +824,75 @@ int bcf_call_combine(int n, const bcf_callret1_t *calls, bcf_callaux_t *bca, int
     return 0;
 }
 
+static const char *b2b_tag_name[B2B_N_TAG] = {
+    "INDEL", "IDV", "IMF", "DP", "I16", "QS", "VDB", "SGB", "RPB", "MQB", "MQSB", "BQB", "RPB2", "MQB2",
+    "MQSB2", "BQB2", "MQ0F", "PL", "DV", "SP", "DP4", "DPR"
+};
+
+/*
+ * Sets the header of the records made by bcf_call2bcf() and looks up the
+ * IDs of their tags once, so that records can be encoded without name
+ * lookups.  Must be called again if tags are added to hdr.
+ */
+void bcf_call_set_hdr(bcf_call_t *bc, bcf_hdr_t *hdr)
+{
+    int i;
+    bc->bcf_hdr = hdr;
+    for (i = 0; i < B2B_N_TAG; ++i)
+        bc->tag_id[i] = hdr? bcf_hdr_id2int(hdr, BCF_DT_ID, b2b_tag_name[i]) : -1;
+}
+
+/*
+ * The record is encoded the way vcf_parse() builds one, straight into the
+ * shared and indiv blocks of rec, with the same encoding as the
+ * bcf_update_info_*() and bcf_update_format_*() functions would produce but
+ * without their name lookups, unpacking and per-field allocations.  A record
+ * left clean like this is written by bcf_write1() as it is.
+ */
+static inline void enc_info_int32(const bcf_call_t *bc, bcf1_t *rec, int tag, const int32_t *v, int n)
+{
+    if (bc->tag_id[tag] < 0) return;
+    bcf_enc_int1(&rec->shared, bc->tag_id[tag]);
+    bcf_enc_vint(&rec->shared, n, (int32_t*)v, -1);
+    ++rec->n_info;
+}
+
+static inline void enc_info_float(const bcf_call_t *bc, bcf1_t *rec, int tag, const float *v, int n)
+{
+    if (bc->tag_id[tag] < 0) return;
+    bcf_enc_int1(&rec->shared, bc->tag_id[tag]);
+    bcf_enc_vfloat(&rec->shared, n, (float*)v);
+    ++rec->n_info;
+}
+
+static inline void enc_info_flag(const bcf_call_t *bc, bcf1_t *rec, int tag)
+{
+    if (bc->tag_id[tag] < 0) return;
+    bcf_enc_int1(&rec->shared, bc->tag_id[tag]);
+    bcf_enc_size(&rec->shared, 0, BCF_BT_NULL);
+    ++rec->n_info;
+}
+
+// n values for each sample
+static inline void enc_format_int32(const bcf_call_t *bc, bcf1_t *rec, int tag, const int32_t *v, int n)
+{
+    if (bc->tag_id[tag] < 0) return;
+    bcf_enc_int1(&rec->indiv, bc->tag_id[tag]);
+    bcf_enc_vint(&rec->indiv, n * rec->n_sample, (int32_t*)v, n);
+    ++rec->n_fmt;
+}
+
+/*
+ * Encodes the call bc into rec, which is cleared first; the header must have
+ * been set with bcf_call_set_hdr().
+ */
 int bcf_call2bcf(bcf_call_t *bc, bcf1_t *rec, bcf_callret1_t *bcr, int fmt_flag, const bcf_callaux_t *bca, const char *ref)
 {
     extern double kt_fisher_exact(int n11, int n12, int n21, int n22, double *_left, double *_right, double *two);
     int i, j, nals = 1;
+    char *p, *q;
 
-    bcf_hdr_t *hdr = bc->bcf_hdr;
+    bcf_clear1(rec);
     rec->rid  = bc->tid;
     rec->pos  = bc->pos;
     rec->qual = 0;
@@ -724,55 +934,66 @@ int bcf_call2bcf(bcf_call_t *bc, bcf1_t *rec, bcf_callret1_t *bcr, int fmt_flag,
             nals++;
         }
     }
-    bcf_update_alleles_str(hdr, rec, bc->tmp.s);
 
+    // ID, then REF and ALT, then FILTER
+    bcf_enc_size(&rec->shared, 0, BCF_BT_CHAR);
+    for (p = bc->tmp.s; ; p = q + 1) {
+        for (q = p; *q && *q != ','; ++q) { }
+        if (p == bc->tmp.s) rec->rlen = q - p;
+        bcf_enc_vchar(&rec->shared, q - p, p);
+        if (*q == 0) break;
+    }
+    rec->n_allele = nals;
+    bcf_enc_vint(&rec->shared, 0, 0, -1);
     bc->tmp.l = 0;
 
     // INFO
     if (bc->ori_ref < 0)
     {
-        bcf_update_info_flag(hdr, rec, "INDEL", NULL, 1);
-        bcf_update_info_int32(hdr, rec, "IDV", &bca->max_support, 1);
-        bcf_update_info_float(hdr, rec, "IMF", &bca->max_frac, 1);
+        enc_info_flag(bc, rec, B2B_TAG_INDEL);
+        enc_info_int32(bc, rec, B2B_TAG_IDV, (int32_t*)&bca->max_support, 1);
+        enc_info_float(bc, rec, B2B_TAG_IMF, &bca->max_frac, 1);
     }
-    bcf_update_info_int32(hdr, rec, "DP", &bc->ori_depth, 1);
+    enc_info_int32(bc, rec, B2B_TAG_DP, (int32_t*)&bc->ori_depth, 1);
 
     float tmpf[16];
     for (i=0; i<16; i++) tmpf[i] = bc->anno[i];
-    bcf_update_info_float(hdr, rec, "I16", tmpf, 16);
-    bcf_update_info_float(hdr, rec, "QS", bc->qsum, nals);
-
-    if ( bc->vdb != HUGE_VAL )      bcf_update_info_float(hdr, rec, "VDB", &bc->vdb, 1);
-    if ( bc->seg_bias != HUGE_VAL ) bcf_update_info_float(hdr, rec, "SGB", &bc->seg_bias, 1);
-    if ( bc->mwu_pos != HUGE_VAL )  bcf_update_info_float(hdr, rec, "RPB", &bc->mwu_pos, 1);
-    if ( bc->mwu_mq != HUGE_VAL )   bcf_update_info_float(hdr, rec, "MQB", &bc->mwu_mq, 1);
-    if ( bc->mwu_mqs != HUGE_VAL )  bcf_update_info_float(hdr, rec, "MQSB", &bc->mwu_mqs, 1);
-    if ( bc->mwu_bq != HUGE_VAL )   bcf_update_info_float(hdr, rec, "BQB", &bc->mwu_bq, 1);
+    enc_info_float(bc, rec, B2B_TAG_I16, tmpf, 16);
+    enc_info_float(bc, rec, B2B_TAG_QS, bc->qsum, nals);
+
+    if ( bc->vdb != HUGE_VAL )      enc_info_float(bc, rec, B2B_TAG_VDB, &bc->vdb, 1);
+    if ( bc->seg_bias != HUGE_VAL ) enc_info_float(bc, rec, B2B_TAG_SGB, &bc->seg_bias, 1);
+    if ( bc->mwu_pos != HUGE_VAL )  enc_info_float(bc, rec, B2B_TAG_RPB, &bc->mwu_pos, 1);
+    if ( bc->mwu_mq != HUGE_VAL )   enc_info_float(bc, rec, B2B_TAG_MQB, &bc->mwu_mq, 1);
+    if ( bc->mwu_mqs != HUGE_VAL )  enc_info_float(bc, rec, B2B_TAG_MQSB, &bc->mwu_mqs, 1);
+    if ( bc->mwu_bq != HUGE_VAL )   enc_info_float(bc, rec, B2B_TAG_BQB, &bc->mwu_bq, 1);
 #if CDF_MWU_TESTS
-    if ( bc->mwu_pos_cdf != HUGE_VAL )  bcf_update_info_float(hdr, rec, "RPB2", &bc->mwu_pos_cdf, 1);
-    if ( bc->mwu_mq_cdf != HUGE_VAL )   bcf_update_info_float(hdr, rec, "MQB2", &bc->mwu_mq_cdf, 1);
-    if ( bc->mwu_mqs_cdf != HUGE_VAL )  bcf_update_info_float(hdr, rec, "MQSB2", &bc->mwu_mqs_cdf, 1);
-    if ( bc->mwu_bq_cdf != HUGE_VAL )   bcf_update_info_float(hdr, rec, "BQB2", &bc->mwu_bq_cdf, 1);
+    if ( bc->mwu_pos_cdf != HUGE_VAL )  enc_info_float(bc, rec, B2B_TAG_RPB2, &bc->mwu_pos_cdf, 1);
+    if ( bc->mwu_mq_cdf != HUGE_VAL )   enc_info_float(bc, rec, B2B_TAG_MQB2, &bc->mwu_mq_cdf, 1);
+    if ( bc->mwu_mqs_cdf != HUGE_VAL )  enc_info_float(bc, rec, B2B_TAG_MQSB2, &bc->mwu_mqs_cdf, 1);
+    if ( bc->mwu_bq_cdf != HUGE_VAL )   enc_info_float(bc, rec, B2B_TAG_BQB2, &bc->mwu_bq_cdf, 1);
 #endif
     tmpf[0] = bc->ori_depth ? (float)bc->mq0/bc->ori_depth : 0;
-    bcf_update_info_float(hdr, rec, "MQ0F", tmpf, 1);
+    enc_info_float(bc, rec, B2B_TAG_MQ0F, tmpf, 1);
+    if ( fmt_flag&B2B_INFO_DPR )
+        enc_info_int32(bc, rec, B2B_TAG_DPR, bc->DPR, nals);
 
     // FORMAT
     rec->n_sample = bc->n;
-    bcf_update_format_int32(hdr, rec, "PL", bc->PL, nals*(nals+1)/2 * rec->n_sample);
+    enc_format_int32(bc, rec, B2B_TAG_PL, bc->PL, nals*(nals+1)/2);
     if ( fmt_flag&B2B_FMT_DP )
     {
         int32_t *ptr = (int32_t*) bc->fmt_arr;
         for (i=0; i<bc->n; i++)
             ptr[i] = bc->DP4[4*i] + bc->DP4[4*i+1] + bc->DP4[4*i+2] + bc->DP4[4*i+3];
-        bcf_update_format_int32(hdr, rec, "DP", bc->fmt_arr, rec->n_sample);
+        enc_format_int32(bc, rec, B2B_TAG_DP, ptr, 1);
     }
     if ( fmt_flag&B2B_FMT_DV )
     {
         int32_t *ptr = (int32_t*) bc->fmt_arr;
         for (i=0; i<bc->n; i++)
             ptr[i] = bc->DP4[4*i+2] + bc->DP4[4*i+3];
-        bcf_update_format_int32(hdr, rec, "DV", bc->fmt_arr, rec->n_sample);
+        enc_format_int32(bc, rec, B2B_TAG_DV, ptr, 1);
     }
     if ( fmt_flag&B2B_FMT_SP )
     {
@@ -791,14 +1012,12 @@ int bcf_call2bcf(bcf_call_t *bc, bcf1_t *rec, bcf_callret1_t *bcr, int fmt_flag,
                 ptr[i] = x;
             }
         }
-        bcf_update_format_int32(hdr, rec, "SP", bc->fmt_arr, rec->n_sample);
+        enc_format_int32(bc, rec, B2B_TAG_SP, ptr, 1);
     }
     if ( fmt_flag&B2B_FMT_DP4 )
-        bcf_update_format_int32(hdr, rec, "DP4", bc->DP4, rec->n_sample*4);
+        enc_format_int32(bc, rec, B2B_TAG_DP4, bc->DP4, 4);
     if ( fmt_flag&B2B_FMT_DPR )
-        bcf_update_format_int32(hdr, rec, "DPR", bc->DPR+B2B_MAX_ALLELES, rec->n_sample*rec->n_allele);
-    if ( fmt_flag&B2B_INFO_DPR )
-        bcf_update_info_int32(hdr, rec, "DPR", bc->DPR, rec->n_allele);
+        enc_format_int32(bc, rec, B2B_TAG_DPR, bc->DPR+B2B_MAX_ALLELES, nals);
 
     return 0;
 }
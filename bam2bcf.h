@@ -52,6 +52,12 @@ DEALINGS IN THE SOFTWARE.  */
 
 #define B2B_MAX_ALLELES 5
 
+// INFO and FORMAT tags written by bcf_call2bcf(), indices to bcf_call_t.tag_id
+enum { B2B_TAG_INDEL, B2B_TAG_IDV, B2B_TAG_IMF, B2B_TAG_DP, B2B_TAG_I16, B2B_TAG_QS, B2B_TAG_VDB,
+       B2B_TAG_SGB, B2B_TAG_RPB, B2B_TAG_MQB, B2B_TAG_MQSB, B2B_TAG_BQB, B2B_TAG_RPB2, B2B_TAG_MQB2,
+       B2B_TAG_MQSB2, B2B_TAG_BQB2, B2B_TAG_MQ0F, B2B_TAG_PL, B2B_TAG_DV, B2B_TAG_SP, B2B_TAG_DP4,
+       B2B_TAG_DPR, B2B_N_TAG };
+
 typedef struct __bcf_callaux_t {
     int capQ, min_baseQ;
     int openQ, extQ, tandemQ; // for indels
@@ -59,6 +65,7 @@ typedef struct __bcf_callaux_t {
     float min_frac, max_frac; // for collecting indel candidates
     int per_sample_flt; // indel filtering strategy
     int *ref_pos, *alt_pos, npos, *ref_mq, *alt_mq, *ref_bq, *alt_bq, *fwd_mqs, *rev_mqs, nqual; // for bias tests
+    uint8_t qual_bin[256];  // bin of a base or mapping quality in the *_bq and *_mq histograms
     // for internal uses
     int max_bases;
     int indel_types[4];     // indel lengths
@@ -66,8 +73,10 @@ typedef struct __bcf_callaux_t {
     int read_len;
     char *inscns;
     uint16_t *bases;        // 5bit: unused, 6:quality, 1:is_rev, 4:2-bit base or indel allele (index to bcf_callaux_t.indel_types)
+    uint8_t *col_bq, *col_mq, *col_dist, *col_epos, *col_flag; // per-read fields gathered alongside bases, see bcf_call_glfgen()
     errmod_t *e;
     void *rghash;
+    struct bcf_indel_arena_t *indel; // scratch memory of bcf_call_gap_prep()
 } bcf_callaux_t;
 
 typedef struct {
@@ -94,6 +103,7 @@ typedef struct {
 typedef struct {
     int tid, pos;
     bcf_hdr_t *bcf_hdr;
+    int tag_id[B2B_N_TAG]; // header IDs of the tags, -1 if absent; see bcf_call_set_hdr()
     int a[5]; // alleles: ref, alt, alt2, alt3
     float qsum[5];  // for the QS tag
     int n, n_alleles, shift, ori_ref, unseen;
@@ -119,11 +129,13 @@ extern "C" {
     void bcf_call_destroy(bcf_callaux_t *bca);
     int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t *bca, bcf_callret1_t *r);
     int bcf_call_combine(int n, const bcf_callret1_t *calls, bcf_callaux_t *bca, int ref_base /*4-bit*/, bcf_call_t *call);
+    void bcf_call_set_hdr(bcf_call_t *bc, bcf_hdr_t *hdr);
     int bcf_call2bcf(bcf_call_t *bc, bcf1_t *b, bcf_callret1_t *bcr, int fmt_flag,
                      const bcf_callaux_t *bca, const char *ref);
     int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_callaux_t *bca, const char *ref,
                           const void *rghash);
     void bcf_callaux_clean(bcf_callaux_t *bca, bcf_call_t *call);
+    void bcf_call_gap_destroy(bcf_callaux_t *bca);
 
 #ifdef __cplusplus
 }
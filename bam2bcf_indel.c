@@ -38,6 +38,31 @@ KSORT_INIT_GENERIC(uint32_t)
 #define MINUS_CONST 0x10000000
 #define INDEL_WINDOW_SIZE 50
 
+/*
+ * Scratch memory of bcf_call_gap_prep(), kept in bcf_callaux_t from one
+ * position to the next and grown as needed, including the workspace of the
+ * realignments.
+ */
+struct bcf_indel_arena_t {
+    size_t m_aux, m_types, m_rs, m_cns, m_ref0, m_ia, m_ins, m_ref2, m_query, m_score1, m_score2, m_qq;
+    uint32_t *aux, *cns;
+    int *types, *inscns_aux, *score1, *score2;
+    char *ref_sample, *ref0, *inscns, *ref2, *query;
+    uint8_t *qq;
+    kpa_buf_t *kpa;
+};
+
+void bcf_call_gap_destroy(bcf_callaux_t *bca)
+{
+    struct bcf_indel_arena_t *a = bca->indel;
+    if (a == 0) return;
+    free(a->aux); free(a->cns); free(a->types); free(a->inscns_aux); free(a->score1); free(a->score2);
+    free(a->ref_sample); free(a->ref0); free(a->inscns); free(a->ref2); free(a->query); free(a->qq);
+    kpa_buf_destroy(a->kpa);
+    free(a);
+    bca->indel = 0;
+}
+
 extern const char bam_nt16_nt4_table[];
 
 void *bcf_call_add_rg(void *_hash, const char *hdtext, const char *list)
@@ -87,6 +112,17 @@ void bcf_call_del_rghash(void *_hash)
     kh_destroy(rg, hash);
 }
 
+/*
+ * Returns 1 if read b is not from a read group in rghash, as built by
+ * bcf_call_add_rg(), and so must not be used for indel candidates.
+ */
+int bcf_call_rg_filtered(const void *rghash, const bam1_t *b)
+{
+    khash_t(rg) *hash = (khash_t(rg)*)rghash;
+    const uint8_t *rg = bam_aux_get(b, "RG");
+    return rg == 0 || kh_get(rg, hash, (const char*)(rg + 1)) == kh_end(hash);
+}
+
 static int tpos2qpos(const bam1_core_t *c, const uint32_t *cigar, int32_t tpos, int is_left, int32_t *_tpos)
 {
     int k, x = c->pos, y = 0, last_y = 0;
@@ -140,6 +176,9 @@ static inline int est_indelreg(int pos, const char *ref, int l, char *ins4)
 /*
     notes:
         - n .. number of samples
+        - if rghash is set, the caller has marked the reads to ignore when
+          looking for indel candidates with bam_pileup1_t.aux = 1 and the
+          others with 0; see bcf_call_rg_filtered()
         - the routine sets bam_pileup1_t.aux of each read as follows:
             - 6: unused
             - 6: the call; index to bcf_callaux_t.indel_types   .. (aux>>16)&0x3f
@@ -150,24 +189,20 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
                       const void *rghash)
 {
     int i, s, j, k, t, n_types, *types, max_rd_len, left, right, max_ins, *score1, *score2, max_ref2;
-    int N, K, l_run, ref_type, n_alt;
-    char *inscns = 0, *ref2, *query, **ref_sample;
-    khash_t(rg) *hash = (khash_t(rg)*)rghash;
+    int N, K, L, l_run, ref_type, n_alt;
+    char *inscns = 0, *ref2, *query, *ref_sample;
+    struct bcf_indel_arena_t *a;
     if (ref == 0 || bca == 0) return -1;
-    // mark filtered reads
+    if (bca->indel == 0) {
+        bca->indel = calloc(1, sizeof(struct bcf_indel_arena_t));
+        bca->indel->kpa = kpa_buf_init();
+    }
+    a = bca->indel;
+    // count the reads not filtered
     if (rghash) {
-        N = 0;
-        for (s = N = 0; s < n; ++s) {
-            for (i = 0; i < n_plp[s]; ++i) {
-                bam_pileup1_t *p = plp[s] + i;
-                const uint8_t *rg = bam_aux_get(p->b, "RG");
-                p->aux = 1; // filtered by default
-                if (rg) {
-                    khint_t k = kh_get(rg, hash, (const char*)(rg + 1));
-                    if (k != kh_end(hash)) p->aux = 0, ++N; // not filtered
-                }
-            }
-        }
+        for (s = N = 0; s < n; ++s)
+            for (i = 0; i < n_plp[s]; ++i)
+                if (plp[s][i].aux == 0) ++N;
         if (N == 0) return -1; // no reads left
     }
     // determine if there is a gap
@@ -182,7 +217,7 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
         bca->max_support = bca->max_frac = 0;
         int m, n_alt = 0, n_tot = 0, indel_support_ok = 0;
         uint32_t *aux;
-        aux = calloc(N + 1, 4);
+        aux = a->aux = kpa_resize(a->aux, &a->m_aux, N + 1, 4);
         m = max_rd_len = 0;
         aux[m++] = MINUS_CONST; // zero indel is always a type
         for (s = 0; s < n; ++s) {
@@ -209,7 +244,7 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
         // To prevent long stretches of N's to be mistaken for indels (sometimes thousands of bases),
         //  check the number of N's in the sequence and skip places where half or more reference bases are Ns.
         int nN=0; for (i=pos; i-pos<max_rd_len && ref[i]; i++) if ( ref[i]=='N' ) nN++;
-        if ( nN*2>(i-pos) ) { free(aux); return -1; }
+        if ( nN*2>(i-pos) ) return -1;
 
         ks_introsort(uint32_t, m, aux);
         // squeeze out identical types
@@ -218,23 +253,19 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
         // Taking totals makes it hard to call rare indels
         if ( !bca->per_sample_flt )
             indel_support_ok = ( (float)n_alt / n_tot < bca->min_frac || n_alt < bca->min_support ) ? 0 : 1;
-        if ( n_types == 1 || !indel_support_ok ) { // then skip
-            free(aux); return -1;
-        }
+        if ( n_types == 1 || !indel_support_ok ) return -1; // then skip
         if (n_types >= 64) {
-            free(aux);
             // TODO revisit how/whether to control printing this warning
             if (hts_verbose >= 2)
                 fprintf(stderr, "[%s] excessive INDEL alleles at position %d. Skip the position.\n", __func__, pos + 1);
             return -1;
         }
-        types = (int*)calloc(n_types, sizeof(int));
+        types = a->types = kpa_resize(a->types, &a->m_types, n_types, sizeof(int));
         t = 0;
         types[t++] = aux[0] - MINUS_CONST;
         for (i = 1; i < m; ++i)
             if (aux[i] != aux[i-1])
                 types[t++] = aux[i] - MINUS_CONST;
-        free(aux);
         for (t = 0; t < n_types; ++t)
             if (types[t] == 0) break;
         ref_type = t; // the index of the reference type (0)
@@ -257,16 +288,19 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
      * Masks mismatches present in at least 70% of the reads with 'N'.
      */
     { // construct per-sample consensus
-        int L = right - left + 1, max_i, max2_i;
+        int max_i, max2_i;
         uint32_t *cns, max, max2;
         char *ref0, *r;
-        ref_sample = calloc(n, sizeof(char*));
-        cns = calloc(L, 4);
-        ref0 = calloc(L, 1);
+        L = right - left + 1;
+        ref_sample = a->ref_sample = kpa_resize(a->ref_sample, &a->m_rs, (size_t)n * L, 1);
+        cns = a->cns = kpa_resize(a->cns, &a->m_cns, L, 4);
+        ref0 = a->ref0 = kpa_resize(a->ref0, &a->m_ref0, L, 1);
+        memset(ref0, 0, L);
         for (i = 0; i < right - left; ++i)
             ref0[i] = seq_nt16_table[(int)ref[i+left]];
         for (s = 0; s < n; ++s) {
-            r = ref_sample[s] = calloc(L, 1);
+            r = ref_sample + (size_t)s * L;
+            memset(r, 0, L);
             memset(cns, 0, sizeof(int) * L);
             // collect ref and non-ref counts
             for (i = 0; i < n_plp[s]; ++i) {
@@ -300,7 +334,6 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
             if (max2_i >= 0) r[max2_i] = 15;
             //for (i = 0; i < right - left; ++i) fputc("=ACMGRSVTWYHKDBN"[(int)r[i]], stderr); fputc('\n', stderr);
         }
-        free(ref0); free(cns);
     }
     { // the length of the homopolymer run around the current position
         int c = seq_nt16_table[(int)ref[pos + 1]];
@@ -317,7 +350,8 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
     // construct the consensus sequence
     max_ins = types[n_types - 1];   // max_ins is at least 0
     if (max_ins > 0) {
-        int *inscns_aux = calloc(5 * n_types * max_ins, sizeof(int));
+        int *inscns_aux = a->inscns_aux = kpa_resize(a->inscns_aux, &a->m_ia, 5 * n_types * max_ins, sizeof(int));
+        memset(inscns_aux, 0, 5 * n_types * max_ins * sizeof(int));
         // count the number of occurrences of each base at each position for each type of insertion
         for (t = 0; t < n_types; ++t) {
             if (types[t] > 0) {
@@ -337,7 +371,8 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
             }
         }
         // use the majority rule to construct the consensus
-        inscns = calloc(n_types * max_ins, 1);
+        inscns = a->inscns = kpa_resize(a->inscns, &a->m_ins, n_types * max_ins, 1);
+        memset(inscns, 0, n_types * max_ins);
         for (t = 0; t < n_types; ++t) {
             for (j = 0; j < types[t]; ++j) {
                 int max = 0, max_k = -1, *ia = &inscns_aux[(t*max_ins+j)*5];
@@ -348,14 +383,16 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
                 if ( max_k==4 ) { types[t] = 0; break; } // discard insertions which contain N's
             }
         }
-        free(inscns_aux);
     }
     // compute the likelihood given each type of indel for each read
     max_ref2 = right - left + 2 + 2 * (max_ins > -types[0]? max_ins : -types[0]);
-    ref2  = calloc(max_ref2, 1);
-    query = calloc(right - left + max_rd_len + max_ins + 2, 1);
-    score1 = calloc(N * n_types, sizeof(int));
-    score2 = calloc(N * n_types, sizeof(int));
+    ref2 = a->ref2 = kpa_resize(a->ref2, &a->m_ref2, max_ref2, 1);
+    query = a->query = kpa_resize(a->query, &a->m_query, right - left + max_rd_len + max_ins + 2, 1);
+    score1 = a->score1 = kpa_resize(a->score1, &a->m_score1, N * n_types, sizeof(int));
+    score2 = a->score2 = kpa_resize(a->score2, &a->m_score2, N * n_types, sizeof(int));
+    memset(ref2, 0, max_ref2);
+    memset(score1, 0, N * n_types * sizeof(int));
+    memset(score2, 0, N * n_types * sizeof(int));
     bca->indelreg = 0;
     for (t = 0; t < n_types; ++t) {
         int l, ir;
@@ -371,12 +408,12 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
         for (s = K = 0; s < n; ++s) {
             // write ref2
             for (k = 0, j = left; j <= pos; ++j)
-                ref2[k++] = bam_nt16_nt4_table[(int)ref_sample[s][j-left]];
+                ref2[k++] = bam_nt16_nt4_table[(int)ref_sample[(size_t)s*L + j-left]];
             if (types[t] <= 0) j += -types[t];
             else for (l = 0; l < types[t]; ++l)
                      ref2[k++] = inscns[t*max_ins + l];
             for (; j < right && ref[j]; ++j)
-                ref2[k++] = bam_nt16_nt4_table[(int)ref_sample[s][j-left]];
+                ref2[k++] = bam_nt16_nt4_table[(int)ref_sample[(size_t)s*L + j-left]];
             for (; k < max_ref2; ++k) ref2[k] = 4;
             if (j < right) right = j;
             // align each read to ref2
@@ -404,7 +441,7 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
                 { // do realignment; this is the bottleneck
                     const uint8_t *qual = bam_get_qual(p->b), *bq;
                     uint8_t *qq;
-                    qq = calloc(qend - qbeg, 1);
+                    qq = a->qq = kpa_resize(a->qq, &a->m_qq, qend - qbeg, 1);
                     bq = (uint8_t*)bam_aux_get(p->b, "ZQ");
                     if (bq) ++bq; // skip type
                     for (l = qbeg; l < qend; ++l) {
@@ -412,19 +449,18 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
                         if (qq[l - qbeg] > 30) qq[l - qbeg] = 30;
                         if (qq[l - qbeg] < 7) qq[l - qbeg] = 7;
                     }
-                    sc = kpa_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
-                                    (uint8_t*)query, qend - qbeg, qq, &apf1, 0, 0);
+                    sc = kpa_glocal_buf(a->kpa, (uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
+                                        (uint8_t*)query, qend - qbeg, qq, &apf1, 0, 0);
                     l = (int)(100. * sc / (qend - qbeg) + .499); // used for adjusting indelQ below
                     if (l > 255) l = 255;
                     score1[K*n_types + t] = score2[K*n_types + t] = sc<<8 | l;
                     if (sc > 5) {
-                        sc = kpa_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
-                                        (uint8_t*)query, qend - qbeg, qq, &apf2, 0, 0);
+                        sc = kpa_glocal_buf(a->kpa, (uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
+                                            (uint8_t*)query, qend - qbeg, qq, &apf2, 0, 0);
                         l = (int)(100. * sc / (qend - qbeg) + .499);
                         if (l > 255) l = 255;
                         score2[K*n_types + t] = sc<<8 | l;
                     }
-                    free(qq);
                 }
 /*
                 for (l = 0; l < tend - tbeg + abs(types[t]); ++l)
@@ -437,7 +473,6 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
             }
         }
     }
-    free(ref2); free(query);
     { // compute indelQ
         int *sc, tmp, *sumq;
         sc   = alloca(n_types * sizeof(int));
@@ -524,10 +559,5 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
             }
         }
     }
-    free(score1); free(score2);
-    // free
-    for (i = 0; i < n; ++i) free(ref_sample[i]);
-    free(ref_sample);
-    free(types); free(inscns);
     return n_alt > 0? 0 : -1;
 }
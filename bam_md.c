@@ -209,7 +209,7 @@ int bam_cap_mapQ(bam1_t *b, char *ref, int thres)
     return (int)(t + .499);
 }
 
-int bam_prob_realn_core(bam1_t *b, const char *ref, int flag)
+int bam_prob_realn_buf(kpa_buf_t *buf, bam1_t *b, const char *ref, int flag)
 {
     int k, i, bw, x, y, yb, ye, xb, xe, apply_baq = flag&1, extend_baq = flag>>1&1, redo_baq = flag&4;
     uint32_t *cigar = bam1_cigar(b);
@@ -268,18 +268,28 @@ int bam_prob_realn_core(bam1_t *b, const char *ref, int flag)
     { // glocal
         uint8_t *s, *r, *q, *seq = bam1_seq(b), *bq;
         int *state;
-        bq = calloc(c->l_qseq + 1, 1);
+        if ((size_t)c->l_qseq + 1 > buf->m_seq) { // the per-base buffers all have room for m_seq bases
+            buf->m_seq = c->l_qseq + 1;
+            kroundup32(buf->m_seq);
+            buf->bq = realloc(buf->bq, buf->m_seq);
+            buf->seq = realloc(buf->seq, buf->m_seq);
+            buf->q = realloc(buf->q, buf->m_seq);
+            buf->left = realloc(buf->left, buf->m_seq);
+            buf->rght = realloc(buf->rght, buf->m_seq);
+            buf->state = realloc(buf->state, buf->m_seq * sizeof(int));
+        }
+        bq = buf->bq, s = buf->seq, q = buf->q, state = buf->state;
         memcpy(bq, qual, c->l_qseq);
-        s = calloc(c->l_qseq, 1);
+        bq[c->l_qseq] = 0;
         for (i = 0; i < c->l_qseq; ++i) s[i] = bam_nt16_nt4_table[bam1_seqi(seq, i)];
-        r = calloc(xe - xb, 1);
+        r = buf->ref = kpa_resize(buf->ref, &buf->m_ref, xe > xb? xe - xb : 1, 1);
         for (i = xb; i < xe; ++i) {
             if (ref[i] == 0) { xe = i; break; }
             r[i-xb] = bam_nt16_nt4_table[bam_nt16_table[(int)ref[i]]];
         }
-        state = calloc(c->l_qseq, sizeof(int));
-        q = calloc(c->l_qseq, 1);
-        kpa_glocal(r, xe-xb, s, c->l_qseq, qual, &conf, state, q);
+        memset(state, 0, c->l_qseq * sizeof(int)); // left as is by kpa_glocal_buf() on an empty reference
+        memset(q, 0, c->l_qseq);
+        kpa_glocal_buf(buf, r, xe-xb, s, c->l_qseq, qual, &conf, state, q);
         if (!extend_baq) { // in this block, bq[] is capped by base quality qual[]
             for (k = 0, x = c->pos, y = 0; k < c->n_cigar; ++k) {
                 int op = cigar[k]&0xf, l = cigar[k]>>4;
@@ -294,8 +304,7 @@ int bam_prob_realn_core(bam1_t *b, const char *ref, int flag)
             }
             for (i = 0; i < c->l_qseq; ++i) bq[i] = qual[i] - bq[i] + 64; // finalize BQ
         } else { // in this block, bq[] is BAQ that can be larger than qual[] (different from the above!)
-            uint8_t *left, *rght;
-            left = calloc(c->l_qseq, 1); rght = calloc(c->l_qseq, 1);
+            uint8_t *left = buf->left, *rght = buf->rght;
             for (k = 0, x = c->pos, y = 0; k < c->n_cigar; ++k) {
                 int op = cigar[k]&0xf, l = cigar[k]>>4;
                 if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
@@ -312,17 +321,23 @@ int bam_prob_realn_core(bam1_t *b, const char *ref, int flag)
                 else if (op == BAM_CDEL) x += l;
             }
             for (i = 0; i < c->l_qseq; ++i) bq[i] = 64 + (qual[i] <= bq[i]? 0 : qual[i] - bq[i]); // finalize BQ
-            free(left); free(rght);
         }
         if (apply_baq) {
             for (i = 0; i < c->l_qseq; ++i) qual[i] -= bq[i] - 64; // modify qual
             bam_aux_append(b, "ZQ", 'Z', c->l_qseq + 1, bq);
         } else bam_aux_append(b, "BQ", 'Z', c->l_qseq + 1, bq);
-        free(bq); free(s); free(r); free(q); free(state);
     }
     return 0;
 }
 
+int bam_prob_realn_core(bam1_t *b, const char *ref, int flag)
+{
+    kpa_buf_t *buf = kpa_buf_init();
+    int ret = bam_prob_realn_buf(buf, b, ref, flag);
+    kpa_buf_destroy(buf);
+    return ret;
+}
+
 int bam_prob_realn(bam1_t *b, const char *ref)
 {
     return bam_prob_realn_core(b, ref, 1);
@@ -335,6 +350,7 @@ int bam_fillmd(int argc, char *argv[])
     faidx_t *fai;
     char *ref = 0, mode_w[8], mode_r[8];
     bam1_t *b;
+    kpa_buf_t *baq;
 
     flt_flag = UPDATE_NM | UPDATE_MD;
     is_bam_out = is_sam_in = is_uncompressed = is_realn = max_nm = capQ = baq_flag = 0;
@@ -384,6 +400,7 @@ int bam_fillmd(int argc, char *argv[])
     fai = fai_load(argv[optind+1]);
 
     b = bam_init1();
+    baq = kpa_buf_init();
     while ((ret = samread(fp, b)) >= 0) {
         if (b->core.tid >= 0) {
             if (tid != b->core.tid) {
@@ -394,7 +411,7 @@ int bam_fillmd(int argc, char *argv[])
                     fprintf(stderr, "[bam_fillmd] fail to find sequence '%s' in the reference.\n",
                             fp->header->target_name[tid]);
             }
-            if (is_realn) bam_prob_realn_core(b, ref, baq_flag);
+            if (is_realn) bam_prob_realn_buf(baq, b, ref, baq_flag);
             if (capQ > 10) {
                 int q = bam_cap_mapQ(b, ref, capQ);
                 if (b->core.qual > q) b->core.qual = q;
@@ -404,6 +421,7 @@ int bam_fillmd(int argc, char *argv[])
         samwrite(fpout, b);
     }
     bam_destroy1(b);
+    kpa_buf_destroy(baq);
 
     free(ref);
     fai_destroy(fai);
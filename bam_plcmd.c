@@ -32,42 +32,33 @@ DEALINGS IN THE SOFTWARE.  */
 // (from version 0.1.19) into this version 1.0
 
 #include <math.h>
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <htslib/sam.h>
 #include <htslib/faidx.h>
 #include <htslib/kstring.h>
+#include <htslib/khash.h>
 #include <htslib/khash_str2int.h>
+#include <htslib/ksort.h>
 #include "sam_header.h"
 #include "samtools.h"
-#include <htslib/bgzf.h>   // mar4: <-- for declaration of bgzf_set_cache_size
+#include <htslib/bgzf.h>   // for bgzf_tell and bgzf_seek in mplp_itr_next
+#include <htslib/hfile.h>
 
-static inline int printw(int c, FILE *fp)
-{
-    char buf[16];
-    int l, x;
-    if (c == 0) return fputc('0', fp);
-    for (l = 0, x = c < 0? -c : c; x > 0; x /= 10) buf[l++] = x%10 + '0';
-    if (c < 0) buf[l++] = '-';
-    buf[l] = 0;
-    for (x = 0; x < l/2; ++x) {
-        int y = buf[x]; buf[x] = buf[l-1-x]; buf[l-1-x] = y;
-    }
-    fputs(buf, fp);
-    return 0;
-}
-
-static inline void pileup_seq(FILE *fp, const bam_pileup1_t *p, int pos, int ref_len, const char *ref)
+static inline void pileup_seq(kstring_t *ks, const bam_pileup1_t *p, int pos, int ref_len, const char *ref)
 {
     int j;
     if (p->is_head) {
-        putc('^', fp);
-        putc(p->b->core.qual > 93? 126 : p->b->core.qual + 33, fp);
+        kputc('^', ks);
+        kputc(p->b->core.qual > 93? 126 : p->b->core.qual + 33, ks);
     }
     if (!p->is_del) {
         int c = p->qpos < p->b->core.l_qseq
@@ -81,26 +72,27 @@ static inline void pileup_seq(FILE *fp, const bam_pileup1_t *p, int pos, int ref
             if (c == '=') c = bam_is_rev(p->b)? ',' : '.';
             else c = bam_is_rev(p->b)? tolower(c) : toupper(c);
         }
-        putc(c, fp);
-    } else putc(p->is_refskip? (bam_is_rev(p->b)? '<' : '>') : '*', fp);
+        kputc(c, ks);
+    } else kputc(p->is_refskip? (bam_is_rev(p->b)? '<' : '>') : '*', ks);
     if (p->indel > 0) {
-        putc('+', fp); printw(p->indel, fp);
+        kputc('+', ks); kputw(p->indel, ks);
         for (j = 1; j <= p->indel; ++j) {
             int c = seq_nt16_str[bam_seqi(bam_get_seq(p->b), p->qpos + j)];
-            putc(bam_is_rev(p->b)? tolower(c) : toupper(c), fp);
+            kputc(bam_is_rev(p->b)? tolower(c) : toupper(c), ks);
         }
     } else if (p->indel < 0) {
-        printw(p->indel, fp);
+        kputw(p->indel, ks);
         for (j = 1; j <= -p->indel; ++j) {
             int c = (ref && (int)pos+j < ref_len)? ref[pos+j] : 'N';
-            putc(bam_is_rev(p->b)? tolower(c) : toupper(c), fp);
+            kputc(bam_is_rev(p->b)? tolower(c) : toupper(c), ks);
         }
     }
-    if (p->is_tail) putc('$', fp);
+    if (p->is_tail) kputc('$', ks);
 }
 
 #include <assert.h>
 #include "bam2bcf.h"
+#include "kprobaln.h"
 #include "sample.h"
 
 #define MPLP_BCF        1
@@ -116,6 +108,11 @@ static inline void pileup_seq(FILE *fp, const bam_pileup1_t *p, int pos, int ref
 #define MPLP_PRINT_MAPQ (1<<10)
 #define MPLP_PER_SAMPLE (1<<11)
 #define MPLP_SMART_OVERLAPS (1<<12)
+#define MPLP_SUBSAMPLE_INDEL (1<<13)
+
+#define MPLP_PLAN_AUTO   0
+#define MPLP_PLAN_STREAM 1
+#define MPLP_PLAN_SEEK   2
 
 void *bed_read(const char *fn);
 int bed_read_as_array(const char *bedfilename, int *pnlines, char ***region_lines);
@@ -123,6 +120,292 @@ void bed_destroy(void *_h);
 int bed_overlap(const void *_h, const char *chr, int beg, int end);
 
 
+/*
+ * BAQ result cache.  A read overlapping several regions that are not merged
+ * into one iterator is fetched once per region; its base qualities after BAQ
+ * are kept, keyed by the virtual offset just past the record, so that the
+ * HMM runs once per read.  The reference and BAQ flags are fixed for a run,
+ * so the offset alone identifies the result.  Each input handle, and so
+ * each thread, has a cache of its own, which needs no lock; entries are
+ * evicted oldest first once the cache holds more than max_mem bytes.  It is
+ * only set up if --baqcachesize is given.
+ */
+KHASH_MAP_INIT_INT64(baq, int)
+
+typedef struct {
+    uint64_t voff;          // virtual offset just past the record
+    int len;
+    uint8_t *qual;          // base qualities after BAQ
+} mplp_baqent_t;
+
+#define MPLP_BAQENT_MEM(len) ((len) + sizeof(mplp_baqent_t) + 16) // 16 for the hash bucket
+
+typedef struct {
+    size_t max_mem, mem;
+    int n, m, head;         // ring of cached results, oldest at head
+    mplp_baqent_t *ent;
+    khash_t(baq) *hash;     // virtual offset -> index in ent
+} mplp_baqcache_t;
+
+static mplp_baqcache_t *mplp_baqcache_init(size_t max_mem)
+{
+    mplp_baqcache_t *bc = calloc(1, sizeof(mplp_baqcache_t));
+    bc->max_mem = max_mem;
+    bc->m = 1024;
+    bc->ent = calloc(bc->m, sizeof(mplp_baqent_t));
+    bc->hash = kh_init(baq);
+    return bc;
+}
+
+static void mplp_baqcache_destroy(mplp_baqcache_t *bc)
+{
+    int i;
+    if (!bc) return;
+    for (i = 0; i < bc->n; ++i) free(bc->ent[(bc->head + i) % bc->m].qual);
+    free(bc->ent);
+    kh_destroy(baq, bc->hash);
+    free(bc);
+}
+
+/*
+ * Copies the cached qualities of the record ending at voff into qual.
+ * Returns 1 on a hit, 0 if BAQ has to be computed.
+ */
+static int mplp_baqcache_get(mplp_baqcache_t *bc, uint64_t voff, uint8_t *qual, int len)
+{
+    khint_t k = kh_get(baq, bc->hash, voff);
+    if (k == kh_end(bc->hash) || bc->ent[kh_val(bc->hash, k)].len != len) return 0;
+    memcpy(qual, bc->ent[kh_val(bc->hash, k)].qual, len);
+    return 1;
+}
+
+/*
+ * Keeps the qualities of the record ending at voff.  Returns the number of
+ * older results evicted to make room.
+ */
+static int mplp_baqcache_put(mplp_baqcache_t *bc, uint64_t voff, const uint8_t *qual, int len)
+{
+    mplp_baqent_t *e;
+    khint_t k;
+    int ret, n_evict = 0;
+    size_t mem = MPLP_BAQENT_MEM(len);
+
+    if (mem > bc->max_mem || kh_get(baq, bc->hash, voff) != kh_end(bc->hash)) return 0;
+    while (bc->n && bc->mem + mem > bc->max_mem) {
+        e = &bc->ent[bc->head];
+        kh_del(baq, bc->hash, kh_get(baq, bc->hash, e->voff));
+        bc->mem -= MPLP_BAQENT_MEM(e->len);
+        free(e->qual);
+        bc->head = (bc->head + 1) % bc->m;
+        --bc->n, ++n_evict;
+    }
+    if (bc->n == bc->m) { // grow the ring, oldest entry first
+        int i;
+        mplp_baqent_t *ent = malloc(2 * bc->m * sizeof(mplp_baqent_t));
+        for (i = 0; i < bc->n; ++i) {
+            ent[i] = bc->ent[(bc->head + i) % bc->m];
+            kh_val(bc->hash, kh_get(baq, bc->hash, ent[i].voff)) = i;
+        }
+        free(bc->ent);
+        bc->ent = ent, bc->m *= 2, bc->head = 0;
+    }
+    e = &bc->ent[(bc->head + bc->n) % bc->m];
+    e->voff = voff;
+    e->len = len;
+    e->qual = malloc(len);
+    memcpy(e->qual, qual, len);
+    k = kh_put(baq, bc->hash, voff, &ret);
+    kh_val(bc->hash, k) = (bc->head + bc->n++) % bc->m;
+    bc->mem += mem;
+    return n_evict;
+}
+
+/*
+ * Inflated record cache.  Region iterators of a BAM input fetched one after
+ * another often start in data the previous region has already read and
+ * inflated.  Every record a region's iterator reads is kept, keyed by the
+ * virtual offset where it starts, with the offset of the record after it,
+ * so that a later iterator that starts at or runs into a cached record
+ * takes it, and the records chained after it, from memory instead of
+ * seeking and inflating again.  Records are kept as they were read, before
+ * mplp_func() changes them.  Entries are evicted oldest first once the
+ * cache holds more than max_mem bytes.  It is set up by --bamcachesize and
+ * sits above htslib: mplp_itr_next() walks the chunks of an hts_itr_t
+ * itself, using only the index and BGZF calls htslib exports.
+ */
+KHASH_MAP_INIT_INT64(rec, int)
+
+typedef struct {
+    uint64_t voff, next;    // virtual offsets of the record and the one after it
+    bam1_t *b;
+} mplp_recent_t;
+
+#define MPLP_RECENT_MEM(b) ((b)->l_data + sizeof(bam1_t) + sizeof(mplp_recent_t) + 16) // 16 for the hash bucket
+
+typedef struct {
+    size_t max_mem, mem;
+    int n, m, head;         // ring of cached records, oldest at head
+    mplp_recent_t *ent;
+    khash_t(rec) *hash;     // virtual offset -> index in ent
+} mplp_reccache_t;
+
+static mplp_reccache_t *mplp_reccache_init(size_t max_mem)
+{
+    mplp_reccache_t *rc = calloc(1, sizeof(mplp_reccache_t));
+    rc->max_mem = max_mem;
+    rc->m = 1024;
+    rc->ent = calloc(rc->m, sizeof(mplp_recent_t));
+    rc->hash = kh_init(rec);
+    return rc;
+}
+
+static void mplp_reccache_destroy(mplp_reccache_t *rc)
+{
+    int i;
+    if (!rc) return;
+    for (i = 0; i < rc->n; ++i) bam_destroy1(rc->ent[(rc->head + i) % rc->m].b);
+    free(rc->ent);
+    kh_destroy(rec, rc->hash);
+    free(rc);
+}
+
+/*
+ * Copies the record starting at voff into b and sets *next to the offset
+ * of the record after it.  Returns 1 on a hit, 0 if it has to be read.
+ */
+static int mplp_reccache_get(mplp_reccache_t *rc, uint64_t voff, bam1_t *b, uint64_t *next)
+{
+    khint_t k = kh_get(rec, rc->hash, voff);
+    mplp_recent_t *e;
+    if (k == kh_end(rc->hash)) return 0;
+    e = &rc->ent[kh_val(rc->hash, k)];
+    bam_copy1(b, e->b);
+    *next = e->next;
+    return 1;
+}
+
+/*
+ * Keeps a copy of record b, which starts at voff and ends at next.  Returns
+ * the number of older records evicted to make room.
+ */
+static int mplp_reccache_put(mplp_reccache_t *rc, uint64_t voff, uint64_t next, const bam1_t *b)
+{
+    mplp_recent_t *e;
+    khint_t k;
+    int ret, n_evict = 0;
+    size_t mem = MPLP_RECENT_MEM(b);
+
+    if (mem > rc->max_mem || kh_get(rec, rc->hash, voff) != kh_end(rc->hash)) return 0;
+    while (rc->n && rc->mem + mem > rc->max_mem) {
+        e = &rc->ent[rc->head];
+        kh_del(rec, rc->hash, kh_get(rec, rc->hash, e->voff));
+        rc->mem -= MPLP_RECENT_MEM(e->b);
+        bam_destroy1(e->b);
+        rc->head = (rc->head + 1) % rc->m;
+        --rc->n, ++n_evict;
+    }
+    if (rc->n == rc->m) { // grow the ring, oldest entry first
+        int i;
+        mplp_recent_t *ent = malloc(2 * rc->m * sizeof(mplp_recent_t));
+        for (i = 0; i < rc->n; ++i) {
+            ent[i] = rc->ent[(rc->head + i) % rc->m];
+            kh_val(rc->hash, kh_get(rec, rc->hash, ent[i].voff)) = i;
+        }
+        free(rc->ent);
+        rc->ent = ent, rc->m *= 2, rc->head = 0;
+    }
+    e = &rc->ent[(rc->head + rc->n) % rc->m];
+    e->voff = voff;
+    e->next = next;
+    e->b = bam_dup1(b);
+    k = kh_put(rec, rc->hash, voff, &ret);
+    kh_val(rc->hash, k) = (rc->head + rc->n++) % rc->m;
+    rc->mem += mem;
+    return n_evict;
+}
+
+/*
+ * Profiling counters for --profile.  Each run (and worker thread) counts
+ * into its own mplp_prof_t, which is written out and added to the total
+ * after every region.
+ */
+enum { MPLP_SKIP_UNMAPPED, MPLP_SKIP_INCL_FLAGS, MPLP_SKIP_EXCL_FLAGS, MPLP_SKIP_BED, MPLP_SKIP_RG,
+       MPLP_SKIP_CAPQ, MPLP_SKIP_MIN_MQ, MPLP_SKIP_ORPHAN, MPLP_SKIP_N };
+static const char *mplp_skip_name[MPLP_SKIP_N] = { "unmapped", "incl_flags", "excl_flags", "bed", "read_group",
+       "adjust_mq", "min_mq", "orphan" };
+
+enum { MPLP_TIME_INDEX, MPLP_TIME_READ, MPLP_TIME_BAQ, MPLP_TIME_CALL, MPLP_TIME_INDEL, MPLP_TIME_OUTPUT, MPLP_TIME_N };
+static const char *mplp_time_name[MPLP_TIME_N] = { "index", "read", "baq", "call", "indel", "output" };
+
+typedef struct {
+    uint64_t n_fetched, n_used, n_skip[MPLP_SKIP_N];    // reads
+    uint64_t n_baq, n_baq_cached;   // reads given BAQ, and of those taken from the BAQ cache
+    uint64_t n_baq_evicted;         // results evicted from the BAQ cache
+    uint64_t baq_mem;               // bytes the BAQ caches held after the region; the most of any region in a total
+    uint64_t n_rec_hit, n_rec_miss, n_rec_evicted; // records taken from the record cache, read, and evicted from it
+    uint64_t rec_mem;               // bytes the record caches held after the region; the most of any region in a total
+    uint64_t n_visited, n_outside, n_filtered, n_emitted; // positions
+    uint64_t n_indel_sub;           // positions subsampled for indel calling
+    uint64_t ns[MPLP_TIME_N];
+} mplp_prof_t;
+
+static inline uint64_t mplp_clock(const mplp_prof_t *prof)
+{
+    struct timespec ts;
+    if (!prof) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// charges the time since *t to what and restarts *t
+static inline void mplp_prof_time(mplp_prof_t *prof, int what, uint64_t *t)
+{
+    uint64_t now;
+    if (!prof) return;
+    now = mplp_clock(prof);
+    prof->ns[what] += now - *t;
+    *t = now;
+}
+
+static void mplp_prof_add(mplp_prof_t *sum, const mplp_prof_t *p)
+{
+    int i;
+    sum->n_fetched += p->n_fetched, sum->n_used += p->n_used;
+    for (i = 0; i < MPLP_SKIP_N; ++i) sum->n_skip[i] += p->n_skip[i];
+    sum->n_baq += p->n_baq, sum->n_baq_cached += p->n_baq_cached;
+    sum->n_baq_evicted += p->n_baq_evicted;
+    if (p->baq_mem > sum->baq_mem) sum->baq_mem = p->baq_mem;
+    sum->n_rec_hit += p->n_rec_hit, sum->n_rec_miss += p->n_rec_miss;
+    sum->n_rec_evicted += p->n_rec_evicted;
+    if (p->rec_mem > sum->rec_mem) sum->rec_mem = p->rec_mem;
+    sum->n_visited += p->n_visited, sum->n_outside += p->n_outside;
+    sum->n_filtered += p->n_filtered, sum->n_emitted += p->n_emitted;
+    sum->n_indel_sub += p->n_indel_sub;
+    for (i = 0; i < MPLP_TIME_N; ++i) sum->ns[i] += p->ns[i];
+}
+
+static void mplp_prof_print(FILE *fp, const mplp_prof_t *p)
+{
+    int i;
+    fprintf(fp, "\"reads\":{\"fetched\":%llu,\"used\":%llu,\"skipped\":{",
+            (unsigned long long)p->n_fetched, (unsigned long long)p->n_used);
+    for (i = 0; i < MPLP_SKIP_N; ++i)
+        fprintf(fp, "%s\"%s\":%llu", i? "," : "", mplp_skip_name[i], (unsigned long long)p->n_skip[i]);
+    fprintf(fp, "},\"baq\":{\"applied\":%llu,\"cached\":%llu,\"evicted\":%llu,\"cache_bytes\":%llu},",
+            (unsigned long long)p->n_baq, (unsigned long long)p->n_baq_cached,
+            (unsigned long long)p->n_baq_evicted, (unsigned long long)p->baq_mem);
+    fprintf(fp, "\"record_cache\":{\"hits\":%llu,\"misses\":%llu,\"evicted\":%llu,\"cache_bytes\":%llu}},\"positions\":{",
+            (unsigned long long)p->n_rec_hit, (unsigned long long)p->n_rec_miss,
+            (unsigned long long)p->n_rec_evicted, (unsigned long long)p->rec_mem);
+    fprintf(fp, "\"visited\":%llu,\"outside_region\":%llu,\"filtered\":%llu,\"emitted\":%llu,\"indel_subsampled\":%llu},\"seconds\":{",
+            (unsigned long long)p->n_visited, (unsigned long long)p->n_outside,
+            (unsigned long long)p->n_filtered, (unsigned long long)p->n_emitted,
+            (unsigned long long)p->n_indel_sub);
+    for (i = 0; i < MPLP_TIME_N; ++i)
+        fprintf(fp, "%s\"%s\":%.6f", i? "," : "", mplp_time_name[i], p->ns[i] * 1e-9);
+    fputc('}', fp);
+}
+
 // mar4: here is where we would define Chris's new structs/typedef:
 // mar4: mplp_filecache_t
 
@@ -133,12 +416,139 @@ typedef struct {
   hts_idx_t *idx;  // mar4: this was bam_index_t in 0.1.19
 } mplp_filecache_t;
 
+/*
+ * Reference sequence cache.  Instead of loading whole contigs, a window of
+ * the requested interval plus a margin is fetched, and one window is kept
+ * per contig.  Windows are evicted in least-recently-used order once the
+ * cache holds more than max_mem bytes; the window in use is always kept.
+ * Bases outside the window read as NUL, just as past the end of a contig,
+ * so the margin must cover whatever BAQ and indel calling look at around a
+ * read or a column.
+ */
+#define MPLP_REF_MARGIN 1000
+
+typedef struct {
+    int tid, beg, end;  // bases [beg,end) of contig tid
+    int at_end;         // the window reaches the end of the contig
+    char *seq;          // NUL, bases beg..end-1, NUL
+    uint64_t used;      // cache clock at the last access
+} mplp_ref_t;
+
+typedef struct {
+    faidx_t *fai;
+    bam_hdr_t *h;
+    int margin;         // bases fetched either side of a request; <0 for whole contigs
+    int max_span;       // longest read interval requested so far
+    size_t max_mem, mem;
+    int n, m;
+    mplp_ref_t *ref;
+    uint64_t clock;
+} mplp_refcache_t;
+
+static mplp_refcache_t *mplp_refcache_init(faidx_t *fai, bam_hdr_t *h, int margin, size_t max_mem)
+{
+    mplp_refcache_t *rc = calloc(1, sizeof(mplp_refcache_t));
+    rc->fai = fai;
+    rc->h = h;
+    rc->margin = margin;
+    rc->max_mem = max_mem;
+    return rc;
+}
+
+static void mplp_refcache_destroy(mplp_refcache_t *rc)
+{
+    int i;
+    if (!rc) return;
+    for (i = 0; i < rc->n; ++i) free(rc->ref[i].seq);
+    free(rc->ref);
+    free(rc);
+}
+
+/*
+ * Returns the reference of contig tid, indexed by 0-based contig position and
+ * valid at least over [beg,end) (clipped to the contig).  *len is set to the
+ * position after the last valid base.  The pointer is only valid until the
+ * next call.  Returns NULL if the contig is absent from the reference.
+ */
+static char *mplp_refcache_get(mplp_refcache_t *rc, int tid, int beg, int end, int *len)
+{
+    mplp_ref_t *r = NULL;
+    int i, wbeg, wend, fbeg, l;
+    char *seq;
+
+    if (beg < 0) beg = 0;
+    for (i = 0; i < rc->n; ++i)
+        if (rc->ref[i].tid == tid) { r = &rc->ref[i]; break; }
+    if (r && r->seq && beg >= r->beg && (end <= r->end || r->at_end)) {
+        r->used = ++rc->clock;
+        *len = r->end;
+        return r->seq + 1 - r->beg;
+    }
+
+    // fetch a new window
+    if (rc->margin < 0) {
+        wbeg = 0, wend = rc->h->target_len[tid];
+    } else {
+        int pad = rc->margin > rc->max_span? rc->margin : rc->max_span;
+        wbeg = beg > pad? beg - pad : 0;
+        wend = end < (int)rc->h->target_len[tid] - pad? end + pad : rc->h->target_len[tid];
+    }
+    if (wend <= wbeg) wend = wbeg + 1;
+    // fetch one base more on the left, to be overwritten by the leading NUL
+    fbeg = wbeg? wbeg - 1 : 0;
+    seq = faidx_fetch_seq(rc->fai, rc->h->target_name[tid], fbeg, wend - 1, &l);
+    if (!seq) { *len = 0; return NULL; }
+    if (wbeg == 0) {
+        seq = realloc(seq, l + 2);
+        memmove(seq + 1, seq, l + 1);
+    } else --l;
+    seq[0] = 0;
+
+    if (!r) {
+        if (rc->n == rc->m) {
+            rc->m = rc->m? rc->m<<1 : 4;
+            rc->ref = realloc(rc->ref, rc->m * sizeof(mplp_ref_t));
+        }
+        r = &rc->ref[rc->n++];
+        memset(r, 0, sizeof(mplp_ref_t));
+        r->tid = tid;
+    }
+    if (r->seq) rc->mem -= r->end - r->beg + 2;
+    free(r->seq);
+    r->seq = seq;
+    r->beg = wbeg;
+    r->end = wbeg + l;
+    r->at_end = r->end < wend || r->end >= (int)rc->h->target_len[tid];
+    r->used = ++rc->clock;
+    rc->mem += l + 2;
+
+    // evict the least recently used windows, but never the current one
+    while (rc->max_mem && rc->mem > rc->max_mem && rc->n > 1) {
+        int lru = -1;
+        for (i = 0; i < rc->n; ++i)
+            if (&rc->ref[i] != r && (lru < 0 || rc->ref[i].used < rc->ref[lru].used)) lru = i;
+        rc->mem -= rc->ref[lru].end - rc->ref[lru].beg + 2;
+        free(rc->ref[lru].seq);
+        if (r == &rc->ref[rc->n - 1]) r = &rc->ref[lru];
+        rc->ref[lru] = rc->ref[--rc->n];
+    }
+    *len = r->end;
+    return r->seq + 1 - r->beg;
+}
+
 
 typedef struct {
     int min_mq, flag, min_baseQ, capQ_thres, max_depth, max_indel_depth, fmt_flag;
     int rflag_require, rflag_filter;
     int openQ, extQ, tandemQ, min_support; // for indels
     int bamcachesizemb;   // mar4: 
+    int refcachesizemb;   // memory limit of the reference cache, per thread
+    int baqcachesizemb;   // memory limit of the BAQ cache, per input file and thread; 0 for none
+    int n_threads;        // worker threads piling up regions in parallel
+    int plan;             // MPLP_PLAN_*: how a list of regions is read
+    int region_gap;       // -l regions this close share one iterator
+    uint32_t indel_seed;  // --indel-seed: picks the reads kept by --subsample-indels
+    FILE *profile_fp;     // --profile: JSON counters per region, NULL if off
     int regbegin, regend; // mar4: beginning and end of region
     double min_frac; // for indels
     char *reg, *pl_list, *fai_fname, *output_fname;
@@ -153,63 +563,153 @@ typedef struct {
     samFile *fp;
     hts_itr_t *iter;
     bam_hdr_t *h;
-    int ref_id;
-    char *ref;
+    int ref_id;     // contig whose reference may be used for BAQ and -C
+    mplp_refcache_t *refcache;
+    mplp_baqcache_t *baqcache; // BAQ results of reads read through fp, NULL if off
+    mplp_reccache_t *reccache; // records read through fp by iterators, NULL if off
+    int itr_i, itr_done;    // chunk of iter being read, as hts_itr_t.i and .finished, with reccache
+    uint64_t itr_off;       // virtual offset of the next record of iter, or 0 before the first
+    kpa_buf_t *baq;     // BAQ workspace, shared by the files of a run
+    mplp_prof_t *prof;
     const mplp_conf_t *conf;
+    const bam_sample_t *sm; // if set, the sample of each read is kept with it (MPLP_SMPL)
+    const void *rghash;     // read groups of the -P platforms, NULL for all
+    const char *fn;
+    kstring_t buf;
 } mplp_aux_t;
 
+/*
+ * Reads of a column grouped by sample.  plp[i] is either the pileup of the
+ * input file that holds exactly the reads of sample i, or buf[i].
+ */
 typedef struct {
     int n;
     int *n_plp, *m_plp;
-    bam_pileup1_t **plp;
+    bam_pileup1_t **plp, **buf;
+    int *src;   // scratch of group_smpl()
 } mplp_pileup_t;
 
-// mar4: add in Chris's profiling variables:
-static int cw_count1 = 0;
-static int cw_bam_iter_read_counter = 0;
-static int cw_out_of_region_count = 0;
+/*
+ * With -g/-v, mplp_func() resolves the sample of a read once, when it is
+ * fetched, together with whether -P excludes the read from indel calling,
+ * and appends both to the record as an aux field of its own, MPLP_AUX.  The pileup copies the record's data, so the field is read back
+ * from the last bytes of the copy without searching the aux fields.  The
+ * core fields cannot hold it: bam_plp_push() rewrites bam1_t.id, and the
+ * others belong to the record.
+ */
+#define MPLP_AUX     "zs"
+#define MPLP_AUX_LEN 7  // tag, type and int32 value
 
+static inline int mplp_aux_val(const bam1_t *b)
+{
+    const uint8_t *s = b->data + b->l_data - MPLP_AUX_LEN;
+    assert(b->l_data >= MPLP_AUX_LEN && s[0] == MPLP_AUX[0] && s[1] == MPLP_AUX[1] && s[2] == 'i');
+    return bam_aux2i(s + 2);
+}
+
+#define MPLP_SMPL(b)    (mplp_aux_val(b) >> 1)
+#define MPLP_PL_SKIP(b) (mplp_aux_val(b) & 1)
+
+/*
+ * Returns the sample of read b of input file fn; exits if its read group is
+ * absent from the header.
+ */
+static int mplp_smpl_id(const bam_sample_t *sm, const char *fn, const bam1_t *b, kstring_t *buf, int ignore_rg)
+{
+    uint8_t *q;
+    int id = -1;
+    q = ignore_rg? 0 : bam_aux_get(b, "RG");
+    if (q) id = bam_smpl_rg2smid(sm, fn, (char*)q+1, buf);
+    if (id < 0) id = bam_smpl_rg2smid(sm, fn, 0, buf);
+    if (id < 0 || id >= sm->n) {
+        assert(q); // otherwise a bug
+        fprintf(stderr, "[%s] Read group %s used in file %s but absent from the header or an alignment missing read group.\n", __func__, (char*)q+1, fn);
+        exit(1);
+    }
+    return id;
+}
+
+extern int bcf_call_rg_filtered(const void *rghash, const bam1_t *b);
+
+/*
+ * Reads the next record of ma->iter through ma->reccache, as sam_itr_next()
+ * would read it from the file.  The chunks of the iterator are walked as
+ * hts_itr_next() walks them, but the file is only sought and read where
+ * the next record is not cached.
+ */
+static int mplp_itr_next(mplp_aux_t *ma, bam1_t *b)
+{
+    hts_itr_t *iter = ma->iter;
+    BGZF *fp = ma->fp->fp.bgzf;
+    mplp_prof_t *prof = ma->prof;
+    int ret = -1;
+
+    if (ma->itr_done || iter->n_off == 0) return -1;
+    for (;;) {
+        uint64_t off;
+        if (ma->itr_off == 0 || ma->itr_off >= iter->off[ma->itr_i].v) { // on to the next chunk
+            if (ma->itr_i == iter->n_off - 1) { ret = -1; break; }
+            if (ma->itr_i < 0 || iter->off[ma->itr_i].v != iter->off[ma->itr_i+1].u)
+                ma->itr_off = iter->off[ma->itr_i+1].u;
+            ++ma->itr_i;
+        }
+        off = ma->itr_off;
+        if (mplp_reccache_get(ma->reccache, off, b, &ma->itr_off)) {
+            ret = 0;
+            if (prof) ++prof->n_rec_hit;
+        } else {
+            int n_evict;
+            if (bgzf_tell(fp) != (int64_t)off && bgzf_seek(fp, off, SEEK_SET) < 0) { ret = -2; break; }
+            if ((ret = bam_read1(fp, b)) < 0) break;
+            ma->itr_off = bgzf_tell(fp);
+            n_evict = mplp_reccache_put(ma->reccache, off, ma->itr_off, b);
+            if (prof) ++prof->n_rec_miss, prof->n_rec_evicted += n_evict;
+        }
+        if (b->core.tid != iter->tid || b->core.pos >= iter->end) { ret = -1; break; } // past the region
+        if (bam_endpos(b) > iter->beg) return ret;
+    }
+    ma->itr_done = 1;
+    return ret;
+}
 
 static int mplp_func(void *data, bam1_t *b)
 {
-    cw_count1 += 1;
     extern int bam_realn(bam1_t *b, const char *ref);
-    extern int bam_prob_realn_core(bam1_t *b, const char *ref, int);
+    extern int bam_prob_realn_buf(kpa_buf_t *buf, bam1_t *b, const char *ref, int flag);
     extern int bam_cap_mapQ(bam1_t *b, char *ref, int thres);
     mplp_aux_t *ma = (mplp_aux_t*)data;
+    mplp_prof_t *prof = ma->prof;
     int ret, skip = 0;
+    uint64_t t = mplp_clock(prof);
     do {
-        int has_ref;
-        // mar4: commenting the following line out, and putting in some of Chris's profiling,
-        // mar4: but making changes: bam_iter_read -> sam_iter_next, and 
-        // mar4: bam_read1 -> sam_read1
-        //ret = ma->iter? sam_itr_next(ma->fp, ma->iter, b) : sam_read1(ma->fp, ma->h, b);
-        if (ma->iter) {
-          ret = sam_itr_next(ma->fp,ma->iter,b);
-          cw_bam_iter_read_counter += 1;
-        } else {
-          //ret = bam_read1(ma->fp,b);
-          ret = sam_read1(ma->fp,ma->h,b);
-        }
-        // the following lines are back to non-Chris-mod code:
-
+        int has_ref, ref_len;
+        char *ref;
+        if (ma->iter && ma->reccache) ret = mplp_itr_next(ma, b);
+        else if (ma->iter) ret = sam_itr_next(ma->fp, ma->iter, b);
+        else ret = sam_read1(ma->fp, ma->h, b);
+        mplp_prof_time(prof, MPLP_TIME_READ, &t);
         if (ret < 0) break;
+        if (prof) ++prof->n_fetched;
         // The 'B' cigar operation is not part of the specification, considering as obsolete.
         //  bam_remove_B(b);
         if (b->core.tid < 0 || (b->core.flag&BAM_FUNMAP)) { // exclude unmapped reads
-            skip = 1;
-            continue;
+            skip = 1 + MPLP_SKIP_UNMAPPED;
+            goto skipped;
         }
-        if (ma->conf->rflag_require && !(ma->conf->rflag_require&b->core.flag)) { skip = 1; continue; }
-        if (ma->conf->rflag_filter && ma->conf->rflag_filter&b->core.flag) { skip = 1; continue; }
+        if (ma->conf->rflag_require && !(ma->conf->rflag_require&b->core.flag)) { skip = 1 + MPLP_SKIP_INCL_FLAGS; goto skipped; }
+        if (ma->conf->rflag_filter && ma->conf->rflag_filter&b->core.flag) { skip = 1 + MPLP_SKIP_EXCL_FLAGS; goto skipped; }
         if (ma->conf->bed) { // test overlap
-            skip = !bed_overlap(ma->conf->bed, ma->h->target_name[b->core.tid], b->core.pos, bam_endpos(b));
-            if (skip) continue;
+            if (!bed_overlap(ma->conf->bed, ma->h->target_name[b->core.tid], b->core.pos, bam_endpos(b))) {
+                skip = 1 + MPLP_SKIP_BED;
+                goto skipped;
+            }
         }
         if (ma->conf->rghash) { // exclude read groups
             uint8_t *rg = bam_aux_get(b, "RG");
-            skip = (rg && khash_str2int_get(ma->conf->rghash, (const char*)(rg+1), NULL)==0);
-            if (skip) continue;
+            if (rg && khash_str2int_get(ma->conf->rghash, (const char*)(rg+1), NULL)==0) {
+                skip = 1 + MPLP_SKIP_RG;
+                goto skipped;
+            }
         }
         if (ma->conf->flag & MPLP_ILLUMINA13) {
             int i;
@@ -217,224 +717,461 @@ static int mplp_func(void *data, bam1_t *b)
             for (i = 0; i < b->core.l_qseq; ++i)
                 qual[i] = qual[i] > 31? qual[i] - 31 : 0;
         }
-        has_ref = (ma->ref && ma->ref_id == b->core.tid)? 1 : 0;
+        ref = 0;
+        if (ma->refcache && ma->ref_id == b->core.tid) {
+            // soft clips and the BAQ band may reach past the aligned bases
+            mplp_refcache_t *rc = ma->refcache;
+            int pad = b->core.l_qseq + 8, beg = b->core.pos - pad, end = bam_endpos(b) + pad;
+            if (end - beg > rc->max_span) rc->max_span = end - beg;
+            ref = mplp_refcache_get(rc, b->core.tid, beg, end, &ref_len);
+        }
+        has_ref = ref? 1 : 0;
         skip = 0;
-        if (has_ref && (ma->conf->flag&MPLP_REALN)) bam_prob_realn_core(b, ma->ref, (ma->conf->flag & MPLP_REDO_BAQ)? 7 : 3);
+        if (has_ref && (ma->conf->flag&MPLP_REALN)) {
+            uint64_t voff = !ma->baqcache? 0 : ma->reccache? ma->itr_off : bgzf_tell(ma->fp->fp.bgzf);
+            if (!ma->baqcache || !mplp_baqcache_get(ma->baqcache, voff, bam_get_qual(b), b->core.l_qseq)) {
+                bam_prob_realn_buf(ma->baq, b, ref, (ma->conf->flag & MPLP_REDO_BAQ)? 7 : 3);
+                if (ma->baqcache) {
+                    int n_evict = mplp_baqcache_put(ma->baqcache, voff, bam_get_qual(b), b->core.l_qseq);
+                    if (prof) prof->n_baq_evicted += n_evict;
+                }
+            } else if (prof) ++prof->n_baq_cached;
+            if (prof) ++prof->n_baq;
+        }
         if (has_ref && ma->conf->capQ_thres > 10) {
-            int q = bam_cap_mapQ(b, ma->ref, ma->conf->capQ_thres);
-            if (q < 0) skip = 1;
+            int q = bam_cap_mapQ(b, ref, ma->conf->capQ_thres);
+            if (q < 0) skip = 1 + MPLP_SKIP_CAPQ;
             else if (b->core.qual > q) b->core.qual = q;
         }
-        if (b->core.qual < ma->conf->min_mq) skip = 1;
-        else if ((ma->conf->flag&MPLP_NO_ORPHAN) && (b->core.flag&BAM_FPAIRED) && !(b->core.flag&BAM_FPROPER_PAIR)) skip = 1;
+        mplp_prof_time(prof, MPLP_TIME_BAQ, &t);
+        if (skip) goto skipped;
+        if (b->core.qual < ma->conf->min_mq) skip = 1 + MPLP_SKIP_MIN_MQ;
+        else if ((ma->conf->flag&MPLP_NO_ORPHAN) && (b->core.flag&BAM_FPAIRED) && !(b->core.flag&BAM_FPROPER_PAIR)) skip = 1 + MPLP_SKIP_ORPHAN;
+    skipped:
+        if (prof && skip) ++prof->n_skip[skip - 1];
     } while (skip);
+    if (ret >= 0 && ma->sm) {
+        int32_t val = mplp_smpl_id(ma->sm, ma->fn, b, &ma->buf, ma->conf->flag & MPLP_IGNORE_RG) << 1;
+        if (ma->rghash && bcf_call_rg_filtered(ma->rghash, b)) val |= 1;
+        bam_aux_append(b, MPLP_AUX, 'i', 4, (uint8_t*)&val);
+    }
+    if (prof && ret >= 0) ++prof->n_used;
     return ret;
 }
 
-static void group_smpl(mplp_pileup_t *m, bam_sample_t *sm, kstring_t *buf,
-                       int n, char *const*fn, int *n_plp, const bam_pileup1_t **plp, int ignore_rg)
+/*
+ * Groups the reads of a column by sample, from the sample mplp_func() kept
+ * with each read.  A sample whose reads are all the reads of one input file
+ * uses that file's pileup in place, which is the common case of one sample
+ * per file; the reads of other samples are copied.  The grouped reads must
+ * not be written to, as the pileup belongs to htslib.
+ */
+static void group_smpl(mplp_pileup_t *m, int n, int *n_plp, const bam_pileup1_t **plp)
 {
-    int i, j;
+    int i, j, s, *src = m->src, n_copy = 0;
     memset(m->n_plp, 0, m->n * sizeof(int));
+    for (s = 0; s < m->n; ++s) src[s] = -1;
+    // count the reads of each sample and the file they come from; -2 for several
     for (i = 0; i < n; ++i) {
         for (j = 0; j < n_plp[i]; ++j) {
-            const bam_pileup1_t *p = plp[i] + j;
-            uint8_t *q;
-            int id = -1;
-            q = ignore_rg? 0 : bam_aux_get(p->b, "RG");
-            if (q) id = bam_smpl_rg2smid(sm, fn[i], (char*)q+1, buf);
-            if (id < 0) id = bam_smpl_rg2smid(sm, fn[i], 0, buf);
-            if (id < 0 || id >= m->n) {
-                assert(q); // otherwise a bug
-                fprintf(stderr, "[%s] Read group %s used in file %s but absent from the header or an alignment missing read group.\n", __func__, (char*)q+1, fn[i]);
-                exit(1);
-            }
-            if (m->n_plp[id] == m->m_plp[id]) {
-                m->m_plp[id] = m->m_plp[id]? m->m_plp[id]<<1 : 8;
-                m->plp[id] = realloc(m->plp[id], sizeof(bam_pileup1_t) * m->m_plp[id]);
-            }
-            m->plp[id][m->n_plp[id]++] = *p;
+            int id = MPLP_SMPL(plp[i][j].b);
+            ++m->n_plp[id];
+            src[id] = src[id] == -1 || src[id] == i? i : -2;
         }
     }
+    for (s = 0; s < m->n; ++s) {
+        if (src[s] >= 0 && m->n_plp[s] == n_plp[src[s]]) {
+            m->plp[s] = (bam_pileup1_t*)plp[src[s]];
+            src[s] = -1;
+            continue;
+        }
+        if (m->n_plp[s] > m->m_plp[s]) {
+            m->m_plp[s] = m->n_plp[s];
+            kroundup32(m->m_plp[s]);
+            m->buf[s] = realloc(m->buf[s], sizeof(bam_pileup1_t) * m->m_plp[s]);
+        }
+        m->plp[s] = m->buf[s];
+        if (m->n_plp[s]) src[s] = 0, ++n_copy; // src[] now counts the reads copied
+        else src[s] = -1;
+    }
+    if (n_copy == 0) return;
+    for (i = 0; i < n; ++i) {
+        for (j = 0; j < n_plp[i]; ++j) {
+            int id = MPLP_SMPL(plp[i][j].b);
+            if (src[id] >= 0) m->buf[id][src[id]++] = plp[i][j];
+        }
+    }
+}
+
+static void mplp_pileup_init(mplp_pileup_t *m, int n)
+{
+    m->n = n;
+    m->n_plp = calloc(n, sizeof(int));
+    m->m_plp = calloc(n, sizeof(int));
+    m->plp = calloc(n, sizeof(bam_pileup1_t*));
+    m->buf = calloc(n, sizeof(bam_pileup1_t*));
+    m->src = calloc(n, sizeof(int));
+}
+
+static void mplp_pileup_destroy(mplp_pileup_t *m)
+{
+    int i;
+    for (i = 0; i < m->n; ++i) free(m->buf[i]);
+    free(m->plp); free(m->buf); free(m->n_plp); free(m->m_plp); free(m->src);
 }
 
+typedef struct mplp_region_t {
+    int tid, beg, end;  // 0-based, half-open; tid refers to the first file's header
+    // if n_sub > 0, only positions inside these sorted, disjoint regions are output
+    const struct mplp_region_t *sub;
+    int n_sub;
+} mplp_region_t;
+
 /*
- * Performs pileup
- * @param conf configuration for this pileup
- * @param n number of files specified in fn
- * @param fn filenames
+ * Output of one region piled up by a worker thread.  It is held back until
+ * the output of all regions before it has been written.
  */
-static int mpileup(mplp_conf_t *conf, int n, char **fn)
-{
-    extern void *bcf_call_add_rg(void *rghash, const char *hdtext, const char *list);
-    extern void bcf_call_del_rghash(void *rghash);
+typedef struct {
+    mplp_region_t reg;
+    int ret, done;
+    char *text;             // text pileup
+    size_t l_text;
+    bcf1_t **rec;           // VCF/BCF records
+    int n_rec, m_rec;
+    mplp_prof_t prof;       // --profile counters of this shard
+} mplp_shard_t;
+
+/*
+ * State shared by all regions of one mpileup run: the input files, sample
+ * table, read group hash, genotype likelihood machinery and the reference
+ * of the current contig.  It is built once by mplp_init_run() so that a long
+ * list of regions does not pay the set-up cost for each region.  Worker
+ * threads get a copy from mplp_init_worker() with their own file handles,
+ * reference and calling state; the headers, indices and sample table are
+ * shared with the main run.
+ */
+typedef struct {
+    int n;                  // number of input files
+    char **fn;
     mplp_aux_t **data;
-    int i, tid, pos, *n_plp, tid0 = -1, beg0 = 0, end0 = 1u<<29, ref_len, ref_tid = -1, max_depth, max_indel_depth;
+    bam_hdr_t *h;           // header of first file in input list
+    bam_sample_t *sm;
+    void *rghash;
+    kstring_t line, col[4]; // text pileup column and its per-sample fields
+    mplp_pileup_t gplp;
+    mplp_pileup_t iplp;     // copy of the reads of gplp for indel calling, subsampled with --subsample-indels
+    uint64_t *ikey;         // subsampling keys and picked reads of one sample
+    int m_ikey;
+    int *n_plp;
     const bam_pileup1_t **plp;
-    bam_mplp_t iter;
-    bam_hdr_t *h = NULL; /* header of first file in input list */
-    char *ref;
-    void *rghash = NULL;
-    FILE *pileup_fp = NULL;
-
-    bcf_callaux_t *bca = NULL;
-    bcf_callret1_t *bcr = NULL;
+    int max_depth, max_indel_depth;
+    int ref_tid;
+    int ref_margin;         // margin of the reference cache; <0 for whole contigs
+    mplp_refcache_t *refcache;
+    kpa_buf_t *baq;
+    faidx_t *fai;           // reference opened by a worker, NULL otherwise
+
+    FILE *pileup_fp;
+    htsFile *bcf_fp;
+    bcf_hdr_t *bcf_hdr;
+    bcf1_t *bcf_rec;
+    bcf_callaux_t *bca;
+    bcf_callret1_t *bcr;
     bcf_call_t bc;
-    htsFile *bcf_fp = NULL;
-    bcf_hdr_t *bcf_hdr = NULL;
+    mplp_shard_t *shard;    // if set, output goes here instead of the files
+    mplp_prof_t prof;       // counters of the current region
+    int n_profiled;         // regions written to the profile so far
+    int n_planned, n_block, n_stream; // --profile: regions, blocks and streamed blocks of the plan
+    int64_t plan_bytes;     // compressed bytes the plan expects to read
+} mplp_run_t;
 
-    bam_sample_t *sm = NULL;
-    kstring_t buf;
-    mplp_pileup_t gplp;
+/*
+ * Allocates the per-thread part of a run: pileup buffers, reference cache
+ * and the genotype likelihood machinery.  run->sm and run->ref_margin must
+ * be set.
+ */
+static void mplp_init_state(mplp_conf_t *conf, mplp_run_t *run, faidx_t *fai)
+{
+    int i;
+
+    run->plp = calloc(run->n, sizeof(bam_pileup1_t*));
+    run->n_plp = calloc(run->n, sizeof(int));
+    run->ref_tid = -1;
+    if (fai)
+        run->refcache = mplp_refcache_init(fai, run->h, run->ref_margin, (size_t)conf->refcachesizemb << 20);
+    run->baq = kpa_buf_init();
+    for (i = 0; i < run->n; ++i) {
+        run->data[i]->refcache = run->refcache;
+        run->data[i]->baq = run->baq;
+        run->data[i]->prof = conf->profile_fp? &run->prof : NULL;
+        if (conf->flag & MPLP_BCF) {
+            run->data[i]->sm = run->sm;
+            run->data[i]->rghash = run->rghash;
+            run->data[i]->fn = run->fn[i];
+        }
+    }
+
+    // allocate data storage proportionate to number of samples being studied sm->n
+    mplp_pileup_init(&run->gplp, run->sm->n);
+    mplp_pileup_init(&run->iplp, run->sm->n);
+    run->bcf_rec = bcf_init1();
+
+    if (conf->flag & MPLP_BCF)
+    {
+        bcf_callaux_t *bca;
+        bcf_call_t *bc = &run->bc;
+        int nsmpl = run->sm->n;
+
+        bca = run->bca = bcf_call_init(-1., conf->min_baseQ);
+        run->bcr = calloc(nsmpl, sizeof(bcf_callret1_t));
+        bca->rghash = run->rghash;
+        bca->openQ = conf->openQ, bca->extQ = conf->extQ, bca->tandemQ = conf->tandemQ;
+        bca->min_frac = conf->min_frac;
+        bca->min_support = conf->min_support;
+        bca->per_sample_flt = conf->flag & MPLP_PER_SAMPLE;
+
+        bc->n = nsmpl;
+        bc->PL = malloc(15 * nsmpl * sizeof(*bc->PL));
+        if (conf->fmt_flag)
+        {
+            assert( sizeof(float)==sizeof(int32_t) );
+            bc->DP4 = malloc(nsmpl * sizeof(int32_t) * 4);
+            bc->fmt_arr = malloc(nsmpl * sizeof(float)); // all fmt_flag fields
+            if ( conf->fmt_flag&(B2B_INFO_DPR|B2B_FMT_DPR) )
+            {
+                // first B2B_MAX_ALLELES fields for total numbers, the rest per-sample
+                bc->DPR = malloc((nsmpl+1)*B2B_MAX_ALLELES*sizeof(int32_t));
+                for (i=0; i<nsmpl; i++)
+                    run->bcr[i].DPR = bc->DPR + (i+1)*B2B_MAX_ALLELES;
+            }
+        }
+    }
+}
+
+static void mplp_destroy_state(mplp_run_t *run)
+{
+    int i;
+
+    free(run->bc.tmp.s);
+    bcf_destroy1(run->bcf_rec);
+    if (run->bca)
+    {
+        bcf_call_destroy(run->bca);
+        free(run->bc.PL);
+        free(run->bc.DP4);
+        free(run->bc.DPR);
+        free(run->bc.fmt_arr);
+        free(run->bcr);
+    }
+    free(run->line.s);
+    for (i = 0; i < 4; ++i) free(run->col[i].s);
+    mplp_pileup_destroy(&run->gplp);
+    mplp_pileup_destroy(&run->iplp);
+    free(run->ikey);
+    for (i = 0; i < run->n; ++i) {
+        if (run->data[i]->iter) hts_itr_destroy(run->data[i]->iter);
+        mplp_baqcache_destroy(run->data[i]->baqcache);
+        mplp_reccache_destroy(run->data[i]->reccache);
+        free(run->data[i]->buf.s);
+        free(run->data[i]);
+    }
+    mplp_refcache_destroy(run->refcache);
+    kpa_buf_destroy(run->baq);
+    free(run->data); free(run->plp); free(run->n_plp);
+}
+
+/*
+ * Opens an input file the way all handles of a run are opened.
+ */
+static samFile *mplp_open_input(mplp_conf_t *conf, const char *fn)
+{
+    samFile *fp = sam_open(fn, "rb");
+    if ( !fp ) {
+        fprintf(stderr, "[%s] failed to open %s: %s\n", __func__, fn, strerror(errno));
+        exit(1);
+    }
+    hts_set_fai_filename(fp, conf->fai_fname);
+    return fp;
+}
+
+/*
+ * Returns a record cache of --bamcachesize MB for a BAM input read by
+ * regions, so that nearby regions do not read and inflate the same data
+ * twice, or NULL.  htslib's own BGZF cache is left off, so that the data is
+ * not held twice.
+ */
+static mplp_reccache_t *mplp_input_cache(mplp_conf_t *conf, samFile *fp, int use_index)
+{
+    if (!use_index || !conf->bamcachesizemb || hts_get_format(fp)->format != bam) return NULL;
+    return mplp_reccache_init((size_t)conf->bamcachesizemb << 20);
+}
 
-    memset(&gplp, 0, sizeof(mplp_pileup_t));
-    memset(&buf, 0, sizeof(kstring_t));
-    memset(&bc, 0, sizeof(bcf_call_t));
-    data = calloc(n, sizeof(mplp_aux_t*));
-    plp = calloc(n, sizeof(bam_pileup1_t*));
-    n_plp = calloc(n, sizeof(int));
-    sm = bam_smpl_init();
+/*
+ * Returns a BAQ cache for an input read by regions, if one is wanted.
+ */
+static mplp_baqcache_t *mplp_input_baqcache(mplp_conf_t *conf, samFile *fp, int use_index)
+{
+    if (!use_index || !conf->baqcachesizemb || !conf->fai || !(conf->flag & MPLP_REALN)
+        || hts_get_format(fp)->format != bam) return NULL;
+    return mplp_baqcache_init((size_t)conf->baqcachesizemb << 20);
+}
 
-    // mar4: some more of Chris's profiling variables:
-    cw_count1 = 0;
-    // cw_bam_read1_count = 0;
-    cw_bam_iter_read_counter = 0;
+/*
+ * Opens the input files, reads their headers and, if use_index is set,
+ * their indices.  The handles are kept in conf->filecache for the lifetime
+ * of the run.  ref_margin is the margin of the reference cache, or -1 to
+ * load whole contigs.
+ */
+static void mplp_init_run(mplp_conf_t *conf, int n, char **fn, int use_index, int ref_margin, mplp_run_t *run)
+{
+    extern void *bcf_call_add_rg(void *rghash, const char *hdtext, const char *list);
+    int i;
 
     if (n == 0) {
         fprintf(stderr,"[%s] no input file/data given\n", __func__);
         exit(1);
     }
+    memset(run, 0, sizeof(mplp_run_t));
+    run->n = n;
+    run->fn = fn;
+    run->data = calloc(n, sizeof(mplp_aux_t*));
+    run->sm = bam_smpl_init();
+    conf->filecache = calloc(n, sizeof(mplp_filecache_t));
 
     // read the header of each file in the list and initialize data
     for (i = 0; i < n; ++i) {
-        bam_hdr_t *h_tmp;
-        data[i] = calloc(1, sizeof(mplp_aux_t));
-        // mar4: here is the place to put some of Chris's mods, the ones that start
-        // mar4: on line 270 in /workspace/cwakefield/ken/mod-samtools/bam_plcmd.c
-        //
-        // mar4: here is the 1.0 version:
-        //   data[i]->fp = sam_open(fn[i], "rb");  // mar4: <-- different in 1.0 vs 0.1.19
-        // mar4: here is the 0.1.19 version:
-        //    data[i]->fp = strcmp(fn[i], "-") == 0? bam_dopen(fileno(stdin), "r") : bam_open(fn[i], "r");
-        // mar4: adding in the file cachine lines:
-        if (conf->filecache && conf->filecache[i].fp != 0) {
-          data[i]->fp = conf->filecache[i].fp;
-        } else { // mar4: do the original thing
-          // mar4: this is the original line, as it would have been in 0.1.19....but things have
-          // mar4: changed a bit...so I think the correct line here is the second one down
-          // data[i]->fp = strcmp(fn[i],"-") == 0? bam_dopen(fileno(stdin),"r") : bam_open(fn[i], "r");        
-          // mar4: for some reason, compiler doesn't like: data[i]->fp = sam_open(fn[i],"rb"); because of 
-          // mar4: samtools_sam_open definition in bam.h...so changing to:
-           data[i]->fp = sam_open(fn[i],"rb"); // mar4: <-- back to original, w/o #incluce "bam.h"
-          if ( !data[i]->fp )
-          {
-             fprintf(stderr, "[%s] failed to open %s: %s\n", __func__, fn[i], strerror(errno));
-             exit(1);
-          }
-          if (conf->filecache && conf->bamcachesizemb)
-          {
-            conf->filecache[i].fp = data[i]->fp;
-            // mar4: cw comment: Set a BGZF cache
-            //fprintf(stderr, "Setting BGZF cache size to %d M\n", conf->bamcachesizemb);
-            //bgzf_set_cache_size(data[i]->fp, conf->bamcachesizemb * 1024 * 1024);
-            bgzf_set_cache_size(data[i]->fp->fp.bgzf, conf->bamcachesizemb * 1024 * 1024);
-          } else if (n == 1) { // mar4: cw comment: this doesn't seem to help when doing mpileup w/o bed regions
-            //fprintf(stderr, "Setting BGZF cache size to %d M\n", conf->bamcachesizemb);
-            //bgzf_set_cache_size(data[i]->fp, conf->bamcachesizemb * 1024 * 1024);
-            bgzf_set_cache_size(data[i]->fp->fp.bgzf, conf->bamcachesizemb * 1024 * 1024);
-          }
-        }
-    
-        // mar4: back to original code
-        hts_set_fai_filename(data[i]->fp, conf->fai_fname); // mar4: <-- new in 1.0
-        data[i]->conf = conf;
-        //h_tmp = sam_hdr_read(data[i]->fp);
-        //if ( !h_tmp ) {
-        //    fprintf(stderr,"[%s] fail to read the header of %s\n", __func__, fn[i]);
-        //    exit(1);
-       // }
-        // mar4: Chris's filecaching:
-        if (conf->filecache && conf->filecache[i].h != 0) {
-          h_tmp = conf->filecache[i].h;
-        } else {
-          //h_tmp = bam_header_read(data[i]->fp); // mar4: <-- for 0.1.19
-          h_tmp = sam_hdr_read(data[i]->fp);   // mar4: new 1.0 version
-          if ( !h_tmp) {
-            fprintf(stderr,"[%s] fail to read header of %s\n",__func__,fn[i]);
+        mplp_filecache_t *fc = &conf->filecache[i];
+        fc->fname = fn[i];
+        fc->fp = mplp_open_input(conf, fn[i]);
+        fc->h = sam_hdr_read(fc->fp);
+        if ( !fc->h ) {
+            fprintf(stderr,"[%s] fail to read the header of %s\n", __func__, fn[i]);
             exit(1);
-          }
-          if (conf->filecache) conf->filecache[i].h = h_tmp;
         }
-        // mar4: back to normal code
-        data[i]->h = i? h : h_tmp; // for i==0, "h" has not been set yet
-        bam_smpl_add(sm, fn[i], (conf->flag&MPLP_IGNORE_RG)? 0 : h_tmp->text);
-        // Collect read group IDs with PL (platform) listed in pl_list (note: fragile, strstr search)
-        rghash = bcf_call_add_rg(rghash, h_tmp->text, conf->pl_list);
-        if (conf->reg) {
-            // mar4: hts_idx_t in 1.0 was bam_index_t in 0.1.19
-            //hts_idx_t *idx = sam_index_load(data[i]->fp, fn[i]);
-            hts_idx_t *idx;
-            if (conf->filecache && conf->filecache[i].idx != 0) {
-              idx = conf->filecache[i].idx;
-            } else {
-              idx = bam_index_load(fn[i]);
-              if (conf->filecache) conf->filecache[i].idx = idx;
-            }
-        
-
-            if (idx == 0) {
+        if (use_index) {
+            fc->idx = bam_index_load(fn[i]);
+            if (fc->idx == 0) {
                 fprintf(stderr, "[%s] fail to load index for %s\n", __func__, fn[i]);
                 exit(1);
             }
-            // mar4: this check existed in 0.1.19, but not in 1.0.
-            // mar4: I'm going to put it in for now, and see what happens:
-            //if (bam_parse_region(h_tmp, conf->reg, &tid, &conf->regbegin, &conf->regend) < 0) {
-            //  fprintf(stderr,"[%s] malformatted region or wrong sequence for %s\n",__func__,fn[i]);
-            //  exit(1);
-            //}
-            // mar4: this check didn't exist in 0.1.19....
-            if ( (data[i]->iter=sam_itr_querys(idx, data[i]->h, conf->reg)) == 0) {
-                fprintf(stderr,"mar4: conf->reg: %s\n",conf->reg);
-                fprintf(stderr, "[E::%s] fail to parse region '%s'\n", __func__, conf->reg);
-                exit(1);
-            }
-            // mar4: there is a different line in Chris's mods:
-            //  if (i == 0) tid0 = tid, beg0 = conf->regbegin, end0 = conf->regend; 
-            // mar4: I'm going to leave what was originally in 1.0 for now:
-            if (i == 0) tid0 = data[i]->iter->tid, beg0 = data[i]->iter->beg, end0 = data[i]->iter->end;
-            if (!conf->filecache) hts_idx_destroy(idx); // mar4: Chris added conditional...original code was just to destroy
         }
-        if (i == 0) {
-           h = h_tmp; /* save the header of first file in list */
-        } else {
-            // FIXME: to check consistency
-            // mar4: again, adding the filecache conditional here:
-            if (!conf->filecache) bam_hdr_destroy(h_tmp);
+        run->data[i] = calloc(1, sizeof(mplp_aux_t));
+        run->data[i]->fp = fc->fp;
+        run->data[i]->reccache = mplp_input_cache(conf, fc->fp, use_index);
+        run->data[i]->baqcache = mplp_input_baqcache(conf, fc->fp, use_index);
+        run->data[i]->h = conf->filecache[0].h; // FIXME: to check consistency
+        run->data[i]->conf = conf;
+        run->data[i]->ref_id = -1;
+        bam_smpl_add(run->sm, fn[i], (conf->flag&MPLP_IGNORE_RG)? 0 : fc->h->text);
+        // Collect read group IDs with PL (platform) listed in pl_list (note: fragile, strstr search)
+        run->rghash = bcf_call_add_rg(run->rghash, fc->h->text, conf->pl_list);
+    }
+    run->h = conf->filecache[0].h;
+
+    fprintf(stderr, "[mpileup] %d samples in %d input files\n", run->sm->n, n);
+    run->max_depth = conf->max_depth;
+    if (run->max_depth * run->sm->n > 1<<20)
+        fprintf(stderr, "(mpileup) Max depth is above 1M. Potential memory hog!\n");
+    if (run->max_depth * run->sm->n < 8000) {
+        run->max_depth = 8000 / run->sm->n;
+        fprintf(stderr, "<mpileup> Set max per-file depth to %d\n", run->max_depth);
+    }
+    run->max_indel_depth = conf->max_indel_depth * run->sm->n;
+    run->ref_margin = ref_margin;
+    mplp_init_state(conf, run, conf->fai);
+}
+
+static void mplp_destroy_run(mplp_conf_t *conf, mplp_run_t *run)
+{
+    extern void bcf_call_del_rghash(void *rghash);
+    int i;
+
+    mplp_destroy_state(run);
+    bam_smpl_destroy(run->sm);
+    bcf_call_del_rghash(run->rghash);
+    for (i = 0; i < run->n; ++i) {
+        mplp_filecache_t *fc = &conf->filecache[i];
+        if (fc->idx) hts_idx_destroy(fc->idx);
+        bam_hdr_destroy(fc->h);
+        sam_close(fc->fp);
+    }
+    free(conf->filecache); conf->filecache = NULL;
+}
+
+/*
+ * Sets up a worker thread's copy of run, which must already have its output
+ * open.  The worker reads through handles of its own but uses the indices
+ * in conf->filecache, so it can only pile up regions.
+ */
+static void mplp_init_worker(mplp_conf_t *conf, const mplp_run_t *run, mplp_run_t *w)
+{
+    int i;
+
+    memset(w, 0, sizeof(mplp_run_t));
+    w->n = run->n;
+    w->fn = run->fn;
+    w->h = run->h;
+    w->sm = run->sm;
+    w->rghash = run->rghash;
+    w->max_depth = run->max_depth;
+    w->max_indel_depth = run->max_indel_depth;
+    w->ref_margin = run->ref_margin;
+    w->data = calloc(w->n, sizeof(mplp_aux_t*));
+    for (i = 0; i < w->n; ++i) {
+        // the header is read only to position the handle
+        samFile *fp = mplp_open_input(conf, run->fn[i]);
+        bam_hdr_t *h = sam_hdr_read(fp);
+        if ( !h ) {
+            fprintf(stderr,"[%s] fail to read the header of %s\n", __func__, run->fn[i]);
+            exit(1);
         }
+        bam_hdr_destroy(h);
+        w->data[i] = calloc(1, sizeof(mplp_aux_t));
+        w->data[i]->fp = fp;
+        w->data[i]->reccache = mplp_input_cache(conf, fp, 1);
+        w->data[i]->baqcache = mplp_input_baqcache(conf, fp, 1);
+        w->data[i]->h = run->h;
+        w->data[i]->conf = conf;
+        w->data[i]->ref_id = -1;
     }
-    // allocate data storage proportionate to number of samples being studied sm->n
-    gplp.n = sm->n;
-    gplp.n_plp = calloc(sm->n, sizeof(int));
-    gplp.m_plp = calloc(sm->n, sizeof(int));
-    gplp.plp = calloc(sm->n, sizeof(bam_pileup1_t*));
+    // faidx handles cannot be shared between threads
+    if (conf->fai && (w->fai = fai_load(conf->fai_fname)) == 0) exit(1);
+    mplp_init_state(conf, w, w->fai);
+    w->bcf_hdr = run->bcf_hdr;
+    bcf_call_set_hdr(&w->bc, w->bcf_hdr);
+}
+
+static void mplp_destroy_worker(mplp_conf_t *conf, mplp_run_t *w)
+{
+    int i;
+    for (i = 0; i < w->n; ++i) sam_close(w->data[i]->fp);
+    mplp_destroy_state(w);
+    if (w->fai) fai_destroy(w->fai);
+}
 
-    fprintf(stderr, "[%s] %d samples in %d input files\n", __func__, sm->n, n);
-    // write the VCF header
+/*
+ * Opens the output and, for -g/-v, writes the VCF/BCF header.
+ */
+static void mplp_open_output(mplp_conf_t *conf, mplp_run_t *run)
+{
+    int i;
     if (conf->flag & MPLP_BCF)
     {
         const char *mode;
+        bcf_hdr_t *bcf_hdr;
+        bam_hdr_t *h = run->h;
         if ( conf->flag & MPLP_VCF )
             mode = (conf->flag&MPLP_NO_COMP)? "wu" : "wz";   // uncompressed VCF or compressed VCF
         else
             mode = (conf->flag&MPLP_NO_COMP)? "wub" : "wb";  // uncompressed BCF or compressed BCF
 
-        bcf_fp = bcf_open(conf->output_fname? conf->output_fname : "-", mode);
-        if (bcf_fp == NULL) {
+        run->bcf_fp = bcf_open(conf->output_fname? conf->output_fname : "-", mode);
+        if (run->bcf_fp == NULL) {
             fprintf(stderr, "[%s] failed to write to %s: %s\n", __func__, conf->output_fname? conf->output_fname : "standard output", strerror(errno));
             exit(1);
         }
 
-        bcf_hdr = bcf_hdr_init("w");
+        bcf_hdr = run->bcf_hdr = bcf_hdr_init("w");
         kstring_t str = {0,0,0};
 
         ksprintf(&str, "##samtoolsVersion=%s+htslib-%s\n",samtools_version(),hts_version());
@@ -495,243 +1232,852 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
         if ( conf->fmt_flag&B2B_FMT_SP )
             bcf_hdr_append(bcf_hdr,"##FORMAT=<ID=SP,Number=1,Type=Integer,Description=\"Phred-scaled strand bias P-value\">");
 
-        for (i=0; i<sm->n; i++)
-            bcf_hdr_add_sample(bcf_hdr, sm->smpl[i]);
+
+        for (i=0; i<run->sm->n; i++)
+            bcf_hdr_add_sample(bcf_hdr, run->sm->smpl[i]);
         bcf_hdr_add_sample(bcf_hdr, NULL);
-        bcf_hdr_write(bcf_fp, bcf_hdr);
+        bcf_hdr_write(run->bcf_fp, bcf_hdr);
+        bcf_call_set_hdr(&run->bc, bcf_hdr);
+    }
+    else {
+        run->pileup_fp = conf->output_fname? fopen(conf->output_fname, "w") : stdout;
 
-        bca = bcf_call_init(-1., conf->min_baseQ);
-        bcr = calloc(sm->n, sizeof(bcf_callret1_t));
-        bca->rghash = rghash;
-        bca->openQ = conf->openQ, bca->extQ = conf->extQ, bca->tandemQ = conf->tandemQ;
-        bca->min_frac = conf->min_frac;
-        bca->min_support = conf->min_support;
-        bca->per_sample_flt = conf->flag & MPLP_PER_SAMPLE;
+        if (run->pileup_fp == NULL) {
+            fprintf(stderr, "[%s] failed to write to %s: %s\n", __func__, conf->output_fname, strerror(errno));
+            exit(1);
+        }
+    }
+}
 
-        bc.bcf_hdr = bcf_hdr;
-        bc.n = sm->n;
-        bc.PL = malloc(15 * sm->n * sizeof(*bc.PL));
-        if (conf->fmt_flag)
+static void mplp_close_output(mplp_conf_t *conf, mplp_run_t *run)
+{
+    if (run->bcf_fp)
+    {
+        hts_close(run->bcf_fp);
+        bcf_hdr_destroy(run->bcf_hdr);
+        run->bcf_fp = NULL;
+        run->bcf_hdr = NULL;
+        bcf_call_set_hdr(&run->bc, NULL);
+    }
+    if (run->pileup_fp && conf->output_fname) fclose(run->pileup_fp);
+    run->pileup_fp = NULL;
+}
+
+/*
+ * Resolves a region string against the header of the first input file.
+ * Returns the contig's tid, or -1 if the header does not have it.
+ */
+static int mplp_parse_region(bam_hdr_t *h, const char *str, mplp_region_t *reg)
+{
+    const char *name_lim;
+    char *name;
+    memset(reg, 0, sizeof(mplp_region_t));
+    name_lim = hts_parse_reg(str, &reg->beg, &reg->end);
+    name = malloc(name_lim - str + 1);
+    memcpy(name, str, name_lim - str);
+    name[name_lim - str] = '\0';
+    reg->tid = bam_name2id(h, name);
+    free(name);
+    return reg->tid;
+}
+
+/*
+ * Writes run->bcf_rec, or keeps a copy of it for the main thread to write.
+ */
+static void mplp_write_bcf(mplp_run_t *run)
+{
+    mplp_shard_t *s = run->shard;
+    if (!s) {
+        bcf_write1(run->bcf_fp, run->bcf_hdr, run->bcf_rec);
+        return;
+    }
+    if (s->n_rec == s->m_rec) {
+        s->m_rec = s->m_rec? s->m_rec<<1 : 256;
+        s->rec = realloc(s->rec, s->m_rec * sizeof(bcf1_t*));
+    }
+    s->rec[s->n_rec++] = bcf_dup(run->bcf_rec);
+}
+
+/*
+ * Renders a text pileup column into run->line and writes it with one call.
+ * The bases, base qualities, mapping qualities and read positions of a
+ * sample are collected in a single pass over its reads; all buffers belong
+ * to the run and are reused from column to column.
+ */
+static void mplp_format_column(mplp_conf_t *conf, mplp_run_t *run, int tid, int pos, const char *ref, int ref_len)
+{
+    kstring_t *s = &run->line, *bases = &run->col[0], *quals = &run->col[1], *mapqs = &run->col[2], *qposs = &run->col[3];
+    int i, j;
+
+    s->l = 0;
+    kputs(run->h->target_name[tid], s); kputc('\t', s);
+    kputw(pos + 1, s); kputc('\t', s);
+    kputc((ref && pos < ref_len)? ref[pos] : 'N', s);
+    for (i = 0; i < run->n; ++i) {
+        const bam_pileup1_t *plp = run->plp[i];
+        int n_plp = run->n_plp[i], cnt = 0;
+        if (n_plp == 0) {
+            kputs("\t0\t*\t*", s);
+            if (conf->flag & MPLP_PRINT_MAPQ) kputs("\t*", s);
+            if (conf->flag & MPLP_PRINT_POS) kputs("\t*", s);
+            continue;
+        }
+        bases->l = quals->l = mapqs->l = qposs->l = 0;
+        for (j = 0; j < n_plp; ++j) {
+            const bam_pileup1_t *p = plp + j;
+            int c = p->qpos < p->b->core.l_qseq? bam_get_qual(p->b)[p->qpos] : 0;
+            if (conf->flag & MPLP_PRINT_POS) {
+                if (j > 0) kputc(',', qposs);
+                kputw(p->qpos + 1, qposs);
+            }
+            if (c < conf->min_baseQ) continue;
+            ++cnt;
+            pileup_seq(bases, p, pos, ref_len, ref);
+            kputc(c + 33 < 126? c + 33 : 126, quals);
+            if (conf->flag & MPLP_PRINT_MAPQ)
+                kputc(p->b->core.qual + 33 < 126? p->b->core.qual + 33 : 126, mapqs);
+        }
+        kputc('\t', s); kputw(cnt, s);
+        kputc('\t', s); kputsn(bases->s, bases->l, s);
+        kputc('\t', s); kputsn(quals->s, quals->l, s);
+        if (conf->flag & MPLP_PRINT_MAPQ) { kputc('\t', s); kputsn(mapqs->s, mapqs->l, s); }
+        if (conf->flag & MPLP_PRINT_POS) { kputc('\t', s); kputsn(qposs->s, qposs->l, s); }
+    }
+    kputc('\n', s);
+    fwrite(s->s, 1, s->l, run->pileup_fp);
+}
+
+KSORT_INIT_GENERIC(uint64_t)
+
+/*
+ * Tells whether any read of m has an indel after this position.  Without
+ * one, bcf_call_gap_prep() has nothing to call.
+ */
+static int mplp_has_indel(const mplp_pileup_t *m)
+{
+    int s, i;
+    for (s = 0; s < m->n; ++s)
+        for (i = 0; i < m->n_plp[s]; ++i)
+            if (m->plp[s][i].indel != 0) return 1;
+    return 0;
+}
+
+/*
+ * Copies the reads of run->gplp into run->iplp for indel calling, which
+ * writes to them, keeping at most max_depth reads of each sample; with
+ * --subsample-indels that is the per-sample -L.  The reads kept from a
+ * deeper sample are split between the strands in proportion to its depth
+ * on each.  As with view -s, reads are ranked by a hash of their name and
+ * the seed, so the same reads are picked at every position and in every
+ * run.  The two reads of a pair are ranked on their own strands, so one
+ * may be kept and the other dropped.
+ */
+static mplp_pileup_t *mplp_indel_column(mplp_run_t *run, int max_depth, uint32_t seed)
+{
+    mplp_pileup_t *g = &run->gplp, *m = &run->iplp;
+    int s, i, j, rev;
+    if (max_depth < 0) max_depth = 0;
+    for (s = 0; s < g->n; ++s) {
+        const bam_pileup1_t *plp = g->plp[s];
+        int n = g->n_plp[s], n_rev = 0, n_pick = 0, keep[2];
+        uint64_t *key, *pick;
+        if ((n < max_depth? n : max_depth) > m->m_plp[s]) {
+            m->m_plp[s] = n < max_depth? n : max_depth;
+            kroundup32(m->m_plp[s]);
+            m->buf[s] = realloc(m->buf[s], sizeof(bam_pileup1_t) * m->m_plp[s]);
+        }
+        m->plp[s] = m->buf[s];
+        if (n <= max_depth) {
+            memcpy(m->plp[s], plp, n * sizeof(bam_pileup1_t));
+            m->n_plp[s] = n;
+            continue;
+        }
+        if (2 * n > run->m_ikey) {
+            run->m_ikey = 2 * n;
+            kroundup32(run->m_ikey);
+            run->ikey = realloc(run->ikey, run->m_ikey * sizeof(uint64_t));
+        }
+        key = run->ikey, pick = run->ikey + n;
+        for (i = 0; i < n; ++i) n_rev += bam_is_rev(plp[i].b);
+        keep[1] = (int)((double)max_depth * n_rev / n + .499);
+        keep[0] = max_depth - keep[1];
+        for (rev = 0; rev < 2; ++rev) {
+            // the keep[rev] smallest keys, with the index of the read in the low bits
+            for (i = j = 0; i < n; ++i)
+                if (bam_is_rev(plp[i].b) == rev)
+                    key[j++] = (uint64_t)__ac_Wang_hash(__ac_X31_hash_string(bam_get_qname(plp[i].b)) ^ seed) << 32 | i;
+            if (keep[rev] < j) {
+                if (keep[rev] > 0) ks_ksmall(uint64_t, j, key, keep[rev] - 1);
+                j = keep[rev];
+            }
+            for (i = 0; i < j; ++i) pick[n_pick++] = (uint32_t)key[i];
+        }
+        ks_introsort(uint64_t, n_pick, pick); // back to pileup order
+        for (i = 0; i < n_pick; ++i) m->plp[s][i] = plp[pick[i]];
+        m->n_plp[s] = n_pick;
+    }
+    return m;
+}
+
+/*
+ * Marks the reads of m that -P excludes from indel calling with aux = 1 and
+ * the others with 0, as bcf_call_gap_prep() expects, from the mark
+ * mplp_func() kept with each read.
+ */
+static void mplp_mark_platform(mplp_pileup_t *m)
+{
+    int s, i;
+    for (s = 0; s < m->n; ++s) {
+        for (i = 0; i < m->n_plp[s]; ++i) {
+            bam_pileup1_t *p = m->plp[s] + i;
+            p->aux = MPLP_PL_SKIP(p->b);
+        }
+    }
+}
+
+/*
+ * Writes the output for a single pileup column, fetching the reference of
+ * a new contig first if needed.
+ */
+static void mplp_pileup_column(mplp_conf_t *conf, mplp_run_t *run, int tid, int pos)
+{
+    int i, n = run->n, *n_plp = run->n_plp;
+    const bam_pileup1_t **plp = run->plp;
+    char *ref;
+    int ref_len;
+    mplp_prof_t *prof = conf->profile_fp? &run->prof : NULL;
+    uint64_t t = mplp_clock(prof);
+
+    if (tid != run->ref_tid) {
+        for (i = 0; i < n; ++i) run->data[i]->ref_id = tid;
+        run->ref_tid = tid;
+    }
+    ref = 0, ref_len = 0;
+    if (run->refcache) {
+        // cover every read that can be in this column
+        int pad = run->refcache->max_span;
+        ref = mplp_refcache_get(run->refcache, tid, pos - pad, pos + 1 + pad, &ref_len);
+    }
+
+    if (conf->flag & MPLP_BCF) { // if generating BCF output (genotype likelihoods)
+        bcf_callaux_t *bca = run->bca;
+        bcf_callret1_t *bcr = run->bcr;
+        bcf_call_t *bc = &run->bc;
+        mplp_pileup_t *gplp = &run->gplp;
+        int total_depth, _ref0, ref16, do_indel, sub_indel;
+        for (i = total_depth = 0; i < n; ++i) total_depth += n_plp[i];
+        // call indels; deeper sites are skipped, or called from a subsample with --subsample-indels
+        do_indel = !(conf->flag&MPLP_NO_INDEL) && total_depth < run->max_indel_depth;
+        sub_indel = !(conf->flag&MPLP_NO_INDEL) && !do_indel && (conf->flag&MPLP_SUBSAMPLE_INDEL);
+        group_smpl(gplp, n, n_plp, plp);
+        _ref0 = (ref && pos < ref_len)? ref[pos] : 'N';
+        ref16 = seq_nt16_table[_ref0];
+        bcf_callaux_clean(bca, bc);
+        for (i = 0; i < gplp->n; ++i)
+            bcf_call_glfgen(gplp->n_plp[i], gplp->plp[i], ref16, bca, bcr + i);
+        bc->tid = tid; bc->pos = pos;
+        bcf_call_combine(gplp->n, bcr, bca, ref16, bc);
+        mplp_prof_time(prof, MPLP_TIME_CALL, &t);
+        bcf_call2bcf(bc, run->bcf_rec, bcr, conf->fmt_flag, 0, 0);
+        mplp_write_bcf(run);
+        mplp_prof_time(prof, MPLP_TIME_OUTPUT, &t);
+        // indel calling writes to the reads, so they are copied, but only at the
+        // few columns where there is an indel to call
+        if ((do_indel || sub_indel) && mplp_has_indel(gplp)) {
+            gplp = mplp_indel_column(run, sub_indel? conf->max_indel_depth : INT_MAX, conf->indel_seed);
+            if (sub_indel && prof) ++prof->n_indel_sub;
+            do_indel = 1;
+        } else do_indel = 0;
+        if (do_indel && run->rghash) mplp_mark_platform(gplp);
+        if (do_indel && bcf_call_gap_prep(gplp->n, gplp->n_plp, gplp->plp, pos, bca, ref, run->rghash) >= 0)
         {
-            assert( sizeof(float)==sizeof(int32_t) );
-            bc.DP4 = malloc(sm->n * sizeof(int32_t) * 4);
-            bc.fmt_arr = malloc(sm->n * sizeof(float)); // all fmt_flag fields
-            if ( conf->fmt_flag&(B2B_INFO_DPR|B2B_FMT_DPR) )
-            {
-                // first B2B_MAX_ALLELES fields for total numbers, the rest per-sample
-                bc.DPR = malloc((sm->n+1)*B2B_MAX_ALLELES*sizeof(int32_t));
-                for (i=0; i<sm->n; i++)
-                    bcr[i].DPR = bc.DPR + (i+1)*B2B_MAX_ALLELES;
+            bcf_callaux_clean(bca, bc);
+            for (i = 0; i < gplp->n; ++i)
+                bcf_call_glfgen(gplp->n_plp[i], gplp->plp[i], -1, bca, bcr + i);
+            if (bcf_call_combine(gplp->n, bcr, bca, -1, bc) >= 0) {
+                mplp_prof_time(prof, MPLP_TIME_INDEL, &t);
+                bcf_call2bcf(bc, run->bcf_rec, bcr, conf->fmt_flag, bca, ref);
+                mplp_write_bcf(run);
+                mplp_prof_time(prof, MPLP_TIME_OUTPUT, &t);
             }
         }
+        mplp_prof_time(prof, MPLP_TIME_INDEL, &t);
+    } else {
+        mplp_format_column(conf, run, tid, pos, ref, ref_len);
+        mplp_prof_time(prof, MPLP_TIME_OUTPUT, &t);
     }
-    else {
-        pileup_fp = conf->output_fname? fopen(conf->output_fname, "w") : stdout;
+}
 
-        if (pileup_fp == NULL) {
-            fprintf(stderr, "[%s] failed to write to %s: %s\n", __func__, conf->output_fname, strerror(errno));
-            exit(1);
+/*
+ * Piles up one region, or the whole input if reg is NULL, through the
+ * handles already opened for this run.
+ */
+static int mplp_pileup_region(mplp_conf_t *conf, mplp_run_t *run, const mplp_region_t *reg)
+{
+    int i, ret, tid, pos, tid0 = -1, beg0 = 0, end0 = 1u<<29, k = 0;
+    mplp_aux_t **data = run->data;
+    mplp_prof_t *prof = conf->profile_fp? &run->prof : NULL;
+    uint64_t t = mplp_clock(prof);
+    bam_mplp_t iter;
+
+    if (prof) memset(prof, 0, sizeof(mplp_prof_t));
+    if (reg) {
+        for (i = 0; i < run->n; ++i) {
+            if (data[i]->iter) hts_itr_destroy(data[i]->iter);
+            data[i]->iter = sam_itr_queryi(conf->filecache[i].idx, reg->tid, reg->beg, reg->end);
+            if (data[i]->iter == 0) {
+                fprintf(stderr, "[E::%s] fail to query region %s:%d-%d\n", __func__, run->h->target_name[reg->tid], reg->beg+1, reg->end);
+                exit(1);
+            }
+            data[i]->itr_i = -1, data[i]->itr_off = 0, data[i]->itr_done = 0;
         }
+        tid0 = reg->tid, beg0 = reg->beg, end0 = reg->end;
+        mplp_prof_time(prof, MPLP_TIME_INDEX, &t);
     }
 
-    if (tid0 >= 0 && conf->fai) { // region is set mar4: cw comment: ('-f' option)
-        ref = faidx_fetch_seq(conf->fai, h->target_name[tid0], 0, 0x7fffffff, &ref_len);
-        ref_tid = tid0;
-        for (i = 0; i < n; ++i) data[i]->ref = ref, data[i]->ref_id = tid0;
-    } else ref_tid = -1, ref = 0;
+    if (tid0 >= 0 && run->refcache) { // region is set
+        int ref_len;
+        mplp_refcache_get(run->refcache, tid0, beg0, end0, &ref_len); // fetch the whole region at once
+        run->ref_tid = tid0;
+        for (i = 0; i < run->n; ++i) data[i]->ref_id = tid0;
+    }
 
     // begin pileup
-    iter = bam_mplp_init(n, mplp_func, (void**)data);
+    iter = bam_mplp_init(run->n, mplp_func, (void**)data);
     if ( conf->flag & MPLP_SMART_OVERLAPS ) bam_mplp_init_overlaps(iter);
-    max_depth = conf->max_depth;
-    if (max_depth * sm->n > 1<<20)
-        fprintf(stderr, "(%s) Max depth is above 1M. Potential memory hog!\n", __func__);
-    if (max_depth * sm->n < 8000) {
-        max_depth = 8000 / sm->n;
-        fprintf(stderr, "<%s> Set max per-file depth to %d\n", __func__, max_depth);
-    }
-    // mar4: some more of Chris's profiling and comments:
-    // cw: report read counts prior to this point --> all zeros
-    int cw_pos_lt_beg0 = 0;
-    int cw_pos_ge_end0 = 0;
-    int cw_bam_mplp_auto_count = 0;
-
-
-    max_indel_depth = conf->max_indel_depth * sm->n;
-    bam_mplp_set_maxcnt(iter, max_depth);
-    bcf1_t *bcf_rec = bcf_init1();  // mar4: <-- new to 1.0
-    int ret;                        // mar4: <-- new to 1.0
-    while ( (ret=bam_mplp_auto(iter, &tid, &pos, n_plp, plp)) > 0) {
-        //fprintf(stderr,"mar4: pos: %i\n",pos);
-        //fprintf(stderr,"mar4: pos+1: %i\n",pos+1);
-        cw_bam_mplp_auto_count += 1;
-        if (conf->reg && (pos < beg0 || pos >= end0)) {
-          cw_out_of_region_count += 1;
-          // mar4: cw comment: count loops pos < beg0 verses >= end0
-          if (pos < beg0)  cw_pos_lt_beg0 += 1;
-          if (pos >= end0) cw_pos_ge_end0 += 1;
-          continue; // out of the region requested mar4: <-- original command
+    bam_mplp_set_maxcnt(iter, run->max_depth);
+
+    while ( (ret=bam_mplp_auto(iter, &tid, &pos, run->n_plp, run->plp)) > 0) {
+        if (prof) ++prof->n_visited;
+        if (reg && (pos < beg0 || pos >= end0)) { // out of the region requested
+            if (prof) ++prof->n_outside;
+            continue;
         }
-        if (conf->bed && tid >= 0 && !bed_overlap(conf->bed, h->target_name[tid], pos, pos+1)) continue;
-        if (tid != ref_tid) {
-            //fprintf(stderr,"cw print: In tid != ref_tid. tid = %d ; ref_tid = %d\n",tid,ref_tid);
-            free(ref); ref = 0;
-            if (conf->fai) ref = faidx_fetch_seq(conf->fai, h->target_name[tid], 0, 0x7fffffff, &ref_len);
-            for (i = 0; i < n; ++i) data[i]->ref = ref, data[i]->ref_id = tid;
-            ref_tid = tid;
+        if (conf->bed && tid >= 0 && !bed_overlap(conf->bed, run->h->target_name[tid], pos, pos+1)) {
+            if (prof) ++prof->n_filtered;
+            continue;
         }
-        if (conf->flag & MPLP_BCF) { // if generating BCF output (genotype likelihoods)
-            int total_depth, _ref0, ref16;
-            for (i = total_depth = 0; i < n; ++i) total_depth += n_plp[i];
-            group_smpl(&gplp, sm, &buf, n, fn, n_plp, plp, conf->flag & MPLP_IGNORE_RG);
-            _ref0 = (ref && pos < ref_len)? ref[pos] : 'N';
-            ref16 = seq_nt16_table[_ref0];
-            bcf_callaux_clean(bca, &bc);
-            for (i = 0; i < gplp.n; ++i)
-                bcf_call_glfgen(gplp.n_plp[i], gplp.plp[i], ref16, bca, bcr + i);
-            bc.tid = tid; bc.pos = pos;
-            bcf_call_combine(gplp.n, bcr, bca, ref16, &bc);
-            bcf_clear1(bcf_rec);
-            bcf_call2bcf(&bc, bcf_rec, bcr, conf->fmt_flag, 0, 0);
-            bcf_write1(bcf_fp, bcf_hdr, bcf_rec);
-            // call indels; todo: subsampling with total_depth>max_indel_depth instead of ignoring?
-            if (!(conf->flag&MPLP_NO_INDEL) && total_depth < max_indel_depth && bcf_call_gap_prep(gplp.n, gplp.n_plp, gplp.plp, pos, bca, ref, rghash) >= 0)
-            {
-                bcf_callaux_clean(bca, &bc);
-                for (i = 0; i < gplp.n; ++i)
-                    bcf_call_glfgen(gplp.n_plp[i], gplp.plp[i], -1, bca, bcr + i);
-                if (bcf_call_combine(gplp.n, bcr, bca, -1, &bc) >= 0) {
-                    bcf_clear1(bcf_rec);
-                    bcf_call2bcf(&bc, bcf_rec, bcr, conf->fmt_flag, bca, ref);
-                    bcf_write1(bcf_fp, bcf_hdr, bcf_rec);
-                }
+        if (reg && reg->n_sub) { // streaming through several regions; positions only increase
+            while (k < reg->n_sub && reg->sub[k].end <= pos) ++k;
+            if (k == reg->n_sub || pos < reg->sub[k].beg) {
+                if (prof) ++prof->n_filtered;
+                continue;
             }
+        }
+        if (prof) ++prof->n_emitted;
+        mplp_pileup_column(conf, run, tid, pos);
+    }
+    bam_mplp_destroy(iter);
+    if (prof) {
+        for (i = 0; i < run->n; ++i) {
+            if (data[i]->baqcache) prof->baq_mem += data[i]->baqcache->mem;
+            if (data[i]->reccache) prof->rec_mem += data[i]->reccache->mem;
+        }
+    }
+    return ret;
+}
+
+#define mplp_region_lt(a, b) ((a).tid < (b).tid || ((a).tid == (b).tid && (a).beg < (b).beg))
+KSORT_INIT(mplp_region, mplp_region_t, mplp_region_lt)
+
+/*
+ * Sorts the regions, merges the overlapping and abutting ones and, if clip
+ * is given, restricts them to it.  Returns the number of regions left, so
+ * that each position is piled up once and in coordinate order.
+ */
+static int mplp_merge_regions(int nreg, mplp_region_t *regs, const mplp_region_t *clip)
+{
+    int i, n = 0;
+    ks_introsort(mplp_region, nreg, regs);
+    for (i = 0; i < nreg; ++i) {
+        mplp_region_t r = regs[i];
+        if (clip) {
+            if (r.tid != clip->tid) continue;
+            if (r.beg < clip->beg) r.beg = clip->beg;
+            if (r.end > clip->end) r.end = clip->end;
+            if (r.beg >= r.end) continue;
+        }
+        if (n && regs[n-1].tid == r.tid && r.beg <= regs[n-1].end) {
+            if (r.end > regs[n-1].end) regs[n-1].end = r.end;
+        } else regs[n++] = r;
+    }
+    return n;
+}
+
+/*
+ * Groups merged regions that are at most gap bases apart into spans.  A
+ * span is fetched with one iterator, which reads the BGZF blocks shared by
+ * nearby regions only once, and lists its regions as sub-regions.
+ */
+static mplp_region_t *mplp_span_regions(int nreg, const mplp_region_t *regs, int gap, int *n_span)
+{
+    mplp_region_t *span = calloc(nreg? nreg : 1, sizeof(mplp_region_t));
+    int i, j, n = 0;
+    for (i = 0; i < nreg; i = j) {
+        for (j = i + 1; j < nreg && regs[j].tid == regs[i].tid && regs[j].beg - regs[j-1].end <= gap; ++j);
+        span[n].tid = regs[i].tid;
+        span[n].beg = regs[i].beg;
+        span[n].end = regs[j-1].end;
+        span[n].sub = &regs[i];
+        span[n++].n_sub = j - i;
+    }
+    *n_span = n;
+    return span;
+}
+
+/*
+ * Tells whether reading may start afresh at pos of tid.  Which reads -d
+ * drops depends on the reads already buffered, so an iterator started at
+ * pos could keep other reads than a run that reaches pos from further left.  That
+ * cannot happen if no input holds more than max_depth reads over the span
+ * of the reads overlapping pos, as then neither drops any of them.
+ */
+static int mplp_cut_ok(mplp_conf_t *conf, mplp_run_t *run, bam1_t *b, int tid, int pos)
+{
+    int i, n, beg;
+    for (i = 0; i < run->n; ++i) {
+        mplp_filecache_t *fc = &conf->filecache[i];
+        hts_itr_t *iter = sam_itr_queryi(fc->idx, tid, pos, pos + 1);
+        if (iter == NULL) return 0;
+        for (n = 0, beg = pos; n <= run->max_depth && sam_itr_next(fc->fp, iter, b) >= 0; ++n)
+            if (b->core.pos < beg) beg = b->core.pos;
+        hts_itr_destroy(iter);
+        if (n > run->max_depth) return 0;
+        if (beg == pos) continue;
+        if ((iter = sam_itr_queryi(fc->idx, tid, beg, pos + 1)) == NULL) return 0;
+        for (n = 0; n <= run->max_depth && sam_itr_next(fc->fp, iter, b) >= 0; ++n);
+        hts_itr_destroy(iter);
+        if (n > run->max_depth) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Region planner.  Consecutive regions on one contig that are sorted and do
+ * not overlap form a block, which can be read either with one seek per
+ * region or in a single pass over the block's span that skips the positions
+ * outside its regions.  Both give the same output, except at sites deeper
+ * than -d, where which reads are dropped depends on where reading started.
+ * --plan auto chooses the cheaper one from the compressed bytes the index
+ * says each would read, but seeks wherever streaming could differ.  Every
+ * seek also costs about MPLP_SEEK_COST bytes for the block it lands in.
+ * --profile reports what was chosen.
+ */
+#define MPLP_SEEK_COST 65536
+
+/*
+ * Estimates the compressed bytes all input files hold for [beg,end) of tid.
+ * BAM indices give the chunks to read; otherwise the file size is prorated
+ * by length.
+ */
+static int64_t mplp_region_bytes(mplp_conf_t *conf, mplp_run_t *run, uint64_t genome_len, int tid, int beg, int end)
+{
+    int i, j;
+    int64_t bytes = 0;
+    for (i = 0; i < run->n; ++i) {
+        mplp_filecache_t *fc = &conf->filecache[i];
+        hts_itr_t *iter = NULL;
+        if (hts_get_format(fc->fp)->format == bam)
+            iter = sam_itr_queryi(fc->idx, tid, beg, end);
+        if (iter && iter->n_off) {
+            for (j = 0; j < iter->n_off; ++j)
+                bytes += (iter->off[j].v >> 16) - (iter->off[j].u >> 16);
         } else {
-            fprintf(pileup_fp, "%s\t%d\t%c", h->target_name[tid], pos + 1, (ref && pos < ref_len)? ref[pos] : 'N');
-            int qualc[20000]; // mar4: <-- cw addition
-            for (i = 0; i < n; ++i) {
-                if (n_plp[i] > 20000) {
-                  fprintf(stderr,"cw print: PROBLEM ??? n_plp[%d] = %d\n",i,n_plp[i]);
-                }
-                int j, cnt;
-                for (j = cnt = 0; j < n_plp[i]; ++j) {
-                    const bam_pileup1_t *p = plp[i] + j;
-                    // slight restructuring in 1.0:
-                    //int c = p->qpos < p->b->core.l_qseq  // mar4: slight resturcure difference in 1.0
-                    //         ? bam_get_qual(p->b)[p->qpos]
-                    //         : 0;
-                    //if (c >= conf->min_baseQ) ++cnt;
-                    // mar4: some lines from chris.... in 0.1.19...
-                    //qualc[j] = bam1_qual(p->b)[p->qpos];
-                    // if (qualc[j] >= conf->min_baseQ) ++cnt;
-                    // mar4: making Chris's 0.1.19 mods in 1.0 format:
-                    qualc[j] = p->qpos < p->b->core.l_qseq ? bam_get_qual(p->b)[p->qpos] : 0;
-                    //fprintf(stderr,"mar4: 1.0: qualc[j] = %i[%i]\n",qualc[j],j);
-                    if (qualc[j] >= conf->min_baseQ) ++cnt;
-                    
-                } 
-                fprintf(pileup_fp, "\t%d\t", cnt);
-                if (n_plp[i] == 0) {
-                    fputs("*\t*", pileup_fp);
-                    if (conf->flag & MPLP_PRINT_MAPQ) fputs("\t*", pileup_fp);
-                    if (conf->flag & MPLP_PRINT_POS) fputs("\t*", pileup_fp);
-                } else {
-                    for (j = 0; j < n_plp[i]; ++j) {
-                        // mar4: structure slightly different from 0.1.19 also:
-                        //const bam_pileup1_t *p = plp[i] + j;
-                        //int c = p->qpos < p->b->core.l_qseq
-                        //    ? bam_get_qual(p->b)[p->qpos]
-                        //    : 0;
-                        //if (c >= conf->min_baseQ)
-                        // mar4: here is what was originally in 0.1.19
-                        //const bam_pileup1_t *p = pop[i] + j;
-                        //if (bam1_qual(p->b)[p->qpos] >= conf->min_baseQ)
-                        // mar4: here is Chris's mod in 0.1.19
-                        if (qualc[j] >= conf->min_baseQ)  // mar4: just using this for now
-                            pileup_seq(pileup_fp, plp[i] + j, pos, ref_len, ref);
-                    }
-                    putc('\t', pileup_fp);
-                    for (j = 0; j < n_plp[i]; ++j) {
-                        // mar4: original 1.0:
-                        //const bam_pileup1_t *p = plp[i] + j;
-                        //int c = p->qpos < p->b->core.l_qseq
-                        //    ? bam_get_qual(p->b)[p->qpos]
-                        //    : 0;
-                        // mar4: original 0.1.19
-                        //const bam_pileup1_t *p = plp[i] + j;
-                        //int c = bam1_qual(p->b)[p->qpos];
-                        // mar4: Chris's mod in 0.1.19:
-                        const bam_pileup1_t *p = plp[i] + j;
-                        int c = p->qpos < p->b->core.l_qseq
-                            ? bam_get_qual(p->b)[p->qpos]
-                            : 0;
-                        if (c >= conf->min_baseQ) {
-                            c = c + 33 < 126? c + 33 : 126;
-                            putc(c, pileup_fp);
-                        }
-                    }
-                    if (conf->flag & MPLP_PRINT_MAPQ) {
-                        putc('\t', pileup_fp);
-                        for (j = 0; j < n_plp[i]; ++j) {
-                            const bam_pileup1_t *p = plp[i] + j;
-                            int c = bam_get_qual(p->b)[p->qpos];
-                            if ( c < conf->min_baseQ ) continue;
-                            c = plp[i][j].b->core.qual + 33;
-                            if (c > 126) c = 126;
-                            putc(c, pileup_fp);
-                        }
-                    }
-                    if (conf->flag & MPLP_PRINT_POS) {
-                        putc('\t', pileup_fp);
-                        for (j = 0; j < n_plp[i]; ++j) {
-                            if (j > 0) putc(',', pileup_fp);
-                            fprintf(pileup_fp, "%d", plp[i][j].qpos + 1); // FIXME: printf() is very slow...
-                        }
-                    }
-                }
+            struct stat sb;
+            if (genome_len && stat(fc->fname, &sb) == 0)
+                bytes += (double)sb.st_size * (end - beg) / genome_len;
+        }
+        if (iter) hts_itr_destroy(iter);
+    }
+    return bytes;
+}
+
+/*
+ * Returns the regions to pile up for regs: blocks that are streamed become
+ * a single region over their span with the block's regions as sub-regions,
+ * the rest are returned as they are.  With --plan auto a block is only
+ * streamed if mplp_cut_ok() holds at the start of each of its regions, so
+ * that the choice never changes the output.  regs may be spans made by
+ * mplp_span_regions(), whose sub-regions are then used instead.  regs must
+ * outlive the result.
+ */
+static mplp_region_t *mplp_plan_regions(mplp_conf_t *conf, mplp_run_t *run, int nreg, const mplp_region_t *regs, int *n_plan)
+{
+    mplp_region_t *plan = calloc(nreg, sizeof(mplp_region_t));
+    bam1_t *b = bam_init1();
+    int i, j, k, n = 0, n_block = 0, n_stream = 0;
+    int64_t total = 0;
+    uint64_t genome_len = 0;
+
+    for (i = 0; i < run->h->n_targets; ++i) genome_len += run->h->target_len[i];
+    for (i = 0; i < nreg; i = j) {
+        int64_t seek = 0, stream = -1;
+        for (j = i + 1; j < nreg && regs[j].tid == regs[i].tid && regs[j].beg >= regs[j-1].end; ++j);
+        ++n_block;
+        if (j - i > 1 && conf->plan != MPLP_PLAN_SEEK)
+            stream = mplp_region_bytes(conf, run, genome_len, regs[i].tid, regs[i].beg, regs[j-1].end) + MPLP_SEEK_COST * run->n;
+        if (stream < 0 || conf->plan == MPLP_PLAN_AUTO)
+            for (k = i; k < j && (stream < 0 || seek < stream); ++k)
+                seek += mplp_region_bytes(conf, run, genome_len, regs[k].tid, regs[k].beg, regs[k].end) + MPLP_SEEK_COST * run->n;
+        if (stream >= 0 && conf->plan == MPLP_PLAN_AUTO && seek >= stream) {
+            for (k = i + 1; k < j && mplp_cut_ok(conf, run, b, regs[k].tid, regs[k].beg); ++k);
+            if (k < j) { // streaming could keep other reads at a deep site; seek instead
+                stream = -1;
+                for (seek = 0, k = i; k < j; ++k)
+                    seek += mplp_region_bytes(conf, run, genome_len, regs[k].tid, regs[k].beg, regs[k].end) + MPLP_SEEK_COST * run->n;
+            }
+        }
+        if (stream >= 0 && (conf->plan == MPLP_PLAN_STREAM || seek >= stream)) {
+            const mplp_region_t *sub = regs[i].n_sub? regs[i].sub : &regs[i];
+            plan[n].tid = regs[i].tid;
+            plan[n].beg = regs[i].beg;
+            plan[n].end = regs[j-1].end;
+            plan[n].sub = sub;
+            plan[n++].n_sub = regs[j-1].n_sub? regs[j-1].sub + regs[j-1].n_sub - sub : j - i;
+            total += stream;
+            ++n_stream;
+        } else {
+            for (k = i; k < j; ++k) plan[n++] = regs[k];
+            total += seek;
+        }
+    }
+    bam_destroy1(b);
+    run->n_planned = nreg, run->n_block = n_block, run->n_stream = n_stream;
+    run->plan_bytes = total;
+    *n_plan = n;
+    return plan;
+}
+
+/*
+ * Regions are handed to worker threads in order, and the main thread
+ * writes their output in the same order.  Workers stay at most
+ * MPLP_SHARD_AHEAD regions per thread ahead of the writer, and long regions
+ * are cut into pieces of about MPLP_SHARD_LEN, which bounds the output held
+ * in memory.  A cut that falls where -d would drop reads is moved on by
+ * MPLP_SHARD_STEP until it is clear of them.
+ */
+#define MPLP_SHARD_LEN   100000
+#define MPLP_SHARD_STEP  1000
+#define MPLP_SHARD_AHEAD 4
+
+/*
+ * Writes the --profile counters of one region (NULL for the whole input) as
+ * an element of the "regions" array and adds them to the total.
+ */
+static void mplp_profile_region(mplp_conf_t *conf, mplp_run_t *run, const mplp_region_t *reg, const mplp_prof_t *p, mplp_prof_t *total)
+{
+    FILE *fp = conf->profile_fp;
+    if (!fp) return;
+    if (reg) fprintf(fp, "%s{\"region\":\"%s:%d-%d\",", run->n_profiled? "," : "", run->h->target_name[reg->tid], reg->beg+1, reg->end);
+    else fprintf(fp, "%s{\"region\":\"*\",", run->n_profiled? "," : "");
+    mplp_prof_print(fp, p);
+    fputs("}\n", fp);
+    mplp_prof_add(total, p);
+    ++run->n_profiled;
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    mplp_shard_t *shard;
+    int n_shard, next, n_written, max_ahead, stop;
+} mplp_pool_t;
+
+typedef struct {
+    mplp_conf_t *conf;
+    mplp_run_t run;
+    mplp_pool_t *pool;
+} mplp_worker_t;
+
+static void *mplp_worker(void *data)
+{
+    mplp_worker_t *w = (mplp_worker_t*)data;
+    mplp_pool_t *p = w->pool;
+    for (;;) {
+        mplp_shard_t *s;
+        int ret;
+
+        pthread_mutex_lock(&p->lock);
+        while (!p->stop && p->next < p->n_shard && p->next >= p->n_written + p->max_ahead)
+            pthread_cond_wait(&p->cond, &p->lock);
+        if (p->stop || p->next == p->n_shard) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        s = &p->shard[p->next++];
+        pthread_mutex_unlock(&p->lock);
+
+        w->run.shard = s;
+        if (!(w->conf->flag & MPLP_BCF)) {
+            w->run.pileup_fp = open_memstream(&s->text, &s->l_text);
+            if (w->run.pileup_fp == NULL) {
+                fprintf(stderr, "[%s] failed to buffer output: %s\n", __func__, strerror(errno));
+                exit(1);
             }
-            putc('\n', pileup_fp);
         }
+        ret = mplp_pileup_region(w->conf, &w->run, &s->reg);
+        s->prof = w->run.prof;
+        if (w->run.pileup_fp) fclose(w->run.pileup_fp);
+        w->run.pileup_fp = NULL;
+
+        pthread_mutex_lock(&p->lock);
+        s->ret = ret;
+        s->done = 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
     }
+    return 0;
+}
 
-    // clean up
-    // mar4: not sure how much of this cleanup should be within a 
-    // mar4: if (!conf->filecace) conditional....
-    free(bc.tmp.s);
-    bcf_destroy1(bcf_rec);
-    if (bcf_fp)
-    {
-        hts_close(bcf_fp);
-        bcf_hdr_destroy(bcf_hdr);
-        bcf_call_destroy(bca);
-        free(bc.PL);
-        free(bc.DP4);
-        free(bc.DPR);
-        free(bc.fmt_arr);
-        free(bcr);
-    }
-    if (pileup_fp && conf->output_fname) fclose(pileup_fp);
-    bam_smpl_destroy(sm); free(buf.s);
-    for (i = 0; i < gplp.n; ++i) free(gplp.plp[i]);
-    free(gplp.plp); free(gplp.n_plp); free(gplp.m_plp);
-    bcf_call_del_rghash(rghash);
-    bam_mplp_destroy(iter);
-    // bam_hdr_destroy(h); // mar4: <-- original
-    if (!conf->filecache) bam_hdr_destroy(h);
-    for (i = 0; i < n; ++i) {
-        // sam_close(data[i]->fp); // mar4: <-- original
-        if (!conf->filecache) sam_close(data[i]->fp);
-        if (data[i]->iter) hts_itr_destroy(data[i]->iter);
-        free(data[i]);
-    }
-    free(data); free(plp); free(ref); free(n_plp);
-    // mar4: some Chris prints:
-    //fprintf(stderr,"Called mplp_func %d times \n",cw_count1);
-    //fprintf(stderr,"    cw_bam_iter_read_counter   = %d\n",cw_bam_iter_read_counter);
-    //fprintf(stderr,"    cw_bam_mplp_auto_count     = %d\n",cw_bam_mplp_auto_count);
-    //fprintf(stderr,"    cw_out_of_region_count     = %d\n",cw_out_of_region_count);
-    //fprintf(stderr,"    cw_pos_lt_beg0             = %d\n",cw_pos_lt_beg0);
-    //fprintf(stderr,"    cw_pos_ge_end0             = %d\n",cw_pos_ge_end0);
+/*
+ * Appends a shard for [beg,end) of reg, keeping the sub-regions of reg that
+ * it overlaps.
+ */
+static void mplp_add_shard(mplp_shard_t **shard, int *n, int *m, const mplp_region_t *reg, int beg, int end, const mplp_region_t *sub, int n_sub)
+{
+    mplp_shard_t *s;
+    if (*n == *m) {
+        *m = *m? *m<<1 : 64;
+        *shard = realloc(*shard, *m * sizeof(mplp_shard_t));
+    }
+    s = &(*shard)[(*n)++];
+    memset(s, 0, sizeof(mplp_shard_t));
+    s->reg.tid = reg->tid;
+    s->reg.beg = beg;
+    s->reg.end = end;
+    s->reg.sub = sub;
+    s->reg.n_sub = n_sub;
+}
+
+/*
+ * Returns where the shard starting at beg of a region of tid ending at end
+ * should end.
+ */
+static int mplp_next_cut(mplp_conf_t *conf, mplp_run_t *run, bam1_t *b, int tid, int beg, int end)
+{
+    int e = beg + MPLP_SHARD_LEN;
+    while (e < end && !mplp_cut_ok(conf, run, b, tid, e)) e += MPLP_SHARD_STEP;
+    return e < end? e : end;
+}
+
+/*
+ * Cuts the regions into shards of about MPLP_SHARD_LEN at positions checked
+ * by mplp_cut_ok(), so that the output is the same as with a single thread.
+ * A region streamed through several sub-regions is cut between them,
+ * leaving out the gaps.
+ */
+static mplp_shard_t *mplp_make_shards(mplp_conf_t *conf, mplp_run_t *run, int nreg, const mplp_region_t *regs, int *n_shard)
+{
+    mplp_shard_t *shard = NULL;
+    bam1_t *b = bam_init1();
+    int i, j, k, n = 0, m = 0;
+    for (i = 0; i < nreg; ++i) {
+        const mplp_region_t *r = &regs[i];
+        int beg, end = r->end;
+        if (end > (int)run->h->target_len[r->tid]) end = run->h->target_len[r->tid];
+        if (r->n_sub == 0) {
+            beg = r->beg;
+            do {
+                int e = mplp_next_cut(conf, run, b, r->tid, beg, end);
+                mplp_add_shard(&shard, &n, &m, r, beg, e, 0, 0);
+                beg = e;
+            } while (beg < end);
+            continue;
+        }
+        for (j = 0; j < r->n_sub; j = k + 1) {
+            beg = r->sub[j].beg;
+            for (k = j; k + 1 < r->n_sub && (r->sub[k+1].end - beg <= MPLP_SHARD_LEN
+                        || !mplp_cut_ok(conf, run, b, r->tid, r->sub[k+1].beg)); ++k);
+            if (k > j || r->sub[j].end - beg <= MPLP_SHARD_LEN) {
+                mplp_add_shard(&shard, &n, &m, r, beg, r->sub[k].end, &r->sub[j], k - j + 1);
+                continue;
+            }
+            while (beg < r->sub[j].end) { // a single long sub-region
+                int e = mplp_next_cut(conf, run, b, r->tid, beg, r->sub[j].end);
+                mplp_add_shard(&shard, &n, &m, r, beg, e, &r->sub[j], 1);
+                beg = e;
+            }
+        }
+    }
+    bam_destroy1(b);
+    *n_shard = n;
+    return shard;
+}
+
+/*
+ * Piles up the regions with conf->n_threads worker threads and writes the
+ * output through run, in region order.  If fewer threads can be started,
+ * the rest of the work is left to those that are running, or done in this
+ * thread if none is.
+ */
+static int mplp_pileup_threaded(mplp_conf_t *conf, mplp_run_t *run, int nreg, const mplp_region_t *regs, mplp_prof_t *total)
+{
+    mplp_pool_t pool;
+    mplp_worker_t *w;
+    pthread_t *tid;
+    pthread_attr_t attr;
+    int i, j, n_threads, err, ret = 0;
+
+    memset(&pool, 0, sizeof(mplp_pool_t));
+    pthread_mutex_init(&pool.lock, 0);
+    pthread_cond_init(&pool.cond, 0);
+    pool.shard = mplp_make_shards(conf, run, nreg, regs, &pool.n_shard);
+    n_threads = conf->n_threads < pool.n_shard? conf->n_threads : pool.n_shard;
+    pool.max_ahead = n_threads * MPLP_SHARD_AHEAD;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    w = (mplp_worker_t*)calloc(n_threads, sizeof(mplp_worker_t));
+    tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+    for (i = 0; i < n_threads; ++i) {
+        w[i].conf = conf;
+        w[i].pool = &pool;
+        mplp_init_worker(conf, run, &w[i].run);
+        if ((err = pthread_create(&tid[i], &attr, mplp_worker, &w[i])) != 0) {
+            fprintf(stderr, "[%s] failed to start worker thread %d of %d: %s\n", __func__, i + 1, n_threads, strerror(err));
+            mplp_destroy_worker(conf, &w[i].run);
+            break;
+        }
+    }
+    if (i < n_threads) { // go on with the threads that did start
+        pthread_mutex_lock(&pool.lock);
+        n_threads = i;
+        pool.max_ahead = n_threads * MPLP_SHARD_AHEAD;
+        pthread_mutex_unlock(&pool.lock);
+    }
+    if (n_threads == 0) { // or pile up the regions in this thread
+        for (i = 0; i < nreg; ++i) {
+            if ((ret = mplp_pileup_region(conf, run, &regs[i])) < 0) break;
+            mplp_profile_region(conf, run, &regs[i], &run->prof, total);
+        }
+        pool.n_written = pool.n_shard;
+    }
+
+    for (i = pool.n_written; i < pool.n_shard; ++i) {
+        mplp_shard_t *s = &pool.shard[i];
+        pthread_mutex_lock(&pool.lock);
+        while (!s->done) pthread_cond_wait(&pool.cond, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+        if (s->ret < 0) {
+            ret = s->ret;
+            break;
+        }
+        mplp_profile_region(conf, run, &s->reg, &s->prof, total);
+        if (s->l_text) fwrite(s->text, 1, s->l_text, run->pileup_fp);
+        free(s->text);
+        for (j = 0; j < s->n_rec; ++j) {
+            bcf_write1(run->bcf_fp, run->bcf_hdr, s->rec[j]);
+            bcf_destroy1(s->rec[j]);
+        }
+        free(s->rec);
+        pthread_mutex_lock(&pool.lock);
+        pool.n_written = i + 1;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < n_threads; ++i) {
+        pthread_join(tid[i], 0);
+        mplp_destroy_worker(conf, &w[i].run);
+    }
+    for (i = pool.n_written; i < pool.n_shard; ++i) { // left over after an error
+        free(pool.shard[i].text);
+        for (j = 0; j < pool.shard[i].n_rec; ++j) bcf_destroy1(pool.shard[i].rec[j]);
+        free(pool.shard[i].rec);
+    }
+    free(pool.shard); free(tid); free(w);
+    pthread_attr_destroy(&attr);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    return ret;
+}
+
+/*
+ * Performs pileup
+ * @param conf configuration for this pileup
+ * @param n number of files specified in fn
+ * @param fn filenames
+ * @param nreg number of regions in reg; 0 piles up the whole input
+ * @param reg region strings, piled up one after another in the given order
+ * @param is_bed reg comes from -l: the regions are sorted, merged and clipped
+ *               to conf->reg, so that each position is output only once
+ *
+ * The regions are parsed and the inputs, indices, sample table and calling
+ * state, as well as the output and its header, are set up only once, however
+ * many regions are given.  With conf->n_threads > 1 the regions, or all
+ * contigs if there are none, are piled up in parallel.
+ */
+static int mpileup(mplp_conf_t *conf, int n, char **fn, int nreg, char **reg, int is_bed)
+{
+    mplp_run_t run;
+    mplp_prof_t total;
+    mplp_region_t *regs, *spans = NULL, *plan;
+    int i, j, ret = 0, n_plan, threaded = conf->n_threads > 1;
+
+    // threads work on regions, so they need the indices even without -r/-l.
+    // Regions only need the reference around them; without any, contigs are
+    // loaded whole, also by threads that pile them up in pieces, so that -@
+    // sees the same reference as a single thread
+    mplp_init_run(conf, n, fn, nreg > 0 || is_bed || threaded, nreg > 0 || is_bed? MPLP_REF_MARGIN : -1, &run);
+    regs = calloc(nreg? nreg : run.h->n_targets, sizeof(mplp_region_t));
+    for (i = j = 0; i < nreg; ++i) {
+        if (mplp_parse_region(run.h, reg[i], &regs[j]) >= 0) ++j;
+        else if (!is_bed) { // contigs missing from a BED file are just not covered
+            fprintf(stderr, "[E::%s] fail to parse region '%s'\n", __func__, reg[i]);
+            exit(1);
+        }
+    }
+    nreg = j;
+    if (is_bed) {
+        mplp_region_t clip;
+        if (conf->reg && mplp_parse_region(run.h, conf->reg, &clip) < 0) {
+            fprintf(stderr, "[E::%s] fail to parse region '%s'\n", __func__, conf->reg);
+            exit(1);
+        }
+        nreg = mplp_merge_regions(nreg, regs, conf->reg? &clip : NULL);
+        spans = mplp_span_regions(nreg, regs, conf->region_gap, &n_plan);
+        plan = n_plan? mplp_plan_regions(conf, &run, n_plan, spans, &n_plan) : spans;
+    } else if (threaded && nreg == 0) {
+        n_plan = run.h->n_targets;
+        for (i = 0; i < n_plan; ++i)
+            regs[i].tid = i, regs[i].beg = 0, regs[i].end = run.h->target_len[i];
+        plan = regs;
+    } else plan = regs, n_plan = nreg;
+
+    // One output and header for the whole run; the records of all regions
+    // are appended to it in order
+    mplp_open_output(conf, &run);
+    memset(&total, 0, sizeof(mplp_prof_t));
+    if (conf->profile_fp) fputs("{\"regions\":[\n", conf->profile_fp);
+    if (threaded)
+        ret = n_plan? mplp_pileup_threaded(conf, &run, n_plan, plan, &total) : 0;
+    else if (nreg == 0 && !is_bed) {
+        ret = mplp_pileup_region(conf, &run, NULL);
+        mplp_profile_region(conf, &run, NULL, &run.prof, &total);
+    } else {
+        for (i = 0; i < n_plan; ++i) {
+            if ((ret = mplp_pileup_region(conf, &run, &plan[i])) < 0) break;
+            mplp_profile_region(conf, &run, &plan[i], &run.prof, &total);
+        }
+    }
+    if (conf->profile_fp) {
+        fputs("],", conf->profile_fp);
+        if (run.n_block)
+            fprintf(conf->profile_fp, "\"plan\":{\"regions\":%d,\"blocks\":%d,\"streamed\":%d,\"by_seek\":%d,\"bytes\":%lld},",
+                    run.n_planned, run.n_block, run.n_stream, run.n_block - run.n_stream, (long long)run.plan_bytes);
+        fputs("\"total\":{", conf->profile_fp);
+        mplp_prof_print(conf->profile_fp, &total);
+        fputs("}}\n", conf->profile_fp);
+    }
+    mplp_close_output(conf, &run);
+    if (plan != regs && plan != spans) free(plan);
+    free(spans);
+    free(regs);
+    mplp_destroy_run(conf, &run);
     return ret;
 }
 
@@ -923,11 +2269,23 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 "                                            [%s]\n", tmp_filter);
     fprintf(fp,
 "  -x, --ignore-overlaps   disable read-pair overlap detection\n"
+"  -@, --threads INT       pile up regions in INT threads; needs indexed input [1]\n"
+"      --plan STR          read blocks of -l regions by: auto, stream or seek [auto]\n"
+"      --region-gap INT    read -l regions up to INT bp apart in one pass [%d]\n", mplp->region_gap);
+    fprintf(fp,
+"      --refcachesize INT  reference cache limit in MB, per thread [%d]\n", mplp->refcachesizemb);
+    fprintf(fp,
+"      --baqcachesize INT  keep the BAQ of reads fetched by several regions;\n"
+"                          limit in MB per input file and thread [0]\n"
+"      --bamcachesize INT  keep BAM records read by regions, to read them once;\n"
+"                          limit in MB per input file and thread [50 with -l, else 0]\n"
 "\n"
 "Output options:\n"
 "  -o, --output FILE       write output to FILE [standard output]\n"
 "  -g, --BCF               generate genotype likelihoods in BCF format\n"
 "  -v, --VCF               generate genotype likelihoods in VCF format\n"
+"      --profile FILE      write read and position counts and timings per region\n"
+"                          to FILE as JSON\n"
 "\n"
 "Output options for mpileup format (without -g/-v):\n"
 "  -O, --output-BP         output base positions on reads\n"
@@ -947,6 +2305,10 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 "  -I, --skip-indels       do not perform indel calling\n"
 "  -L, --max-idepth INT    maximum per-sample depth for INDEL calling [%d]\n", mplp->max_indel_depth);
     fprintf(fp,
+"      --subsample-indels  call INDELs at deeper sites from -L reads per sample\n"
+"                          per sample instead of skipping them\n"
+"      --indel-seed INT    seed for the choice of reads by --subsample-indels [0]\n");
+    fprintf(fp,
 "  -m, --min-ireads INT    minimum number gapped reads for indel candidates [%d]\n", mplp->min_support);
     fprintf(fp,
 "  -o, --open-prob INT     Phred-scaled gap open seq error probability [%d]\n", mplp->openQ);
@@ -966,13 +2328,14 @@ int bam_mpileup(int argc, char *argv[])
     const char *file_list = NULL;
     char **fn = NULL;
     int nfiles = 0, use_orphan = 0;
-    int multipileup = 0;  // mar4: cw mod
-    int few_bed_regions = 0;  // mar4: few bed regions for -l option
+    const char *bed_fname = NULL; // regions for -l / --MULTIPILEUP
     mplp_conf_t mplp;
     memset(&mplp, 0, sizeof(mplp_conf_t));
     mplp.min_baseQ = 13;
     mplp.capQ_thres = 0;
     mplp.max_depth = 250; mplp.max_indel_depth = 250;
+    mplp.refcachesizemb = 256;
+    mplp.region_gap = 1000;
     mplp.openQ = 40; mplp.extQ = 20; mplp.tandemQ = 100;
     mplp.min_frac = 0.002; mplp.min_support = 1;
     mplp.flag = MPLP_NO_ORPHAN | MPLP_REALN | MPLP_SMART_OVERLAPS;
@@ -990,6 +2353,14 @@ int bam_mpileup(int argc, char *argv[])
         {"illumina1.3+", no_argument, NULL, '6'},
         {"MULTIPILEUP",  required_argument, NULL, 7}, // mar4: cw multipileup mode, arg is file
         {"bamcachesize", required_argument, NULL, 8}, // mar4: cw set cachesize, arg is cachesize in MB
+        {"refcachesize", required_argument, NULL, 9}, // reference cache limit in MB
+        {"threads", required_argument, NULL, '@'},
+        {"plan", required_argument, NULL, 10}, // read -l regions by: auto, stream or seek
+        {"region-gap", required_argument, NULL, 11}, // -l regions this close share an iterator
+        {"profile", required_argument, NULL, 12}, // write per-region counters and timings as JSON
+        {"baqcachesize", required_argument, NULL, 13}, // BAQ result cache limit in MB, per input file and thread
+        {"subsample-indels", no_argument, NULL, 14},
+        {"indel-seed", required_argument, NULL, 15},
         {"count-orphans", no_argument, NULL, 'A'},
         {"bam-list", required_argument, NULL, 'b'},
         {"no-BAQ", no_argument, NULL, 'B'},
@@ -1032,7 +2403,7 @@ int bam_mpileup(int argc, char *argv[])
         {"platforms", required_argument, NULL, 'P'},
         {NULL, 0, NULL, 0}
     };
-    while ((c = getopt_long(argc, argv, "Agf:r:l:q:Q:uRC:BDSd:L:b:P:po:e:h:Im:F:EG:6OsVvxt:",lopts,NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "Agf:r:l:q:Q:uRC:BDSd:L:b:P:po:e:h:Im:F:EG:6OsVvxt:@:",lopts,NULL)) >= 0) {
         switch (c) {
         case 'x': mplp.flag &= ~MPLP_SMART_OVERLAPS; break;
         case  1 :
@@ -1046,12 +2417,30 @@ int bam_mpileup(int argc, char *argv[])
         case  3 : mplp.output_fname = optarg; break;
         case  4 : mplp.openQ = atoi(optarg); break;
         case  7 :     // mar4: turn on Chris's mods
-          mplp.bed = strdup(optarg);
-          multipileup = 1;
+          bed_fname = optarg;
           break;
         case  8 :    // mar4: set cache size
           mplp.bamcachesizemb = atoi(optarg);
           break;
+        case  9 : mplp.refcachesizemb = atoi(optarg); break;
+        case '@': mplp.n_threads = atoi(optarg); break;
+        case 10 :
+            if (strcmp(optarg, "auto") == 0) mplp.plan = MPLP_PLAN_AUTO;
+            else if (strcmp(optarg, "stream") == 0) mplp.plan = MPLP_PLAN_STREAM;
+            else if (strcmp(optarg, "seek") == 0) mplp.plan = MPLP_PLAN_SEEK;
+            else { fprintf(stderr,"Could not parse --plan %s\n", optarg); return 1; }
+            break;
+        case 11 : mplp.region_gap = atoi(optarg); break;
+        case 13 : mplp.baqcachesizemb = atoi(optarg); break;
+        case 14 : mplp.flag |= MPLP_SUBSAMPLE_INDEL; break;
+        case 15 : mplp.indel_seed = strtoul(optarg, NULL, 10); break;
+        case 12 :
+            mplp.profile_fp = fopen(optarg, "w");
+            if (mplp.profile_fp == NULL) {
+                fprintf(stderr,"Could not open --profile %s: %s\n", optarg, strerror(errno));
+                return 1;
+            }
+            break;
         case 'f':
             mplp.fai = fai_load(optarg);
             if (mplp.fai == 0) return 1;
@@ -1061,19 +2450,10 @@ int bam_mpileup(int argc, char *argv[])
         case 'r': mplp.reg = strdup(optarg); break;
         case 'l':
                   // In the original version the whole BAM was streamed which is inefficient
-                  //  with few BED intervals and big BAMs. Todo: devise a heuristic to determine
-                  //  best strategy, that is streaming or jumping.
-                  few_bed_regions = 1;  // mar4: set up to always use my new code
-                  if (few_bed_regions) 
-                  {
-                    mplp.bed = strdup(optarg); // mar4: new code I'm adding to use cw's performance improvements
-                    mplp.bamcachesizemb = 50;  // mar4: hard-code for now 
-                  } 
-                  else 
-                  {
-                    mplp.bed = bed_read(optarg);  // mar4: the original functionality
-                  }
-                  if (!mplp.bed) { print_error_errno("Could not read file \"%s\"", optarg); return 1; }
+                  //  with few BED intervals and big BAMs. Now mplp_plan_regions() decides,
+                  //  for each sorted block of intervals, between seeking and streaming.
+                  bed_fname = optarg;
+                  if (!mplp.bamcachesizemb) mplp.bamcachesizemb = 50;
                   break;
         case 'P': mplp.pl_list = strdup(optarg); break;
         case 'p': mplp.flag |= MPLP_PER_SAMPLE; break;
@@ -1139,45 +2519,29 @@ int bam_mpileup(int argc, char *argv[])
     int ret;
     if (file_list) {
         if ( read_file_list(file_list,&nfiles,&fn) ) return 1;
-        ret = mpileup(&mplp,nfiles,fn);
+    } else {
+        nfiles = argc - optind;
+        fn = argv + optind;
+    }
+    if (bed_fname) {
+        // The BED intervals are merged and piled up in coordinate order, within -r if given
+        int nreg;
+        char **reg;
+        if ( bed_read_as_array(bed_fname, &nreg, &reg) ) return 1;
+        ret = mpileup(&mplp, nfiles, fn, nreg, reg, 1);
+        for (c=0; c<nreg; c++) free(reg[c]);
+        free(reg);
+    } else {
+        ret = mpileup(&mplp, nfiles, fn, mplp.reg? 1 : 0, &mplp.reg, 0);
+    }
+    if (file_list) {
         for (c=0; c<nfiles; c++) free(fn[c]);
         free(fn);
-    } else if (few_bed_regions || multipileup)  { // mar4: use filecaching
-      // mar4: cw comment: Loop over BED file, inserting each line into mplp.reg before mpileup
-      fprintf(stderr,"mar4: few_bed_regions\n");
-      const char* bedfilename = (const char*) mplp.bed;
-      int nbedlines;
-      char **region_lines = NULL;
-      int mary = bed_read_as_array(bedfilename,&nbedlines,&region_lines);
-      //fprintf(stderr,"mar4: region_lines[%i] = %s\n",ix,region_lines[ix]);
-      fprintf(stderr,"mar4: back in %s, nbedlines = %i\n",__func__,nbedlines);
-      //fprintf(stderr,"mar4: mplp.bed:    %s\n",mplp.bed);
-      int ix;
-      int numbamfiles = argc - optind;
-      
-      mplp.bed = (void*) 0;
-      fprintf(stderr,"mar4: after mplp.bed assignment.\n");
-      //if (read_bed_lines(bedfilename,&nbedlines,&fn) ) return 1;
-      mplp.filecache = calloc(numbamfiles, sizeof(mplp_filecache_t));
-      // mar4: cw comment: read each line in BED file, inserting into mplp.reg before mpileup
-      fprintf(stderr,"mar4: before loop.\n");
-      for (ix = 0; ix < nbedlines ; ix++) {
-        //fixBedLine (fn[ix]);
-        fprintf(stderr,"mar4: start loop...idx = %i\n",ix);
-        fprintf(stderr,"mar4: region_lines[%i] = %s\n",ix,region_lines[ix]);
-        mplp.reg = region_lines[ix];
-        fprintf(stderr,"mar4: mplp.reg: %s\n",mplp.reg);
-        fprintf(stderr,"mar4: getting ready for mpileup.\n");
-        // mar4: trying ret = here... but we return something different in 1.0 vs 0.1.19
-        ret = mpileup(&mplp,argc-optind,argv+optind);
-      }
-      mplp.reg = 0;
-    } else { 
-        ret = mpileup(&mplp, argc - optind, argv + optind);
     }
     if (mplp.rghash) khash_str2int_destroy_free(mplp.rghash);
     free(mplp.reg); free(mplp.pl_list);
     if (mplp.fai) fai_destroy(mplp.fai);
     if (mplp.bed) bed_destroy(mplp.bed);
+    if (mplp.profile_fp) fclose(mplp.profile_fp);
     return ret;
 }
@@ -27,6 +27,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdlib.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <regex.h>
@@ -88,28 +89,121 @@ static int strnum_cmp(const char *_a, const char *_b)
     return *pa? 1 : *pb? -1 : 0;
 }
 
+/*
+ * Encodes the name of b, followed by its READ1/READ2 flags, into a key that
+ * sorts with key_cmp() as the name with strnum_cmp() and then the flags do
+ * in bam1_lt().  Each digit run becomes a byte '0'+L (or '9' and L-9 when
+ * L >= 9) for its length L without leading zeros, those L digits and 255 less
+ * the number of leading zeros; as the length byte is a digit, it compares
+ * with other characters as the run does in strnum_cmp().  key must have room
+ * for 2 * b->core.l_qname bytes.  Returns the length of the key.
+ */
+static int qname_key(const bam1_t *b, uint8_t *key)
+{
+    const uint8_t *p = (const uint8_t*)bam_get_qname(b), *q;
+    uint8_t *k = key;
+    while (*p) {
+        if (isdigit(*p)) {
+            int l, z = 0;
+            while (*p == '0') ++p, ++z;
+            for (q = p; isdigit(*q); ++q);
+            l = q - p;
+            if (l < 9) *k++ = '0' + l;
+            else *k++ = '9', *k++ = l - 9;
+            memcpy(k, p, l);
+            k += l;
+            *k++ = 255 - z;
+            p = q;
+        } else *k++ = *p++;
+    }
+    *k++ = (b->core.flag&0xc0) >> 6; // below any character, so a shorter name sorts first
+    return k - key;
+}
+
+static inline int key_cmp(const uint8_t *a, int l_a, const uint8_t *b, int l_b)
+{
+    int t = memcmp(a, b, l_a < l_b? l_a : l_b);
+    return t? t : l_a - l_b;
+}
+
 #define HEAP_EMPTY UINT64_MAX
 
 typedef struct {
     int i;
     uint64_t pos, idx;
     bam1_t *b;
+    uint8_t *key; // qname_key() of b when merging by name
+    int l_key, m_key;
 } heap1_t;
 
 #define __pos_cmp(a, b) ((a).pos > (b).pos || ((a).pos == (b).pos && ((a).i > (b).i || ((a).i == (b).i && (a).idx > (b).idx))))
 
-// Function to compare reads in the heap and determine which one is < the other
+// Function to compare the next reads of two inputs and determine which one comes after the other
 static inline int heap_lt(const heap1_t a, const heap1_t b)
 {
     if (g_is_by_qname) {
         int t;
         if (a.b == NULL || b.b == NULL) return a.b == NULL? 1 : 0;
-        t = strnum_cmp(bam_get_qname(a.b), bam_get_qname(b.b));
-        return (t > 0 || (t == 0 && (a.b->core.flag&0xc0) > (b.b->core.flag&0xc0)));
+        t = key_cmp(a.key, a.l_key, b.key, b.l_key);
+        return (t > 0 || (t == 0 && a.i > b.i));
     } else return __pos_cmp(a, b);
 }
 
-KSORT_INIT(heap, heap1_t, heap_lt)
+// Sets the key heap_lt() compares by name from h->b
+static void heap_set_key(heap1_t *h)
+{
+    int m = 2 * h->b->core.l_qname;
+    if (m > h->m_key) {
+        h->m_key = m;
+        kroundup32(h->m_key);
+        h->key = (uint8_t*)realloc(h->key, h->m_key);
+    }
+    h->l_key = qname_key(h->b, h->key);
+}
+
+/*
+ * Loser tree over the inputs of a merge.  Leaves n..2n-1 stand for inputs
+ * 0..n-1, internal node k (1 <= k < n) holds the input that lost the match
+ * played there and the input with the next read overall is kept as the
+ * winner.  When the winner's read is replaced, it replays only the matches
+ * on its path to the root, one comparison per level.
+ */
+typedef struct {
+    int n, winner;
+    int *loser;
+    const heap1_t *h; // next read of each input, indexed by input
+} merge_tree_t;
+
+static int merge_tree_play(merge_tree_t *t, int k)
+{
+    int a, b;
+    if (k >= t->n) return k - t->n;
+    a = merge_tree_play(t, k<<1);
+    b = merge_tree_play(t, k<<1|1);
+    if (heap_lt(t->h[a], t->h[b])) { t->loser[k] = a; return b; }
+    t->loser[k] = b;
+    return a;
+}
+
+static void merge_tree_init(merge_tree_t *t, int n, const heap1_t *h)
+{
+    t->n = n, t->h = h;
+    t->loser = (int*)calloc(n, sizeof(int));
+    t->winner = n > 1? merge_tree_play(t, 1) : 0;
+}
+
+// Finds the new winner after the read of the current winner was replaced
+static void merge_tree_replay(merge_tree_t *t)
+{
+    int k, w = t->winner;
+    for (k = (w + t->n)>>1; k > 0; k >>= 1) {
+        if (heap_lt(t->h[w], t->h[t->loser[k]])) {
+            int tmp = t->loser[k];
+            t->loser[k] = w, w = tmp;
+        }
+    }
+    t->winner = w;
+}
 
 typedef struct trans_tbl {
     int32_t n_targets;
@@ -566,6 +660,188 @@ int* rtrans_build(int n, int n_targets, trans_tbl_t* translation_tbl)
  * file. Finally we write our chosen read it to the output file.
  */
 
+/*
+ * An input of a merge.  Its reads are translated to the output header and
+ * tagged with -r before they reach the merge.  With read-ahead, a reader
+ * thread does this into a ring of MERGE_RING reads ahead of the merge, which
+ * takes each read by swapping its own bam1_t with the one in the ring slot.
+ * A reader serves several inputs in turn; inputs without one are read
+ * directly by the merge.
+ */
+#define MERGE_RING 64
+#define MERGE_BATCH 16 // reads a reader reads into a ring before moving on
+#define MERGE_MAX_MEM ((size_t)768<<20) // read-ahead memory for "samtools merge"
+
+struct merge_reader_s;
+
+typedef struct {
+    samFile *fp;
+    hts_itr_t *iter;
+    bam_hdr_t *hdr;
+    trans_tbl_t *tbl;
+    const char *RG; // RG tag to attach, or NULL
+    int RG_len;
+    // read-ahead
+    struct merge_reader_s *r; // NULL if read directly
+    bam1_t *ring[MERGE_RING];
+    int ret[MERGE_RING];
+    size_t head, tail;     // reads put in and taken out of the ring, under r->lock
+    size_t c_head, c_tail; // the merge's copies
+    size_t w_head, w_tail; // the reader's copies
+    int w_ret;             // last value returned by merge_input_read()
+} merge_input_t;
+
+typedef struct merge_reader_s {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int n, stop;
+    merge_input_t **in;
+} merge_reader_t;
+
+static int merge_input_read(merge_input_t *in, bam1_t *b)
+{
+    int ret = in->iter? sam_itr_next(in->fp, in->iter, b) : sam_read1(in->fp, in->hdr, b);
+    if (ret >= 0) {
+        bam_translate(b, in->tbl);
+        if (in->RG) {
+            uint8_t *rg = bam_aux_get(b, "RG");
+            if (rg) bam_aux_del(b, rg);
+            bam_aux_append(b, "RG", 'Z', in->RG_len + 1, (uint8_t*)in->RG);
+        }
+    }
+    return ret;
+}
+
+// Whether any input of the reader is neither finished nor full; under r->lock
+static int merge_reader_room(const merge_reader_t *r)
+{
+    int i;
+    for (i = 0; i < r->n; ++i)
+        if (r->in[i]->w_ret >= 0 && r->in[i]->w_head - r->in[i]->tail < MERGE_RING) return 1;
+    return 0;
+}
+
+static void *merge_reader_worker(void *data)
+{
+    merge_reader_t *r = (merge_reader_t*)data;
+    int i, n, stop;
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        for (i = 0; i < r->n; ++i) r->in[i]->head = r->in[i]->w_head;
+        pthread_cond_broadcast(&r->cond);
+        while (!r->stop && !merge_reader_room(r))
+            pthread_cond_wait(&r->cond, &r->lock);
+        stop = r->stop;
+        for (i = 0; i < r->n; ++i) r->in[i]->w_tail = r->in[i]->tail;
+        pthread_mutex_unlock(&r->lock);
+        if (stop) break;
+        for (i = 0; i < r->n; ++i) {
+            merge_input_t *in = r->in[i];
+            for (n = 0; n < MERGE_BATCH && in->w_head - in->w_tail < MERGE_RING && in->w_ret >= 0; ++n, ++in->w_head) {
+                int k = in->w_head % MERGE_RING;
+                in->w_ret = in->ret[k] = merge_input_read(in, in->ring[k]);
+            }
+        }
+    }
+    return 0;
+}
+
+static void merge_reader_detach(merge_reader_t *r)
+{
+    int i, k;
+    for (i = 0; i < r->n; ++i) {
+        for (k = 0; k < MERGE_RING; ++k) bam_destroy1(r->in[i]->ring[k]);
+        r->in[i]->r = NULL;
+    }
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    free(r->in);
+    r->n = 0, r->in = NULL;
+}
+
+/*
+ * Starts reading ahead the inputs that still have reads, as many as have
+ * their rings of MERGE_RING reads of rec_mem bytes fit in max_mem, with at
+ * most n_threads readers taking them in turn.  Inputs beyond that, or whose
+ * reader cannot be created, are read directly.  Returns the readers and
+ * their number in *n_readers.
+ */
+static merge_reader_t *merge_readers_start(merge_input_t *in, int n, int n_threads, size_t max_mem, size_t rec_mem, int *n_readers)
+{
+    merge_reader_t *r;
+    int i, k, n_ra, n_live = 0;
+    size_t max_ra = max_mem / (MERGE_RING * (rec_mem? rec_mem : 1));
+
+    *n_readers = 0;
+    for (i = 0; i < n; ++i)
+        if (in[i].w_ret >= 0) ++n_live;
+    n_ra = max_ra < (size_t)n_live? (int)max_ra : n_live;
+    if (n_threads > n_ra) n_threads = n_ra;
+    if (n_threads < 1) return NULL;
+    if ((r = (merge_reader_t*)calloc(n_threads, sizeof(merge_reader_t))) == NULL) return NULL;
+    for (i = 0; i < n_threads; ++i)
+        r[i].in = (merge_input_t**)calloc((n_ra + n_threads - 1) / n_threads, sizeof(merge_input_t*));
+    for (i = k = 0; i < n && k < n_ra; ++i) {
+        merge_reader_t *ri;
+        if (in[i].w_ret < 0) continue;
+        ri = &r[k++ % n_threads];
+        if (ri->in) ri->in[ri->n++] = &in[i];
+    }
+    for (i = 0; i < n_threads; ++i) {
+        merge_reader_t *ri = &r[i];
+        int j;
+        pthread_mutex_init(&ri->lock, 0);
+        pthread_cond_init(&ri->cond, 0);
+        for (j = 0; j < ri->n; ++j) {
+            for (k = 0; k < MERGE_RING; ++k) ri->in[j]->ring[k] = bam_init1();
+            ri->in[j]->r = ri;
+        }
+        if (ri->n == 0 || pthread_create(&ri->tid, 0, merge_reader_worker, ri) != 0)
+            merge_reader_detach(ri);
+    }
+    *n_readers = n_threads;
+    return r;
+}
+
+static void merge_readers_stop(merge_reader_t *r, int n_readers)
+{
+    int i;
+    for (i = 0; i < n_readers; ++i) {
+        if (r[i].n == 0) continue;
+        pthread_mutex_lock(&r[i].lock);
+        r[i].stop = 1;
+        pthread_cond_broadcast(&r[i].cond);
+        pthread_mutex_unlock(&r[i].lock);
+        pthread_join(r[i].tid, 0);
+        merge_reader_detach(&r[i]);
+    }
+    free(r);
+}
+
+/*
+ * Reads the next read of the input into *b, which may be swapped for another
+ * bam1_t.  Returns as sam_read1().
+ */
+static int merge_input_next(merge_input_t *in, bam1_t **b)
+{
+    merge_reader_t *r = in->r;
+    bam1_t *tmp;
+    int i;
+    if (r == NULL) return in->w_ret = merge_input_read(in, *b);
+    if (in->c_tail == in->c_head) {
+        pthread_mutex_lock(&r->lock);
+        in->tail = in->c_tail;
+        pthread_cond_broadcast(&r->cond);
+        while (in->head == in->tail) pthread_cond_wait(&r->cond, &r->lock);
+        in->c_head = in->head;
+        pthread_mutex_unlock(&r->lock);
+    }
+    i = in->c_tail++ % MERGE_RING;
+    tmp = *b, *b = in->ring[i], in->ring[i] = tmp;
+    return in->ret[i];
+}
+
 /*!
   @abstract    Merge multiple sorted BAM.
   @param  is_by_qname whether to sort by query name
@@ -578,16 +854,24 @@ int* rtrans_build(int n, int n_targets, trans_tbl_t* translation_tbl)
   @param  fn          names of files to be merged
   @param  flag        flags that control how the merge is undertaken
   @param  reg         region to merge
-  @param  n_threads   number of threads to use (passed to htslib)
+  @param  n_threads   number of threads to use (passed to htslib); if more
+                      than one, inputs are also read ahead by up to that
+                      many threads
+  @param  max_mem     memory for the rings of the inputs read ahead
   @discussion Padding information may NOT correctly maintained. This
   function is NOT thread safe.
  */
-int bam_merge_core2(int by_qname, const char *out, const char *mode, const char *headers, int n, char * const *fn, int flag, const char *reg, int n_threads)
+static int merge_core(int by_qname, const char *out, const char *mode, const char *headers, int n, char * const *fn, int flag, const char *reg, int n_threads, size_t max_mem)
 {
     samFile *fpout, **fp;
     heap1_t *heap;
+    merge_input_t *in;
+    merge_reader_t *readers = NULL;
+    int n_readers = 0, n_live = 0;
+    size_t rec_mem = 0;
+    merge_tree_t tree = { 0 };
     bam_hdr_t *hout = NULL;
-    int i, j, *RG_len = NULL;
+    int i, j, *RG_len = NULL, ret = 0;
     uint64_t idx = 0;
     char **RG = NULL;
     hts_itr_t **iter = NULL;
@@ -705,68 +989,92 @@ int bam_merge_core2(int by_qname, const char *out, const char *mode, const char
         return -1;
     }
 
-    // Load the first read from each file into the heap
+    // Open output file and write header, before any read-ahead thread is started
+    in = (merge_input_t*)calloc(n, sizeof(merge_input_t));
+    if ((fpout = sam_open(out, mode)) == 0) {
+        fprintf(stderr, "[%s] fail to create the output file.\n", __func__);
+        ret = -1;
+        goto merge_end;
+    }
+    if (sam_hdr_write(fpout, hout) < 0) {
+        fprintf(stderr, "[%s] fail to write the header to the output file.\n", __func__);
+        ret = -1;
+        goto merge_end;
+    }
+    if (!(flag & MERGE_UNCOMP)) hts_set_threads(fpout, n_threads);
+
+    // Load the first read from each file directly; their sizes size the rings
     for (i = 0; i < n; ++i) {
         heap1_t *h = heap + i;
+        in[i].fp = fp[i], in[i].iter = iter[i], in[i].hdr = hdr[i];
+        in[i].tbl = translation_tbl + i;
+        if (flag & MERGE_RG) in[i].RG = RG[i], in[i].RG_len = RG_len[i];
         h->i = i;
         h->b = bam_init1();
-        if ((iter[i]? sam_itr_next(fp[i], iter[i], h->b) : sam_read1(fp[i], hdr[i], h->b)) >= 0) {
-            bam_translate(h->b, translation_tbl + i);
+        if ((j = merge_input_next(&in[i], &h->b)) >= 0) {
             h->pos = ((uint64_t)h->b->core.tid<<32) | (uint32_t)((int32_t)h->b->core.pos+1)<<1 | bam_is_rev(h->b);
             h->idx = idx++;
+            if (by_qname) heap_set_key(h);
+            rec_mem += sizeof(bam1_t) + h->b->m_data;
+            ++n_live;
         }
         else {
+            if (j < -1) fprintf(stderr, "[bam_merge_core] '%s' is truncated. Continue anyway.\n", fn[i]);
             h->pos = HEAP_EMPTY;
             bam_destroy1(h->b);
             h->b = NULL;
         }
     }
 
-    // Open output file and write header
-    if ((fpout = sam_open(out, mode)) == 0) {
-        fprintf(stderr, "[%s] fail to create the output file.\n", __func__);
-        return -1;
-    }
-    sam_hdr_write(fpout, hout);
-    if (!(flag & MERGE_UNCOMP)) hts_set_threads(fpout, n_threads);
+    if (n_threads > 1 && n_live > 0)
+        readers = merge_readers_start(in, n, n_threads, max_mem, rec_mem / n_live, &n_readers);
 
     // Begin the actual merge
-    ks_heapmake(heap, n, heap);
-    while (heap->pos != HEAP_EMPTY) {
-        bam1_t *b = heap->b;
-        if (flag & MERGE_RG) {
-            uint8_t *rg = bam_aux_get(b, "RG");
-            if (rg) bam_aux_del(b, rg);
-            bam_aux_append(b, "RG", 'Z', RG_len[heap->i] + 1, (uint8_t*)RG[heap->i]);
+    merge_tree_init(&tree, n, heap);
+    while (n > 0 && heap[tree.winner].pos != HEAP_EMPTY) {
+        heap1_t *h = heap + tree.winner;
+        sam_write1(fpout, hout, h->b);
+        if ((j = merge_input_next(&in[h->i], &h->b)) >= 0) {
+            h->pos = ((uint64_t)h->b->core.tid<<32) | (uint32_t)((int)h->b->core.pos+1)<<1 | bam_is_rev(h->b);
+            h->idx = idx++;
+            if (by_qname) heap_set_key(h);
+        } else {
+            if (j < -1) fprintf(stderr, "[bam_merge_core] '%s' is truncated. Continue anyway.\n", fn[h->i]);
+            h->pos = HEAP_EMPTY;
+            bam_destroy1(h->b);
+            h->b = NULL;
         }
-        sam_write1(fpout, hout, b);
-        if ((j = (iter[heap->i]? sam_itr_next(fp[heap->i], iter[heap->i], b) : sam_read1(fp[heap->i], hdr[heap->i], b))) >= 0) {
-            bam_translate(b, translation_tbl + heap->i);
-            heap->pos = ((uint64_t)b->core.tid<<32) | (uint32_t)((int)b->core.pos+1)<<1 | bam_is_rev(b);
-            heap->idx = idx++;
-        } else if (j == -1) {
-            heap->pos = HEAP_EMPTY;
-            bam_destroy1(heap->b);
-            heap->b = NULL;
-        } else fprintf(stderr, "[bam_merge_core] '%s' is truncated. Continue anyway.\n", fn[heap->i]);
-        ks_heapadjust(heap, 0, n, heap);
+        merge_tree_replay(&tree);
     }
 
     // Clean up and close
+merge_end:
     if (flag & MERGE_RG) {
         for (i = 0; i != n; ++i) free(RG[i]);
         free(RG); free(RG_len);
     }
+    if (readers) merge_readers_stop(readers, n_readers);
     for (i = 0; i < n; ++i) {
+        free(heap[i].key);
         trans_tbl_destroy(translation_tbl + i);
         hts_itr_destroy(iter[i]);
         bam_hdr_destroy(hdr[i]);
         sam_close(fp[i]);
     }
     bam_hdr_destroy(hout);
-    sam_close(fpout);
+    if (fpout) sam_close(fpout);
     free(translation_tbl); free(fp); free(heap); free(iter); free(hdr);
-    return 0;
+    free(in); free(tree.loser);
+    return ret;
+}
+
+/*!
+  @abstract    Merge multiple sorted BAM, as merge_core() with up to
+               MERGE_MAX_MEM bytes for read-ahead.
+ */
+int bam_merge_core2(int by_qname, const char *out, const char *mode, const char *headers, int n, char * const *fn, int flag, const char *reg, int n_threads)
+{
+    return merge_core(by_qname, out, mode, headers, n, fn, flag, reg, n_threads, MERGE_MAX_MEM);
 }
 
 int bam_merge_core(int by_qname, const char *out, const char *headers, int n, char * const *fn, int flag, const char *reg)
@@ -787,7 +1095,7 @@ static void merge_usage(FILE *to)
     fprintf(to, "         -f       overwrite the output BAM if exist\n");
     fprintf(to, "         -1       compress level 1\n");
     fprintf(to, "         -l INT   compression level, from 0 to 9 [-1]\n");
-    fprintf(to, "         -@ INT   number of BAM compression threads [0]\n");
+    fprintf(to, "         -@ INT   number of BAM compression threads; inputs are read ahead if >1 [0]\n");
     fprintf(to, "         -R STR   merge file in the specified region STR [all]\n");
     fprintf(to, "         -h FILE  copy the header in FILE to <out.bam> [in1.bam]\n");
     fprintf(to, "         -c       combine RG tags with colliding IDs rather than amending them\n");
@@ -888,8 +1196,6 @@ end:
  * BAM sorting *
  ***************/
 
-#include <pthread.h>
-
 typedef bam1_t *bam1_p;
 
 static int change_SO(bam_hdr_t *h, const char *so)
@@ -926,16 +1232,116 @@ static int change_SO(bam_hdr_t *h, const char *so)
     return 0;
 }
 
+// The coordinate sort key: reference, then position, then strand
+#define bam1_pos_key(b) ((uint64_t)(b)->core.tid<<32|((b)->core.pos+1)<<1|bam_is_rev(b))
+
 // Function to compare reads and determine which one is < the other
 static inline int bam1_lt(const bam1_p a, const bam1_p b)
 {
     if (g_is_by_qname) {
         int t = strnum_cmp(bam_get_qname(a), bam_get_qname(b));
         return (t < 0 || (t == 0 && (a->core.flag&0xc0) < (b->core.flag&0xc0)));
-    } else return (((uint64_t)a->core.tid<<32|(a->core.pos+1)<<1|bam_is_rev(a)) < ((uint64_t)b->core.tid<<32|(b->core.pos+1)<<1|bam_is_rev(b)));
+    } else return bam1_pos_key(a) < bam1_pos_key(b);
 }
 KSORT_INIT(sort, bam1_p, bam1_lt)
 
+typedef struct {
+    uint64_t key;
+    bam1_p b;
+} bam1_key_t;
+
+/*
+ * Sorts buf[0..n-1] by coordinate in the order of bam1_lt().  The keys are
+ * computed once into a (key, record) array, which is sorted with a stable
+ * LSD radix sort eight bits at a time, so records with equal keys keep their
+ * input order as with ks_mergesort().  Passes over bytes that are the same
+ * in every key, such as the high bytes of tid, are skipped.
+ */
+static void sort_by_pos(size_t n, bam1_p *buf)
+{
+    size_t i, cnt[8][256];
+    bam1_key_t *a, *t, *tmp;
+    int s;
+
+    if (n < 2) return;
+    a = (bam1_key_t*)malloc(n * sizeof(bam1_key_t));
+    t = (bam1_key_t*)malloc(n * sizeof(bam1_key_t));
+    if (a == NULL || t == NULL) { // fall back to the comparison sort
+        free(a); free(t);
+        ks_mergesort(sort, n, buf, 0);
+        return;
+    }
+    memset(cnt, 0, sizeof(cnt));
+    for (i = 0; i < n; ++i) {
+        uint64_t key = bam1_pos_key(buf[i]);
+        a[i].key = key, a[i].b = buf[i];
+        for (s = 0; s < 8; ++s)
+            ++cnt[s][key>>(s<<3) & 0xff];
+    }
+    for (s = 0; s < 8; ++s) {
+        size_t *c = cnt[s], sum = 0;
+        int shift = s<<3;
+        if (c[a[0].key>>shift & 0xff] == n) continue; // all keys share this byte
+        for (i = 0; i < 256; ++i) {
+            size_t x = c[i];
+            c[i] = sum, sum += x;
+        }
+        for (i = 0; i < n; ++i)
+            t[c[a[i].key>>shift & 0xff]++] = a[i];
+        tmp = a, a = t, t = tmp;
+    }
+    for (i = 0; i < n; ++i) buf[i] = a[i].b;
+    free(a); free(t);
+}
+
+typedef struct {
+    const uint8_t *key;
+    int l_key;
+    bam1_p b;
+} bam1_name_t;
+
+static inline int bam1_name_lt(const bam1_name_t a, const bam1_name_t b)
+{
+    return key_cmp(a.key, a.l_key, b.key, b.l_key) < 0;
+}
+KSORT_INIT(sort_name, bam1_name_t, bam1_name_lt)
+
+/*
+ * Sorts buf[0..n-1] by name in the order of bam1_lt(), encoding every name
+ * once with qname_key() and merge sorting the keys with memcmp().
+ */
+static void sort_by_name(size_t n, bam1_p *buf)
+{
+    size_t i, l = 0;
+    bam1_name_t *a;
+    uint8_t *keys, *p;
+
+    if (n < 2) return;
+    for (i = 0; i < n; ++i) l += 2 * buf[i]->core.l_qname;
+    a = (bam1_name_t*)malloc(n * sizeof(bam1_name_t));
+    keys = (uint8_t*)malloc(l);
+    if (a == NULL || keys == NULL) { // fall back to comparing the names
+        free(a); free(keys);
+        ks_mergesort(sort, n, buf, 0);
+        return;
+    }
+    for (i = 0, p = keys; i < n; ++i) {
+        a[i].key = p, a[i].b = buf[i];
+        a[i].l_key = qname_key(buf[i], p);
+        p += a[i].l_key;
+    }
+    ks_mergesort(sort_name, n, a, 0);
+    for (i = 0; i < n; ++i) buf[i] = a[i].b;
+    free(a); free(keys);
+}
+
+// Sorts a block of records in the order of bam1_lt()
+static void sort_buffer(size_t n, bam1_p *buf)
+{
+    if (g_is_by_qname) sort_by_name(n, buf);
+    else sort_by_pos(n, buf);
+}
+
 typedef struct {
     size_t buf_len;
     const char *prefix;
@@ -961,7 +1367,7 @@ static void *worker(void *data)
 {
     worker_t *w = (worker_t*)data;
     char *name;
-    ks_mergesort(sort, w->buf_len, w->buf, 0);
+    sort_buffer(w->buf_len, w->buf);
     name = (char*)calloc(strlen(w->prefix) + 20, 1);
     sprintf(name, "%s.%.4d.bam", w->prefix, w->index);
     write_buffer(name, "wb1", w->buf_len, w->buf, w->h, 0);
@@ -999,6 +1405,124 @@ static int sort_blocks(int n_files, size_t k, bam1_p *buf, const char *prefix, c
     return n_files + n_threads;
 }
 
+/*
+ * Records being sorted are packed into large chunks, each record a bam1_t
+ * directly followed by its data, instead of one bam1_t and data allocation
+ * per record.  The chunks are kept and refilled from the start for every
+ * block, so after the first block reading needs no allocation at all.
+ */
+#define REC_CHUNK_SIZE (8<<20)
+
+typedef struct {
+    size_t size, used;
+    uint8_t *mem;
+} rec_chunk_t;
+
+typedef struct {
+    int n, m, cur; // chunks allocated, their capacity, chunk being filled
+    rec_chunk_t *c;
+} rec_arena_t;
+
+// Bytes a record takes in the arena
+#define rec_arena_size(b) ((sizeof(bam1_t) + (b)->l_data + 7) & ~(size_t)7)
+
+/*
+ * Copies b into the arena; the copy shares no memory with b and must not be
+ * passed to bam_destroy1().  Returns NULL if out of memory.
+ */
+static bam1_t *rec_arena_add(rec_arena_t *a, const bam1_t *b)
+{
+    size_t size = rec_arena_size(b);
+    rec_chunk_t *c = a->cur < a->n? &a->c[a->cur] : NULL;
+    bam1_t *r;
+    if (c == NULL || c->used + size > c->size) {
+        if (c && c->used > 0) c = ++a->cur < a->n? &a->c[a->cur] : NULL;
+        if (c == NULL) { // add a chunk
+            if (a->n == a->m) {
+                rec_chunk_t *tmp;
+                a->m = a->m? a->m<<1 : 16;
+                if ((tmp = (rec_chunk_t*)realloc(a->c, a->m * sizeof(rec_chunk_t))) == NULL) return NULL;
+                a->c = tmp;
+            }
+            c = &a->c[a->n++];
+            c->size = c->used = 0; c->mem = NULL;
+        }
+        if (c->size < size) { // a record larger than a chunk
+            free(c->mem);
+            c->size = size > REC_CHUNK_SIZE? size : REC_CHUNK_SIZE;
+            if ((c->mem = (uint8_t*)malloc(c->size)) == NULL) {
+                c->size = 0;
+                return NULL;
+            }
+        }
+    }
+    r = (bam1_t*)(c->mem + c->used);
+    c->used += size;
+    *r = *b;
+    r->data = (uint8_t*)(r + 1);
+    r->m_data = b->l_data;
+    memcpy(r->data, b->data, b->l_data);
+    return r;
+}
+
+/*
+ * Bytes counted against the memory limit for b: the record in the arena, its
+ * pointer in the block and the scratch space sort_buffer() needs for it.
+ */
+static inline size_t sort_rec_mem(const bam1_t *b)
+{
+    size_t mem = rec_arena_size(b) + sizeof(bam1_p);
+    if (g_is_by_qname) return mem + 2 * sizeof(bam1_name_t) + 2 * b->core.l_qname;
+    else return mem + 2 * sizeof(bam1_key_t);
+}
+
+// Empties the arena for the next block, keeping its chunks
+static void rec_arena_reset(rec_arena_t *a)
+{
+    int i;
+    for (i = 0; i < a->n; ++i) a->c[i].used = 0;
+    a->cur = 0;
+}
+
+static void rec_arena_destroy(rec_arena_t *a)
+{
+    int i;
+    for (i = 0; i < a->n; ++i) free(a->c[i].mem);
+    free(a->c);
+}
+
+/*
+ * A block of records read into memory.  With more than one thread there are
+ * two: one is sorted and written to a temporary file in the background while
+ * the next is read into the other.
+ */
+typedef struct {
+    size_t k, max_k, mem; // records, capacity of buf, bytes counted against max_mem
+    bam1_p *buf;
+    rec_arena_t arena;
+} sort_block_t;
+
+typedef struct {
+    sort_block_t *blk;
+    int n_files, n_threads;
+    const char *prefix;
+    const bam_hdr_t *h;
+    pthread_t tid;
+} sort_job_t;
+
+static void *sort_job(void *data)
+{
+    sort_job_t *j = (sort_job_t*)data;
+    j->n_files = sort_blocks(j->n_files, j->blk->k, j->blk->buf, j->prefix, j->h, j->n_threads);
+    return 0;
+}
+
+static void sort_block_reset(sort_block_t *blk)
+{
+    rec_arena_reset(&blk->arena);
+    blk->k = blk->mem = 0;
+}
+
 /*!
   @abstract Sort an unsorted BAM file based on the chromosome order
   and the leftmost position of an alignment
@@ -1008,7 +1532,10 @@ static int sort_blocks(int n_files, size_t k, bam1_p *buf, const char *prefix, c
   @param  prefix   prefix of the temporary files (prefix.NNNN.bam are written)
   @param  fnout    name of the final output file to be written
   @param  modeout  sam_open() mode to be used to create the final output file
-  @param  max_mem  approxiate maximum memory (very inaccurate)
+  @param  max_mem  maximum memory per thread for the records held in memory;
+                   with n_threads > 1 it is split between the block being
+                   read and the block being sorted and written, and then
+                   bounds the read-ahead of the final merge
   @return 0 for successful sorting, negative on errors
 
   @discussion It may create multiple temporary subalignment files
@@ -1017,17 +1544,19 @@ static int sort_blocks(int n_files, size_t k, bam1_p *buf, const char *prefix, c
  */
 int bam_sort_core_ext(int is_by_qname, const char *fn, const char *prefix, const char *fnout, const char *modeout, size_t _max_mem, int n_threads)
 {
-    int ret, i, n_files = 0;
-    size_t mem, max_k, k, max_mem;
+    int ret, i, cur = 0, n_blk, running = 0, n_files = 0, status = 0;
+    size_t max_mem;
     bam_hdr_t *header;
     samFile *fp;
-    bam1_t *b, **buf;
+    bam1_t *b;
+    sort_block_t blk[2], *bb;
+    sort_job_t job;
 
     if (n_threads < 2) n_threads = 1;
     g_is_by_qname = is_by_qname;
-    max_k = k = 0; mem = 0;
-    max_mem = _max_mem * n_threads;
-    buf = NULL;
+    n_blk = n_threads > 1? 2 : 1;
+    max_mem = _max_mem * n_threads / n_blk;
+    memset(blk, 0, sizeof(blk));
     fp = sam_open(fn, "r");
     if (fp == NULL) {
         fprintf(stderr, "[bam_sort_core] fail to open file %s\n", fn);
@@ -1037,60 +1566,88 @@ int bam_sort_core_ext(int is_by_qname, const char *fn, const char *prefix, const
     if (is_by_qname) change_SO(header, "queryname");
     else change_SO(header, "coordinate");
     // write sub files
-    for (;;) {
-        if (k == max_k) {
-            size_t kk, old_max = max_k;
-            max_k = max_k? max_k<<1 : 0x10000;
-            buf = (bam1_t**)realloc(buf, max_k * sizeof(bam1_t*));
-            for (kk = old_max; kk < max_k; ++kk) buf[kk] = NULL;
-        }
-        if (buf[k] == NULL) buf[k] = bam_init1();
-        b = buf[k];
-        if ((ret = sam_read1(fp, header, b)) < 0) break;
-        if (b->l_data < b->m_data>>2) { // shrink
-            b->m_data = b->l_data;
-            kroundup32(b->m_data);
-            b->data = (uint8_t*)realloc(b->data, b->m_data);
+    b = bam_init1();
+    bb = &blk[cur];
+    while ((ret = sam_read1(fp, header, b)) >= 0) {
+        size_t rec_mem = sort_rec_mem(b);
+        if (bb->k > 0 && bb->mem + rec_mem > max_mem) {
+            if (running) { // wait for the previous block to be written
+                pthread_join(job.tid, 0);
+                n_files = job.n_files;
+                running = 0;
+            }
+            job.blk = bb, job.n_files = n_files, job.n_threads = n_threads;
+            job.prefix = prefix, job.h = header;
+            if (n_blk > 1 && pthread_create(&job.tid, 0, sort_job, &job) == 0) {
+                running = 1;
+                bb = &blk[cur ^= 1];
+            } else {
+                sort_job(&job);
+                n_files = job.n_files;
+            }
+            sort_block_reset(bb);
         }
-        mem += sizeof(bam1_t) + b->m_data + sizeof(void*) + sizeof(void*); // two sizeof(void*) for the data allocated to pointer arrays
-        ++k;
-        if (mem >= max_mem) {
-            n_files = sort_blocks(n_files, k, buf, prefix, header, n_threads);
-            mem = k = 0;
+        if (bb->k == bb->max_k) {
+            size_t max_k = bb->max_k? bb->max_k<<1 : 0x10000;
+            bam1_t **buf = (bam1_t**)realloc(bb->buf, max_k * sizeof(bam1_t*));
+            if (buf == NULL) break;
+            bb->buf = buf, bb->max_k = max_k;
         }
+        if ((bb->buf[bb->k] = rec_arena_add(&bb->arena, b)) == NULL) break;
+        bb->mem += rec_mem;
+        ++bb->k;
+    }
+    if (running) {
+        pthread_join(job.tid, 0);
+        n_files = job.n_files;
+    }
+    if (ret >= 0) {
+        fprintf(stderr, "[bam_sort_core] failed to allocate memory for the records\n");
+        status = -1;
+        goto sort_core_end;
     }
     if (ret != -1)
         fprintf(stderr, "[bam_sort_core] truncated file. Continue anyway.\n");
     // write the final output
     if (n_files == 0) { // a single block
-        ks_mergesort(sort, k, buf, 0);
-        write_buffer(fnout, modeout, k, buf, header, n_threads);
+        sort_buffer(bb->k, bb->buf);
+        write_buffer(fnout, modeout, bb->k, bb->buf, header, n_threads);
     } else { // then merge
         char **fns;
-        n_files = sort_blocks(n_files, k, buf, prefix, header, n_threads);
+        n_files = sort_blocks(n_files, bb->k, bb->buf, prefix, header, n_threads);
+        // the blocks are written; their memory goes to the merge's read-ahead
+        for (i = 0; i < n_blk; ++i) {
+            rec_arena_destroy(&blk[i].arena);
+            free(blk[i].buf);
+        }
+        memset(blk, 0, sizeof(blk));
         fprintf(stderr, "[bam_sort_core] merging from %d files...\n", n_files);
         fns = (char**)calloc(n_files, sizeof(char*));
         for (i = 0; i < n_files; ++i) {
             fns[i] = (char*)calloc(strlen(prefix) + 20, 1);
             sprintf(fns[i], "%s.%.4d.bam", prefix, i);
         }
-        if (bam_merge_core2(is_by_qname, fnout, modeout, NULL, n_files, fns, MERGE_COMBINE_RG|MERGE_COMBINE_PG, NULL, n_threads) < 0) {
-            // Propagate bam_merge_core2() failure; it has already emitted a
+        if (merge_core(is_by_qname, fnout, modeout, NULL, n_files, fns, MERGE_COMBINE_RG|MERGE_COMBINE_PG, NULL, n_threads, _max_mem * n_threads) < 0) {
+            // Propagate merge_core() failure; it has already emitted a
             // message explaining the failure, so no further message is needed.
-            return -1;
+            status = -1;
         }
         for (i = 0; i < n_files; ++i) {
-            unlink(fns[i]);
+            if (status == 0) unlink(fns[i]);
             free(fns[i]);
         }
         free(fns);
     }
     // free
-    for (k = 0; k < max_k; ++k) bam_destroy1(buf[k]);
-    free(buf);
+sort_core_end:
+    bam_destroy1(b);
+    for (i = 0; i < n_blk; ++i) {
+        rec_arena_destroy(&blk[i].arena);
+        free(blk[i].buf);
+    }
     bam_hdr_destroy(header);
     sam_close(fp);
-    return 0;
+    return status;
 }
 
 int bam_sort_core(int is_by_qname, const char *fn, const char *prefix, size_t max_mem)
@@ -30,6 +30,8 @@ KSORT_INIT_GENERIC(uint16_t)
 
 /* table of constants generated for given depcorr and eta */
 typedef struct __errmod_coef_t {
+    /* beta[(n<<6|qual)<<8|k]: all qualities of one depth n are adjacent, as
+     * errmod_cal() only ever looks at a single n per call */
     double *fk, *beta, *lhet;
 } errmod_coef_t;
 
@@ -79,7 +81,7 @@ static errmod_coef_t *cal_coef(double depcorr, double eta)
         double le = log(e);
         double le1 = log(1.0 - e);
         for (n = 1; n <= 255; ++n) {
-            double *beta = ec->beta + (q<<16|n<<8);
+            double *beta = ec->beta + ((n<<6|q)<<8);
             sum1 = sum = 0.0;
             for (k = n; k >= 0; --k, sum1 = sum) {
                 sum = sum1 + expl(lC[n<<8|k] + k*le + (n-k)*le1);
@@ -118,6 +120,70 @@ void errmod_destroy(errmod_t *em)
     free(em->coef); free(em);
 }
 
+/* adds bases[0..n-1], in descending order of their value, to aux and w */
+static void add_sorted(const errmod_t *em, int n, const uint16_t *bases, call_aux_t *aux, int *w)
+{
+    int j;
+    for (j = n - 1; j >= 0; --j) { // calculate esum and fsum
+        uint16_t b = bases[j];
+        /* extract quality and cap at 63 */
+        int qual = b>>5 < 4? 4 : b>>5;
+        if (qual > 63) qual = 63;
+        /* extract base ORed with strand */
+        int basestrand = b&0x1f;
+        /* extract base */
+        int base = b&0xf;
+        aux->fsum[base] += em->coef->fk[w[basestrand]];
+        aux->bsum[base] += em->coef->fk[w[basestrand]] * em->coef->beta[(n<<6|qual)<<8|aux->c[base]];
+        ++aux->c[base];
+        ++w[basestrand];
+    }
+}
+
+/*
+ * Same as ks_introsort() followed by add_sorted(), but counts the bases in
+ * a quality x strand x base histogram and walks it from the top instead of
+ * sorting.  Bases of equal value are interchangeable, so the sums are
+ * accumulated in exactly the same order.  Returns -1, having done nothing,
+ * if a quality above 63 does not fit the histogram.
+ */
+static int add_counted(const errmod_t *em, int n, const uint16_t *bases, call_aux_t *aux, int *w)
+{
+    uint32_t mask[64];  // bit basestrand of mask[qual] is set if cnt[qual<<5|basestrand] is in use
+    uint64_t qmask = 0; // bit qual is set if mask[qual] is not empty
+    uint8_t cnt[64<<5]; // n <= 255
+    int j;
+
+    memset(mask, 0, sizeof(mask));
+    for (j = 0; j < n; ++j) {
+        int b = bases[j], qual = b>>5, basestrand = b&0x1f;
+        if (qual > 63) return -1;
+        if (!(mask[qual]>>basestrand & 1)) {
+            mask[qual] |= 1U<<basestrand;
+            qmask |= 1ULL<<qual;
+            cnt[b] = 0;
+        }
+        ++cnt[b];
+    }
+    while (qmask) {
+        int qual = 63 - __builtin_clzll(qmask);
+        uint32_t bs = mask[qual];
+        const double *beta = em->coef->beta + ((n<<6 | (qual < 4? 4 : qual))<<8);
+        qmask &= ~(1ULL<<qual);
+        while (bs) {
+            int basestrand = 31 - __builtin_clz(bs), base = basestrand&0xf, c;
+            bs &= ~(1U<<basestrand);
+            for (c = cnt[qual<<5|basestrand]; c > 0; --c) {
+                aux->fsum[base] += em->coef->fk[w[basestrand]];
+                aux->bsum[base] += em->coef->fk[w[basestrand]] * beta[aux->c[base]];
+                ++aux->c[base];
+                ++w[basestrand];
+            }
+        }
+    }
+    return 0;
+}
+
 //
 // em: error model to fit to data
 // m: number of alleles across all samples
@@ -142,24 +208,12 @@ int errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q)
         ks_shuffle(uint16_t, n, bases);
         n = 255;
     }
-    ks_introsort(uint16_t, n, bases);
     /* zero out w and aux */
     memset(w, 0, 32 * sizeof(int));
     memset(&aux, 0, sizeof(call_aux_t));
-
-    for (j = n - 1; j >= 0; --j) { // calculate esum and fsum
-        uint16_t b = bases[j];
-        /* extract quality and cap at 63 */
-        int qual = b>>5 < 4? 4 : b>>5;
-        if (qual > 63) qual = 63;
-        /* extract base ORed with strand */
-        int basestrand = b&0x1f;
-        /* extract base */
-        int base = b&0xf;
-        aux.fsum[base] += em->coef->fk[w[basestrand]];
-        aux.bsum[base] += em->coef->fk[w[basestrand]] * em->coef->beta[qual<<16|n<<8|aux.c[base]];
-        ++aux.c[base];
-        ++w[basestrand];
+    if (add_counted(em, n, bases, &aux, w) < 0) {
+        ks_introsort(uint16_t, n, bases);
+        add_sorted(em, n, bases, &aux, w);
     }
 
     // generate likelihood
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#include <pthread.h>
 #include "kprobaln.h"
 
 /*****************************************
@@ -39,11 +40,37 @@
 
 static float g_qual2prob[256];
 
-#define set_u(u, b, i, k) { int x=(i)-(b); x=x>0?x:0; (u)=((k)-x+1)*3; }
-
 kpa_par_t kpa_par_def = { 0.001, 0.1, 10 };
 kpa_par_t kpa_par_alt = { 0.0001, 0.01, 10 };
 
+kpa_buf_t *kpa_buf_init(void)
+{
+	return calloc(1, sizeof(kpa_buf_t));
+}
+
+static void kpa_buf_free(kpa_buf_t *buf)
+{
+	free(buf->f); free(buf->b); free(buf->fmat); free(buf->bmat); free(buf->s); free(buf->e); free(buf->qual);
+	free(buf->bq); free(buf->seq); free(buf->ref); free(buf->q); free(buf->left); free(buf->rght); free(buf->state);
+}
+
+void kpa_buf_destroy(kpa_buf_t *buf)
+{
+	if (buf == 0) return;
+	kpa_buf_free(buf);
+	free(buf);
+}
+
+// makes room for n elements of the given size in p, which has room for *m
+void *kpa_resize(void *p, size_t *m, size_t n, size_t size)
+{
+	if (n > *m) {
+		*m = n + (n>>1);
+		p = realloc(p, *m * size);
+	}
+	return p;
+}
+
 /*
   The topology of the profile HMM:
 
@@ -72,33 +99,243 @@ kpa_par_t kpa_par_alt = { 0.0001, 0.01, 10 };
 int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
 			   const kpa_par_t *c, int *state, uint8_t *q)
 {
-	double **f, **b = 0, *s, m[9], sI, sM, bI, bM, pb;
+	kpa_buf_t buf;
+	int Pr;
+	memset(&buf, 0, sizeof(kpa_buf_t));
+	Pr = kpa_glocal_buf(&buf, _ref, l_ref, _query, l_query, iqual, c, state, q);
+	kpa_buf_free(&buf);
+	return Pr;
+}
+
+/*
+  Row kernels. The matrices are stored as three arrays per row, M[], I[]
+  and D[], each W = bw2+2 long and indexed by the band offset j of
+  set_j(). The M and I cells of a row depend on the previous row only
+  and are computed by these kernels, which have SIMD versions chosen at
+  run time; the D cells depend on their left (forward) or right
+  (backward) neighbour and are computed in order by kpa_glocal_buf().
+  Every path does the same double precision operations in the same
+  order, so all give the same result.
+ */
+
+typedef struct {
+	const char *name;
+	// M[j] and I[j] for j in [jb,je]; p is row i-1 shifted so that p[j] is the M cell diagonal to j
+	void (*fwd)(const double *e, double *M, double *I, const double *p, int W, int jb, int je, const double *m);
+	// M[j] and I[j] for j in [jb,je] from the emissions, D[j+1] and I1[j], the I cell of row i+1 below j
+	void (*bwd)(const double *e, double *M, double *I, const double *D, const double *I1, int jb, int je, const double *m);
+	// multiplies M[j], I[j] and D[j] for j in [jb,je] by y
+	void (*scale)(double *M, double *I, double *D, int jb, int je, double y);
+} kpa_kern_t;
+
+static void kpa_fwd_scalar(const double *e, double *M, double *I, const double *p, int W, int jb, int je, const double *m)
+{
+	int j;
+	for (j = jb; j <= je; ++j) {
+		M[j] = e[j] * (m[0] * p[j] + m[3] * p[W+j] + m[6] * p[2*W+j]);
+		I[j] = EI * (m[1] * p[j+1] + m[4] * p[W+j+1]);
+	}
+}
+
+static void kpa_bwd_scalar(const double *e, double *M, double *I, const double *D, const double *I1, int jb, int je, const double *m)
+{
+	int j;
+	for (j = jb; j <= je; ++j) {
+		M[j] = e[j] * m[0] + EI * m[1] * I1[j] + m[2] * D[j+1];
+		I[j] = e[j] * m[3] + EI * m[4] * I1[j];
+	}
+}
+
+static void kpa_scale_scalar(double *M, double *I, double *D, int jb, int je, double y)
+{
+	int j;
+	for (j = jb; j <= je; ++j) M[j] *= y, I[j] *= y, D[j] *= y;
+}
+
+static const kpa_kern_t kpa_kern_scalar = { "scalar", kpa_fwd_scalar, kpa_bwd_scalar, kpa_scale_scalar };
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define KPA_X86
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static void kpa_fwd_sse2(const double *e, double *M, double *I, const double *p, int W, int jb, int je, const double *m)
+{
+	__m128d m0 = _mm_set1_pd(m[0]), m3 = _mm_set1_pd(m[3]), m6 = _mm_set1_pd(m[6]);
+	__m128d m1 = _mm_set1_pd(m[1]), m4 = _mm_set1_pd(m[4]), ei = _mm_set1_pd(EI);
+	int j;
+	for (j = jb; j + 1 <= je; j += 2) {
+		__m128d a = _mm_mul_pd(m0, _mm_loadu_pd(p + j));
+		a = _mm_add_pd(a, _mm_mul_pd(m3, _mm_loadu_pd(p + W + j)));
+		a = _mm_add_pd(a, _mm_mul_pd(m6, _mm_loadu_pd(p + 2*W + j)));
+		_mm_storeu_pd(M + j, _mm_mul_pd(_mm_loadu_pd(e + j), a));
+		a = _mm_add_pd(_mm_mul_pd(m1, _mm_loadu_pd(p + j + 1)), _mm_mul_pd(m4, _mm_loadu_pd(p + W + j + 1)));
+		_mm_storeu_pd(I + j, _mm_mul_pd(ei, a));
+	}
+	for (; j <= je; ++j) {
+		M[j] = e[j] * (m[0] * p[j] + m[3] * p[W+j] + m[6] * p[2*W+j]);
+		I[j] = EI * (m[1] * p[j+1] + m[4] * p[W+j+1]);
+	}
+}
+
+__attribute__((target("sse2")))
+static void kpa_bwd_sse2(const double *e, double *M, double *I, const double *D, const double *I1, int jb, int je, const double *m)
+{
+	__m128d m0 = _mm_set1_pd(m[0]), m2 = _mm_set1_pd(m[2]), m3 = _mm_set1_pd(m[3]);
+	__m128d c1 = _mm_set1_pd(EI * m[1]), c4 = _mm_set1_pd(EI * m[4]);
+	int j;
+	for (j = jb; j + 1 <= je; j += 2) {
+		__m128d ej = _mm_loadu_pd(e + j), i1 = _mm_loadu_pd(I1 + j);
+		__m128d a = _mm_add_pd(_mm_mul_pd(ej, m0), _mm_mul_pd(c1, i1));
+		_mm_storeu_pd(M + j, _mm_add_pd(a, _mm_mul_pd(m2, _mm_loadu_pd(D + j + 1))));
+		_mm_storeu_pd(I + j, _mm_add_pd(_mm_mul_pd(ej, m3), _mm_mul_pd(c4, i1)));
+	}
+	for (; j <= je; ++j) {
+		M[j] = e[j] * m[0] + EI * m[1] * I1[j] + m[2] * D[j+1];
+		I[j] = e[j] * m[3] + EI * m[4] * I1[j];
+	}
+}
+
+__attribute__((target("sse2")))
+static void kpa_scale_sse2(double *M, double *I, double *D, int jb, int je, double y)
+{
+	__m128d yy = _mm_set1_pd(y);
+	int j;
+	for (j = jb; j + 1 <= je; j += 2) {
+		_mm_storeu_pd(M + j, _mm_mul_pd(_mm_loadu_pd(M + j), yy));
+		_mm_storeu_pd(I + j, _mm_mul_pd(_mm_loadu_pd(I + j), yy));
+		_mm_storeu_pd(D + j, _mm_mul_pd(_mm_loadu_pd(D + j), yy));
+	}
+	for (; j <= je; ++j) M[j] *= y, I[j] *= y, D[j] *= y;
+}
+
+__attribute__((target("avx")))
+static void kpa_fwd_avx(const double *e, double *M, double *I, const double *p, int W, int jb, int je, const double *m)
+{
+	__m256d m0 = _mm256_set1_pd(m[0]), m3 = _mm256_set1_pd(m[3]), m6 = _mm256_set1_pd(m[6]);
+	__m256d m1 = _mm256_set1_pd(m[1]), m4 = _mm256_set1_pd(m[4]), ei = _mm256_set1_pd(EI);
+	int j;
+	for (j = jb; j + 3 <= je; j += 4) {
+		__m256d a = _mm256_mul_pd(m0, _mm256_loadu_pd(p + j));
+		a = _mm256_add_pd(a, _mm256_mul_pd(m3, _mm256_loadu_pd(p + W + j)));
+		a = _mm256_add_pd(a, _mm256_mul_pd(m6, _mm256_loadu_pd(p + 2*W + j)));
+		_mm256_storeu_pd(M + j, _mm256_mul_pd(_mm256_loadu_pd(e + j), a));
+		a = _mm256_add_pd(_mm256_mul_pd(m1, _mm256_loadu_pd(p + j + 1)), _mm256_mul_pd(m4, _mm256_loadu_pd(p + W + j + 1)));
+		_mm256_storeu_pd(I + j, _mm256_mul_pd(ei, a));
+	}
+	for (; j <= je; ++j) {
+		M[j] = e[j] * (m[0] * p[j] + m[3] * p[W+j] + m[6] * p[2*W+j]);
+		I[j] = EI * (m[1] * p[j+1] + m[4] * p[W+j+1]);
+	}
+}
+
+__attribute__((target("avx")))
+static void kpa_bwd_avx(const double *e, double *M, double *I, const double *D, const double *I1, int jb, int je, const double *m)
+{
+	__m256d m0 = _mm256_set1_pd(m[0]), m2 = _mm256_set1_pd(m[2]), m3 = _mm256_set1_pd(m[3]);
+	__m256d c1 = _mm256_set1_pd(EI * m[1]), c4 = _mm256_set1_pd(EI * m[4]);
+	int j;
+	for (j = jb; j + 3 <= je; j += 4) {
+		__m256d ej = _mm256_loadu_pd(e + j), i1 = _mm256_loadu_pd(I1 + j);
+		__m256d a = _mm256_add_pd(_mm256_mul_pd(ej, m0), _mm256_mul_pd(c1, i1));
+		_mm256_storeu_pd(M + j, _mm256_add_pd(a, _mm256_mul_pd(m2, _mm256_loadu_pd(D + j + 1))));
+		_mm256_storeu_pd(I + j, _mm256_add_pd(_mm256_mul_pd(ej, m3), _mm256_mul_pd(c4, i1)));
+	}
+	for (; j <= je; ++j) {
+		M[j] = e[j] * m[0] + EI * m[1] * I1[j] + m[2] * D[j+1];
+		I[j] = e[j] * m[3] + EI * m[4] * I1[j];
+	}
+}
+
+__attribute__((target("avx")))
+static void kpa_scale_avx(double *M, double *I, double *D, int jb, int je, double y)
+{
+	__m256d yy = _mm256_set1_pd(y);
+	int j;
+	for (j = jb; j + 3 <= je; j += 4) {
+		_mm256_storeu_pd(M + j, _mm256_mul_pd(_mm256_loadu_pd(M + j), yy));
+		_mm256_storeu_pd(I + j, _mm256_mul_pd(_mm256_loadu_pd(I + j), yy));
+		_mm256_storeu_pd(D + j, _mm256_mul_pd(_mm256_loadu_pd(D + j), yy));
+	}
+	for (; j <= je; ++j) M[j] *= y, I[j] *= y, D[j] *= y;
+}
+
+static const kpa_kern_t kpa_kern_sse2 = { "sse2", kpa_fwd_sse2, kpa_bwd_sse2, kpa_scale_sse2 };
+static const kpa_kern_t kpa_kern_avx = { "avx", kpa_fwd_avx, kpa_bwd_avx, kpa_scale_avx };
+#endif
+
+static const kpa_kern_t *kpa_kern; // set by kpa_init_once()
+static pthread_once_t kpa_once = PTHREAD_ONCE_INIT;
+
+static const kpa_kern_t *kpa_kern_pick(void)
+{
+#ifdef KPA_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx")) return &kpa_kern_avx;
+	if (__builtin_cpu_supports("sse2")) return &kpa_kern_sse2;
+#endif
+	return &kpa_kern_scalar;
+}
+
+// picks the kernel and fills g_qual2prob[]; run once, whichever thread calls first
+static void kpa_init_once(void)
+{
+	int i;
+	kpa_kern = kpa_kern_pick();
+	for (i = 0; i < 256; ++i)
+		g_qual2prob[i] = pow(10, -i/10.);
+}
+
+#define set_j(j, b, i, k) { int x=(i)-(b); x=x>0?x:0; (j)=(k)-x+1; }
+
+// clears the M, I and D cells on either side of the band [jb,je] of a row
+static inline void kpa_clear_edges(double *r, int W, int jb, int je)
+{
+	r[jb-1] = r[W+jb-1] = r[2*W+jb-1] = 0.;
+	r[je+1] = r[W+je+1] = r[2*W+je+1] = 0.;
+}
+
+/* Same as kpa_glocal(), with the matrices taken from buf. */
+int kpa_glocal_buf(kpa_buf_t *buf, const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query,
+				   const uint8_t *iqual, const kpa_par_t *c, int *state, uint8_t *q)
+{
+	double **f, **b = 0, *s, *e, m[9], sI, sM, bI, bM, pb;
 	float *qual, *_qual;
 	const uint8_t *ref, *query;
-	int bw, bw2, i, k, is_diff = 0, is_backward = 1, Pr;
+	const kpa_kern_t *kern;
+	int bw, bw2, W, i, k, is_diff = 0, is_backward = 1, Pr;
+	size_t n;
 
     if ( l_ref<=0 || l_query<=0 ) return 0; // FIXME: this may not be an ideal fix, just prevents sefgault
 
 	/*** initialization ***/
+	pthread_once(&kpa_once, kpa_init_once);
+	kern = kpa_kern;
 	is_backward = state && q? 1 : 0;
 	ref = _ref - 1; query = _query - 1; // change to 1-based coordinate
 	bw = l_ref > l_query? l_ref : l_query;
 	if (bw > c->bw) bw = c->bw;
 	if (bw < abs(l_ref - l_query)) bw = abs(l_ref - l_query);
 	bw2 = bw * 2 + 1;
-	// allocate the forward and backward matrices f[][] and b[][] and the scaling array s[]
-	f = calloc(l_query+1, sizeof(double*));
-	if (is_backward) b = calloc(l_query+1, sizeof(double*));
-	for (i = 0; i <= l_query; ++i) {    // FIXME: this will lead in segfault for l_query==0
-		f[i] = calloc(bw2 * 3 + 6, sizeof(double)); // FIXME: this is over-allocated for very short seqs
-		if (is_backward) b[i] = calloc(bw2 * 3 + 6, sizeof(double));
+	// set up the forward and backward matrices f[][] and b[][] and the scaling array s[];
+	// row i holds M[], I[] and D[] at f[i], f[i]+W and f[i]+2*W. The buffers are reused,
+	// so the cells next to the band of a row, which are read as zero, are cleared
+	W = bw2 + 2; // FIXME: this is over-allocated for very short seqs
+	n = (size_t)(l_query + 1) * W * 3;
+	buf->fmat = kpa_resize(buf->fmat, &buf->m_fmat, n, sizeof(double));
+	buf->f = kpa_resize(buf->f, &buf->m_f, l_query + 1, sizeof(double*));
+	f = buf->f;
+	for (i = 0; i <= l_query; ++i) f[i] = buf->fmat + (size_t)i * W * 3;
+	if (is_backward) {
+		buf->bmat = kpa_resize(buf->bmat, &buf->m_bmat, n, sizeof(double));
+		buf->b = kpa_resize(buf->b, &buf->m_b, l_query + 1, sizeof(double*));
+		b = buf->b;
+		for (i = 0; i <= l_query; ++i) b[i] = buf->bmat + (size_t)i * W * 3;
 	}
-	s = calloc(l_query+2, sizeof(double)); // s[] is the scaling factor to avoid underflow
+	e = buf->e = kpa_resize(buf->e, &buf->m_e, W, sizeof(double)); // emissions of the current row
+	s = buf->s = kpa_resize(buf->s, &buf->m_s, l_query + 2, sizeof(double)); // s[] is the scaling factor to avoid underflow
 	// initialize qual
-	_qual = calloc(l_query, sizeof(float));
-	if (g_qual2prob[0] == 0)
-		for (i = 0; i < 256; ++i)
-			g_qual2prob[i] = pow(10, -i/10.);
+	_qual = buf->qual = kpa_resize(buf->qual, &buf->m_qual, l_query, sizeof(float));
 	for (i = 0; i < l_query; ++i) _qual[i] = g_qual2prob[iqual? iqual[i] : 30];
 	qual = _qual - 1;
 	// initialize transition probability
@@ -109,53 +346,53 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 	bM = (1 - c->d) / l_ref; bI = c->d / l_ref; // (bM+bI)*l_ref==1
 	/*** forward ***/
 	// f[0]
-	set_u(k, bw, 0, 0);
+	set_j(k, bw, 0, 0);
 	f[0][k] = s[0] = 1.;
 	{ // f[1]
 		double *fi = f[1], sum;
 		int beg = 1, end = l_ref < bw + 1? l_ref : bw + 1, _beg, _end;
+		set_j(_beg, bw, 1, beg); set_j(_end, bw, 1, end);
+		for (k = 0; k < 3; ++k) memset(fi + k*W + _beg - 1, 0, (_end - _beg + 3) * sizeof(double));
 		for (k = beg, sum = 0.; k <= end; ++k) {
 			int u;
 			double e = (ref[k] > 3 || query[1] > 3)? 1. : ref[k] == query[1]? 1. - qual[1] : qual[1] * EM;
-			set_u(u, bw, 1, k);
-			fi[u+0] = e * bM; fi[u+1] = EI * bI;
-			sum += fi[u] + fi[u+1];
+			set_j(u, bw, 1, k);
+			fi[u] = e * bM; fi[W+u] = EI * bI;
+			sum += fi[u] + fi[W+u];
 		}
 		// rescale
 		s[1] = sum;
-		set_u(_beg, bw, 1, beg); set_u(_end, bw, 1, end); _end += 2;
-		for (k = _beg; k <= _end; ++k) fi[k] /= sum;
+		for (k = _beg; k <= _end; ++k) fi[k] /= sum, fi[W+k] /= sum, fi[2*W+k] /= sum;
 	}
 	// f[2..l_query]
 	for (i = 2; i <= l_query; ++i) {
-		double *fi = f[i], *fi1 = f[i-1], sum, qli = qual[i];
+		double *fi = f[i], *fd = fi + 2*W, sum, qli = qual[i], t[4];
 		int beg = 1, end = l_ref, x, _beg, _end;
 		uint8_t qyi = query[i];
 		x = i - bw; beg = beg > x? beg : x; // band start
 		x = i + bw; end = end < x? end : x; // band end
-		for (k = beg, sum = 0.; k <= end; ++k) {
-			int u, v11, v01, v10;
-			double e;
-			e = (ref[k] > 3 || qyi > 3)? 1. : ref[k] == qyi? 1. - qli : qli * EM;
-			set_u(u, bw, i, k); set_u(v11, bw, i-1, k-1); set_u(v10, bw, i-1, k); set_u(v01, bw, i, k-1);
-			fi[u+0] = e * (m[0] * fi1[v11+0] + m[3] * fi1[v11+1] + m[6] * fi1[v11+2]);
-			fi[u+1] = EI * (m[1] * fi1[v10+0] + m[4] * fi1[v10+1]);
-			fi[u+2] = m[2] * fi[v01+0] + m[8] * fi[v01+2];
-			sum += fi[u] + fi[u+1] + fi[u+2];
-//			fprintf(stderr, "F (%d,%d;%d): %lg,%lg,%lg\n", i, k, u, fi[u], fi[u+1], fi[u+2]); // DEBUG
+		set_j(_beg, bw, i, beg); set_j(_end, bw, i, end);
+		kpa_clear_edges(fi, W, _beg, _end);
+		for (k = 0; k < 4; ++k) t[k] = qyi > 3? 1. : k == qyi? 1. - qli : qli * EM;
+		for (k = beg; k <= end; ++k) e[_beg + k - beg] = ref[k] > 3? 1. : t[ref[k]];
+		// the band of row i-1 starts one cell to the left once i > bw
+		kern->fwd(e, fi, fi + W, f[i-1] + (i > bw) - 1, W, _beg, _end, m);
+		for (k = _beg, sum = 0.; k <= _end; ++k) {
+			fd[k] = m[2] * fi[k-1] + m[8] * fd[k-1];
+			sum += fi[k] + fi[W+k] + fd[k];
+//			fprintf(stderr, "F (%d,%d;%d): %lg,%lg,%lg\n", i, beg + k - _beg, k, fi[k], fi[W+k], fd[k]); // DEBUG
 		}
 		// rescale
 		s[i] = sum;
-		set_u(_beg, bw, i, beg); set_u(_end, bw, i, end); _end += 2;
-		for (k = _beg, sum = 1./sum; k <= _end; ++k) fi[k] *= sum;
+		kern->scale(fi, fi + W, fd, _beg, _end, 1./sum);
 	}
 	{ // f[l_query+1]
 		double sum;
 		for (k = 1, sum = 0.; k <= l_ref; ++k) {
 			int u;
-			set_u(u, bw, l_query, k);
-			if (u < 3 || u >= bw2*3+3) continue;
-		    sum += f[l_query][u+0] * sM + f[l_query][u+1] * sI;
+			set_j(u, bw, l_query, k);
+			if (u < 1 || u >= bw2+1) continue;
+		    sum += f[l_query][u] * sM + f[l_query][W+u] * sI;
 		}
 		s[l_query+1] = sum; // the last scaling factor
 	}
@@ -167,41 +404,44 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 		}
 		Pr1 += -4.343 * log(p * l_ref * l_query);
 		Pr = (int)(Pr1 + .499);
-		if (!is_backward) { // skip backward and MAP
-			for (i = 0; i <= l_query; ++i) free(f[i]);
-			free(f); free(s); free(_qual);
-			return Pr;
-		}
+		if (!is_backward) return Pr; // skip backward and MAP
 	}
 	/*** backward ***/
 	// b[l_query] (b[l_query+1][0]=1 and thus \tilde{b}[][]=1/s[l_query+1]; this is where s[l_query+1] comes from)
+	{
+		int beg = 1, end = l_ref, x, _beg, _end;
+		x = l_query - bw; beg = beg > x? beg : x;
+		x = l_query + bw; end = end < x? end : x;
+		set_j(_beg, bw, l_query, beg); set_j(_end, bw, l_query, end);
+		kpa_clear_edges(b[l_query], W, _beg, _end);
+	}
 	for (k = 1; k <= l_ref; ++k) {
 		int u;
 		double *bi = b[l_query];
-		set_u(u, bw, l_query, k);
-		if (u < 3 || u >= bw2*3+3) continue;
-		bi[u+0] = sM / s[l_query] / s[l_query+1]; bi[u+1] = sI / s[l_query] / s[l_query+1];
+		set_j(u, bw, l_query, k);
+		if (u < 1 || u >= bw2+1) continue;
+		bi[u] = sM / s[l_query] / s[l_query+1]; bi[W+u] = sI / s[l_query] / s[l_query+1];
 	}
 	// b[l_query-1..1]
 	for (i = l_query - 1; i >= 1; --i) {
-		int beg = 1, end = l_ref, x, _beg, _end;
-		double *bi = b[i], *bi1 = b[i+1], y = (i > 1), qli1 = qual[i+1];
+		int beg = 1, end = l_ref, x, _beg, _end, d;
+		double *bi = b[i], *bi1 = b[i+1], *bd = bi + 2*W, y = (i > 1), qli1 = qual[i+1], t[4];
 		uint8_t qyi1 = query[i+1];
 		x = i - bw; beg = beg > x? beg : x;
 		x = i + bw; end = end < x? end : x;
+		set_j(_beg, bw, i, beg); set_j(_end, bw, i, end);
+		d = i >= bw; // the band of row i+1 starts one cell to the right
+		kpa_clear_edges(bi, W, _beg, _end);
+		for (k = 0; k < 4; ++k) t[k] = qyi1 > 3? 1. : k == qyi1? 1. - qli1 : qli1 * EM;
 		for (k = end; k >= beg; --k) {
-			int u, v11, v01, v10;
-			double e;
-			set_u(u, bw, i, k); set_u(v11, bw, i+1, k+1); set_u(v10, bw, i+1, k); set_u(v01, bw, i, k+1);
-			e = (k >= l_ref? 0 : (ref[k+1] > 3 || qyi1 > 3)? 1. : ref[k+1] == qyi1? 1. - qli1 : qli1 * EM) * bi1[v11];
-			bi[u+0] = e * m[0] + EI * m[1] * bi1[v10+1] + m[2] * bi[v01+2]; // bi1[v11] has been foled into e.
-			bi[u+1] = e * m[3] + EI * m[4] * bi1[v10+1];
-			bi[u+2] = (e * m[6] + m[8] * bi[v01+2]) * y;
-//			fprintf(stderr, "B (%d,%d;%d): %lg,%lg,%lg\n", i, k, u, bi[u], bi[u+1], bi[u+2]); // DEBUG
+			int u = _beg + k - beg;
+			e[u] = (k >= l_ref? 0 : ref[k+1] > 3? 1. : t[ref[k+1]]) * bi1[u+1-d]; // bi1[v11] has been foled into e.
+			bd[u] = (e[u] * m[6] + m[8] * bd[u+1]) * y;
 		}
+		kern->bwd(e, bi, bi + W, bd, bi1 + W - d, _beg, _end, m);
+//		for (k = _beg; k <= _end; ++k) fprintf(stderr, "B (%d,%d;%d): %lg,%lg,%lg\n", i, beg + k - _beg, k, bi[k], bi[W+k], bd[k]); // DEBUG
 		// rescale
-		set_u(_beg, bw, i, beg); set_u(_end, bw, i, end); _end += 2;
-		for (k = _beg, y = 1./s[i]; k <= _end; ++k) bi[k] *= y;
+		kern->scale(bi, bi + W, bd, _beg, _end, 1./s[i]);
 	}
 	{ // b[0]
 		int beg = 1, end = l_ref < bw + 1? l_ref : bw + 1;
@@ -209,11 +449,11 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 		for (k = end; k >= beg; --k) {
 			int u;
 			double e = (ref[k] > 3 || query[1] > 3)? 1. : ref[k] == query[1]? 1. - qual[1] : qual[1] * EM;
-			set_u(u, bw, 1, k);
-			if (u < 3 || u >= bw2*3+3) continue;
-		    sum += e * b[1][u+0] * bM + EI * b[1][u+1] * bI;
+			set_j(u, bw, 1, k);
+			if (u < 1 || u >= bw2+1) continue;
+		    sum += e * b[1][u] * bM + EI * b[1][W+u] * bI;
 		}
-		set_u(k, bw, 0, 0);
+		set_j(k, bw, 0, 0);
 		pb = b[0][k] = sum / s[0]; // if everything works as is expected, pb == 1.0
 	}
 	is_diff = fabs(pb - 1.) > 1e-7? 1 : 0;
@@ -226,9 +466,9 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 		for (k = beg; k <= end; ++k) {
 			int u;
 			double z;
-			set_u(u, bw, i, k);
-			z = fi[u+0] * bi[u+0]; if (z > max) max = z, max_k = (k-1)<<2 | 0; sum += z;
-			z = fi[u+1] * bi[u+1]; if (z > max) max = z, max_k = (k-1)<<2 | 1; sum += z;
+			set_j(u, bw, i, k);
+			z = fi[u] * bi[u]; if (z > max) max = z, max_k = (k-1)<<2 | 0; sum += z;
+			z = fi[W+u] * bi[W+u]; if (z > max) max = z, max_k = (k-1)<<2 | 1; sum += z;
 		}
 		max /= sum; sum *= s[i]; // if everything works as is expected, sum == 1.0
 		if (state) state[i-1] = max_k;
@@ -238,11 +478,6 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 				"ACGT"[query[i]], "ACGT"[ref[(max_k>>2)+1]], max_k&3, max); // DEBUG
 #endif
 	}
-	/*** free ***/
-	for (i = 0; i <= l_query; ++i) {
-		free(f[i]); free(b[i]);
-	}
-	free(f); free(b); free(s); free(_qual);
 	return Pr;
 }
 
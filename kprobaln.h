@@ -26,6 +26,7 @@
 #ifndef LH3_KPROBALN_H_
 #define LH3_KPROBALN_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct {
@@ -33,12 +34,30 @@ typedef struct {
 	int bw;
 } kpa_par_t;
 
+/* Scratch memory for kpa_glocal_buf() and bam_prob_realn_buf(), kept
+   across calls and grown when a longer read comes. One per thread. */
+typedef struct {
+	size_t m_f, m_b, m_fmat, m_bmat, m_s, m_e, m_qual;
+	double **f, **b, *fmat, *bmat, *s, *e;
+	float *qual;
+	// used by bam_prob_realn_buf()
+	size_t m_seq, m_ref;
+	uint8_t *bq, *seq, *ref, *q, *left, *rght;
+	int *state;
+} kpa_buf_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 	int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
 				   const kpa_par_t *c, int *state, uint8_t *q);
+	int kpa_glocal_buf(kpa_buf_t *buf, const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query,
+					   const uint8_t *iqual, const kpa_par_t *c, int *state, uint8_t *q);
+
+	kpa_buf_t *kpa_buf_init(void);
+	void kpa_buf_destroy(kpa_buf_t *buf);
+	void *kpa_resize(void *p, size_t *m, size_t n, size_t size);
 
 #ifdef __cplusplus
 }
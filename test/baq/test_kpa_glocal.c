@@ -0,0 +1,425 @@
+/*  test/baq/test_kpa_glocal.c -- BAQ kernel test harness.
+
+    Copyright (C) 2015 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Runs bam_prob_realn_buf() over the reads of a SAM file, with and without
+ * -E, with BQ or ZQ tags left by an earlier run, using every kpa_glocal_buf()
+ * kernel this CPU supports, and compares the records it leaves with those
+ * it leaves using the original interleaved double precision implementation,
+ * kept below as ref_glocal().
+ */
+
+#include "../../kprobaln.c"
+#include <ctype.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define set_u(u, b, i, k) { int x=(i)-(b); x=x>0?x:0; (u)=((k)-x+1)*3; }
+
+static int ref_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
+					  const kpa_par_t *c, int *state, uint8_t *q)
+{
+	double **f, **b = 0, *s, m[9], sI, sM, bI, bM, pb;
+	float *qual, *_qual;
+	const uint8_t *ref, *query;
+	int bw, bw2, i, k, is_diff = 0, is_backward = 1, Pr;
+
+    if ( l_ref<=0 || l_query<=0 ) return 0; // FIXME: this may not be an ideal fix, just prevents sefgault
+
+	/*** initialization ***/
+	is_backward = state && q? 1 : 0;
+	ref = _ref - 1; query = _query - 1; // change to 1-based coordinate
+	bw = l_ref > l_query? l_ref : l_query;
+	if (bw > c->bw) bw = c->bw;
+	if (bw < abs(l_ref - l_query)) bw = abs(l_ref - l_query);
+	bw2 = bw * 2 + 1;
+	// allocate the forward and backward matrices f[][] and b[][] and the scaling array s[]
+	f = calloc(l_query+1, sizeof(double*));
+	if (is_backward) b = calloc(l_query+1, sizeof(double*));
+	for (i = 0; i <= l_query; ++i) {    // FIXME: this will lead in segfault for l_query==0
+		f[i] = calloc(bw2 * 3 + 6, sizeof(double)); // FIXME: this is over-allocated for very short seqs
+		if (is_backward) b[i] = calloc(bw2 * 3 + 6, sizeof(double));
+	}
+	s = calloc(l_query+2, sizeof(double)); // s[] is the scaling factor to avoid underflow
+	// initialize qual
+	_qual = calloc(l_query, sizeof(float));
+	if (g_qual2prob[0] == 0) // filled backwards: [0] is only set once the rest is, for concurrent callers
+		for (i = 255; i >= 0; --i)
+			g_qual2prob[i] = pow(10, -i/10.);
+	for (i = 0; i < l_query; ++i) _qual[i] = g_qual2prob[iqual? iqual[i] : 30];
+	qual = _qual - 1;
+	// initialize transition probability
+	sM = sI = 1. / (2 * l_query + 2); // the value here seems not to affect results; FIXME: need proof
+	m[0*3+0] = (1 - c->d - c->d) * (1 - sM); m[0*3+1] = m[0*3+2] = c->d * (1 - sM);
+	m[1*3+0] = (1 - c->e) * (1 - sI); m[1*3+1] = c->e * (1 - sI); m[1*3+2] = 0.;
+	m[2*3+0] = 1 - c->e; m[2*3+1] = 0.; m[2*3+2] = c->e;
+	bM = (1 - c->d) / l_ref; bI = c->d / l_ref; // (bM+bI)*l_ref==1
+	/*** forward ***/
+	// f[0]
+	set_u(k, bw, 0, 0);
+	f[0][k] = s[0] = 1.;
+	{ // f[1]
+		double *fi = f[1], sum;
+		int beg = 1, end = l_ref < bw + 1? l_ref : bw + 1, _beg, _end;
+		for (k = beg, sum = 0.; k <= end; ++k) {
+			int u;
+			double e = (ref[k] > 3 || query[1] > 3)? 1. : ref[k] == query[1]? 1. - qual[1] : qual[1] * EM;
+			set_u(u, bw, 1, k);
+			fi[u+0] = e * bM; fi[u+1] = EI * bI;
+			sum += fi[u] + fi[u+1];
+		}
+		// rescale
+		s[1] = sum;
+		set_u(_beg, bw, 1, beg); set_u(_end, bw, 1, end); _end += 2;
+		for (k = _beg; k <= _end; ++k) fi[k] /= sum;
+	}
+	// f[2..l_query]
+	for (i = 2; i <= l_query; ++i) {
+		double *fi = f[i], *fi1 = f[i-1], sum, qli = qual[i];
+		int beg = 1, end = l_ref, x, _beg, _end;
+		uint8_t qyi = query[i];
+		x = i - bw; beg = beg > x? beg : x; // band start
+		x = i + bw; end = end < x? end : x; // band end
+		for (k = beg, sum = 0.; k <= end; ++k) {
+			int u, v11, v01, v10;
+			double e;
+			e = (ref[k] > 3 || qyi > 3)? 1. : ref[k] == qyi? 1. - qli : qli * EM;
+			set_u(u, bw, i, k); set_u(v11, bw, i-1, k-1); set_u(v10, bw, i-1, k); set_u(v01, bw, i, k-1);
+			fi[u+0] = e * (m[0] * fi1[v11+0] + m[3] * fi1[v11+1] + m[6] * fi1[v11+2]);
+			fi[u+1] = EI * (m[1] * fi1[v10+0] + m[4] * fi1[v10+1]);
+			fi[u+2] = m[2] * fi[v01+0] + m[8] * fi[v01+2];
+			sum += fi[u] + fi[u+1] + fi[u+2];
+//			fprintf(stderr, "F (%d,%d;%d): %lg,%lg,%lg\n", i, k, u, fi[u], fi[u+1], fi[u+2]); // DEBUG
+		}
+		// rescale
+		s[i] = sum;
+		set_u(_beg, bw, i, beg); set_u(_end, bw, i, end); _end += 2;
+		for (k = _beg, sum = 1./sum; k <= _end; ++k) fi[k] *= sum;
+	}
+	{ // f[l_query+1]
+		double sum;
+		for (k = 1, sum = 0.; k <= l_ref; ++k) {
+			int u;
+			set_u(u, bw, l_query, k);
+			if (u < 3 || u >= bw2*3+3) continue;
+		    sum += f[l_query][u+0] * sM + f[l_query][u+1] * sI;
+		}
+		s[l_query+1] = sum; // the last scaling factor
+	}
+	{ // compute likelihood
+		double p = 1., Pr1 = 0.;
+		for (i = 0; i <= l_query + 1; ++i) {
+			p *= s[i];
+			if (p < 1e-100) Pr1 += -4.343 * log(p), p = 1.;
+		}
+		Pr1 += -4.343 * log(p * l_ref * l_query);
+		Pr = (int)(Pr1 + .499);
+		if (!is_backward) { // skip backward and MAP
+			for (i = 0; i <= l_query; ++i) free(f[i]);
+			free(f); free(s); free(_qual);
+			return Pr;
+		}
+	}
+	/*** backward ***/
+	// b[l_query] (b[l_query+1][0]=1 and thus \tilde{b}[][]=1/s[l_query+1]; this is where s[l_query+1] comes from)
+	for (k = 1; k <= l_ref; ++k) {
+		int u;
+		double *bi = b[l_query];
+		set_u(u, bw, l_query, k);
+		if (u < 3 || u >= bw2*3+3) continue;
+		bi[u+0] = sM / s[l_query] / s[l_query+1]; bi[u+1] = sI / s[l_query] / s[l_query+1];
+	}
+	// b[l_query-1..1]
+	for (i = l_query - 1; i >= 1; --i) {
+		int beg = 1, end = l_ref, x, _beg, _end;
+		double *bi = b[i], *bi1 = b[i+1], y = (i > 1), qli1 = qual[i+1];
+		uint8_t qyi1 = query[i+1];
+		x = i - bw; beg = beg > x? beg : x;
+		x = i + bw; end = end < x? end : x;
+		for (k = end; k >= beg; --k) {
+			int u, v11, v01, v10;
+			double e;
+			set_u(u, bw, i, k); set_u(v11, bw, i+1, k+1); set_u(v10, bw, i+1, k); set_u(v01, bw, i, k+1);
+			e = (k >= l_ref? 0 : (ref[k+1] > 3 || qyi1 > 3)? 1. : ref[k+1] == qyi1? 1. - qli1 : qli1 * EM) * bi1[v11];
+			bi[u+0] = e * m[0] + EI * m[1] * bi1[v10+1] + m[2] * bi[v01+2]; // bi1[v11] has been foled into e.
+			bi[u+1] = e * m[3] + EI * m[4] * bi1[v10+1];
+			bi[u+2] = (e * m[6] + m[8] * bi[v01+2]) * y;
+//			fprintf(stderr, "B (%d,%d;%d): %lg,%lg,%lg\n", i, k, u, bi[u], bi[u+1], bi[u+2]); // DEBUG
+		}
+		// rescale
+		set_u(_beg, bw, i, beg); set_u(_end, bw, i, end); _end += 2;
+		for (k = _beg, y = 1./s[i]; k <= _end; ++k) bi[k] *= y;
+	}
+	{ // b[0]
+		int beg = 1, end = l_ref < bw + 1? l_ref : bw + 1;
+		double sum = 0.;
+		for (k = end; k >= beg; --k) {
+			int u;
+			double e = (ref[k] > 3 || query[1] > 3)? 1. : ref[k] == query[1]? 1. - qual[1] : qual[1] * EM;
+			set_u(u, bw, 1, k);
+			if (u < 3 || u >= bw2*3+3) continue;
+		    sum += e * b[1][u+0] * bM + EI * b[1][u+1] * bI;
+		}
+		set_u(k, bw, 0, 0);
+		pb = b[0][k] = sum / s[0]; // if everything works as is expected, pb == 1.0
+	}
+	is_diff = fabs(pb - 1.) > 1e-7? 1 : 0;
+	/*** MAP ***/
+	for (i = 1; i <= l_query; ++i) {
+		double sum = 0., *fi = f[i], *bi = b[i], max = 0.;
+		int beg = 1, end = l_ref, x, max_k = -1;
+		x = i - bw; beg = beg > x? beg : x;
+		x = i + bw; end = end < x? end : x;
+		for (k = beg; k <= end; ++k) {
+			int u;
+			double z;
+			set_u(u, bw, i, k);
+			z = fi[u+0] * bi[u+0]; if (z > max) max = z, max_k = (k-1)<<2 | 0; sum += z;
+			z = fi[u+1] * bi[u+1]; if (z > max) max = z, max_k = (k-1)<<2 | 1; sum += z;
+		}
+		max /= sum; sum *= s[i]; // if everything works as is expected, sum == 1.0
+		if (state) state[i-1] = max_k;
+		if (q) k = (int)(-4.343 * log(1. - max) + .499), q[i-1] = k > 100? 99 : k;
+#ifdef _MAIN
+		fprintf(stderr, "(%.10lg,%.10lg) (%d,%d:%c,%c:%d) %lg\n", pb, sum, i-1, max_k>>2,
+				"ACGT"[query[i]], "ACGT"[ref[(max_k>>2)+1]], max_k&3, max); // DEBUG
+#endif
+	}
+	/*** free ***/
+	for (i = 0; i <= l_query; ++i) {
+		free(f[i]); free(b[i]);
+	}
+	free(f); free(b); free(s); free(_qual);
+	return Pr;
+}
+
+static int use_ref_glocal; // route kpa_glocal_buf() calls of bam_md.c to ref_glocal()
+
+static int test_glocal_buf(kpa_buf_t *buf, const uint8_t *ref, int l_ref, const uint8_t *query, int l_query,
+                           const uint8_t *iqual, const kpa_par_t *c, int *state, uint8_t *q)
+{
+    if (use_ref_glocal) return ref_glocal(ref, l_ref, query, l_query, iqual, c, state, q);
+    return kpa_glocal_buf(buf, ref, l_ref, query, l_query, iqual, c, state, q);
+}
+
+#define kpa_glocal_buf test_glocal_buf
+#include "../../bam_md.c"
+#undef kpa_glocal_buf
+
+typedef struct {
+    int n, m;
+    char **name, **seq;
+    int *len;
+} ref_t;
+
+static int load_fasta(const char *fn, ref_t *r)
+{
+    char line[4096];
+    gzFile fp = gzopen(fn, "r");
+    if (fp == 0) return -1;
+    memset(r, 0, sizeof(ref_t));
+    while (gzgets(fp, line, sizeof(line))) {
+        int l = strlen(line);
+        while (l > 0 && isspace((unsigned char)line[l-1])) line[--l] = 0;
+        if (line[0] == '>') {
+            if (r->n == r->m) {
+                r->m = r->m? r->m<<1 : 4;
+                r->name = realloc(r->name, r->m * sizeof(char*));
+                r->seq = realloc(r->seq, r->m * sizeof(char*));
+                r->len = realloc(r->len, r->m * sizeof(int));
+            }
+            r->name[r->n] = strdup(strtok(line + 1, " \t"));
+            r->seq[r->n] = 0; r->len[r->n] = 0;
+            ++r->n;
+        } else if (r->n > 0) {
+            int i = r->n - 1;
+            r->seq[i] = realloc(r->seq[i], r->len[i] + l + 1);
+            memcpy(r->seq[i] + r->len[i], line, l + 1);
+            r->len[i] += l;
+        }
+    }
+    gzclose(fp);
+    return 0;
+}
+
+/*
+ * Parses a mapped SAM line into b, without its optional fields, and sets
+ * *ref to the sequence of its contig.  Returns 0 if the read is usable.
+ */
+static int parse_read(char *line, const ref_t *refs, bam1_t *b, const char **ref)
+{
+    char *f[11], *p;
+    int i, n, l_qname, n_cigar, l_qseq;
+    uint8_t *d;
+    for (n = 0, p = strtok(line, "\t\n"); p && n < 11; p = strtok(0, "\t\n")) f[n++] = p;
+    if (n < 11 || (atoi(f[1]) & 4) || strcmp(f[9], "*") == 0 || strcmp(f[10], "*") == 0) return -1;
+    for (i = 0, *ref = 0; i < refs->n; ++i)
+        if (strcmp(refs->name[i], f[2]) == 0) *ref = refs->seq[i], b->core.tid = i;
+    if (*ref == 0) return -1;
+    l_qname = strlen(f[0]) + 1;
+    l_qseq = strlen(f[9]);
+    if (strlen(f[10]) != (size_t)l_qseq) return -1;
+    for (n_cigar = 0, p = f[5]; *p; ++p) if (!isdigit((unsigned char)*p)) ++n_cigar;
+    b->l_data = l_qname + n_cigar * 4 + (l_qseq + 1) / 2 + l_qseq;
+    if (b->m_data < b->l_data) {
+        b->m_data = b->l_data;
+        kroundup32(b->m_data);
+        b->data = realloc(b->data, b->m_data);
+    }
+    b->core.flag = atoi(f[1]);
+    b->core.pos = atoi(f[3]) - 1;
+    b->core.qual = atoi(f[4]);
+    b->core.l_qname = l_qname;
+    b->core.n_cigar = n_cigar;
+    b->core.l_qseq = l_qseq;
+    b->core.mtid = -1; b->core.mpos = -1; b->core.isize = 0;
+    d = b->data;
+    memcpy(d, f[0], l_qname);
+    for (i = 0, p = f[5]; i < n_cigar; ++i) {
+        long len = strtol(p, &p, 10);
+        const char *op = strchr(BAM_CIGAR_STR, *p++);
+        if (op == 0) return -1;
+        bam_get_cigar(b)[i] = len << BAM_CIGAR_SHIFT | (op - BAM_CIGAR_STR);
+    }
+    d = bam_get_seq(b);
+    memset(d, 0, (l_qseq + 1) / 2);
+    for (i = 0; i < l_qseq; ++i) d[i>>1] |= seq_nt16_table[(unsigned char)f[9][i]] << ((~i&1)<<2);
+    d = bam_get_qual(b);
+    for (i = 0; i < l_qseq; ++i) d[i] = f[10][i] - 33;
+    return 0;
+}
+
+/*
+ * BAQ flags of bam_prob_realn_buf() to test: calmd -r and -Ar, mpileup
+ * without and with -E, each on a record fresh from the aligner (pre < 0) or
+ * already carrying the BQ or ZQ tag that a run with flag pre leaves.
+ */
+static const struct { int pre, flag; } cases[] = {
+    { -1, 0 }, { -1, 1 }, { -1, 3 }, { -1, 7 },
+    { 0, 0 }, { 0, 1 }, { 0, 3 }, { 0, 7 },
+    { 1, 0 }, { 1, 1 }, { 1, 3 }, { 1, 7 }
+};
+#define N_CASES (int)(sizeof(cases) / sizeof(cases[0]))
+
+// Runs case k on a copy of b in out; returns what bam_prob_realn_buf() does
+static int realn(kpa_buf_t *buf, const bam1_t *b, const char *ref, int k, bam1_t *out)
+{
+    bam_copy1(out, b);
+    if (cases[k].pre >= 0) bam_prob_realn_buf(buf, out, ref, cases[k].pre);
+    return bam_prob_realn_buf(buf, out, ref, cases[k].flag);
+}
+
+// Largest difference between the base qualities and BQ/ZQ values of a and b
+static int max_diff(const bam1_t *a, const bam1_t *b, long *n_diff)
+{
+    int i, d, max = 0;
+    uint8_t *qa = bam_get_qual(a), *qb = bam_get_qual(b), *ta, *tb;
+    if (a->l_data != b->l_data) return 256;
+    for (i = 0; i < a->core.l_qseq; ++i)
+        if ((d = abs((int)qa[i] - (int)qb[i])) > 0) ++*n_diff, max = d > max? d : max;
+    ta = bam_aux_get(a, "BQ"), tb = bam_aux_get(b, "BQ");
+    if (!ta) ta = bam_aux_get(a, "ZQ"), tb = bam_aux_get(b, "ZQ");
+    if (!ta != !tb) return 256;
+    for (i = 0; ta && i < a->core.l_qseq; ++i)
+        if ((d = abs((int)ta[i+1] - (int)tb[i+1])) > 0) ++*n_diff, max = d > max? d : max;
+    return max;
+}
+
+int main(int argc, char **argv)
+{
+    const kpa_kern_t *kern[3];
+    const char *fn_sam = "examples/ex1.sam.gz", *fn_ref = "examples/ex1.fa";
+    int c, i, j, k, n_kern = 0, tolerance = 0, verbose = 0, failure = 0;
+    long n_reads = 0, n_bases = 0, n_diff[3] = {0, 0, 0};
+    int max_d[3] = {0, 0, 0};
+    kpa_buf_t *buf[3], *buf0;
+    bam1_t *b, *b0, *b1;
+    char line[8192];
+    ref_t refs;
+    gzFile fp;
+
+    while ((c = getopt(argc, argv, "t:v")) != -1) {
+        switch (c) {
+        case 't': tolerance = atoi(optarg); break;
+        case 'v': ++verbose; break;
+        default:
+            printf("usage: test_kpa_glocal [-v] [-t tolerance] [in.sam[.gz] ref.fa]\n");
+            return 1;
+        }
+    }
+    if (optind + 2 <= argc) fn_sam = argv[optind], fn_ref = argv[optind+1];
+
+    pthread_once(&kpa_once, kpa_init_once); // before kpa_kern is set below
+    kern[n_kern++] = &kpa_kern_scalar;
+#ifdef KPA_X86
+    if (__builtin_cpu_supports("sse2")) kern[n_kern++] = &kpa_kern_sse2;
+    if (__builtin_cpu_supports("avx")) kern[n_kern++] = &kpa_kern_avx;
+#endif
+    for (j = 0; j < n_kern; ++j) buf[j] = kpa_buf_init();
+    buf0 = kpa_buf_init();
+    b = bam_init1(); b0 = bam_init1(); b1 = bam_init1();
+
+    if (load_fasta(fn_ref, &refs) < 0 || (fp = gzopen(fn_sam, "r")) == 0) {
+        fprintf(stderr, "test_kpa_glocal: cannot read %s or %s\n", fn_sam, fn_ref);
+        return 1;
+    }
+    while (gzgets(fp, line, sizeof(line))) {
+        const char *ref;
+        if (line[0] == '@' || parse_read(line, &refs, b, &ref) < 0) continue;
+        ++n_reads; n_bases += b->core.l_qseq;
+        for (k = 0; k < N_CASES; ++k) {
+            int ret0, ret;
+            use_ref_glocal = 1;
+            ret0 = realn(buf0, b, ref, k, b0);
+            use_ref_glocal = 0;
+            for (j = 0; j < n_kern; ++j) {
+                int d;
+                kpa_kern = kern[j];
+                ret = realn(buf[j], b, ref, k, b1);
+                d = ret != ret0? 256 : max_diff(b0, b1, &n_diff[j]);
+                if (d > max_d[j]) max_d[j] = d;
+                if (d > tolerance && verbose > 1)
+                    printf("%s: %s kernel, flag %d after %d differs by %d\n",
+                           bam_get_qname(b), kern[j]->name, cases[k].flag, cases[k].pre, d);
+            }
+        }
+    }
+    gzclose(fp);
+
+    for (j = 0; j < n_kern; ++j) {
+        int ok = max_d[j] <= tolerance;
+        if (!ok || verbose)
+            printf("%s: %s kernel, %ld reads in %d cases, %ld of %ld BQ values differ, max difference %d\n",
+                   ok? "ok" : "FAIL", kern[j]->name, n_reads, N_CASES, n_diff[j], n_bases * N_CASES, max_d[j]);
+        if (!ok) ++failure;
+        kpa_buf_destroy(buf[j]);
+    }
+    kpa_buf_destroy(buf0);
+    bam_destroy1(b); bam_destroy1(b0); bam_destroy1(b1);
+    for (i = 0; i < refs.n; ++i) free(refs.name[i]), free(refs.seq[i]);
+    free(refs.name); free(refs.seq); free(refs.len);
+    if (n_reads == 0) {
+        fprintf(stderr, "test_kpa_glocal: no reads in %s\n", fn_sam);
+        return 1;
+    }
+    return failure? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,271 @@
+/*  test/errmod/test_errmod_cal.c -- errmod_cal() differential test.
+
+    Copyright (C) 2015 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Piles up the bases of SAM files the way bam2bcf.c feeds them to
+ * errmod_cal(), per file and pooled, adds random columns of up to 600 bases,
+ * and checks that errmod_cal() gives bit for bit the likelihoods of the
+ * original sort-based implementation, kept below as ref_errmod_cal().
+ */
+
+#include "../../errmod.c"
+#include <stdio.h>
+#include <unistd.h>
+
+static double *ref_beta; // the original qual<<16|n<<8|k layout
+
+static void ref_init(void)
+{
+    int k, n, q;
+    long double sum, sum1;
+    double *lC = logbinomial_table( 256 );
+    ref_beta = (double*)calloc(256 * 256 * 64, sizeof(double));
+    for (q = 1; q != 64; ++q) {
+        double e = pow(10.0, -q/10.0);
+        double le = log(e);
+        double le1 = log(1.0 - e);
+        for (n = 1; n <= 255; ++n) {
+            double *beta = ref_beta + (q<<16|n<<8);
+            sum1 = sum = 0.0;
+            for (k = n; k >= 0; --k, sum1 = sum) {
+                sum = sum1 + expl(lC[n<<8|k] + k*le + (n-k)*le1);
+                beta[k] = -10. / M_LN10 * logl(sum1 / sum);
+            }
+        }
+    }
+    free(lC);
+}
+
+static int ref_errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q)
+{
+    call_aux_t aux;
+    int i, j, k;
+    int w[32];
+
+    memset(q, 0, m * m * sizeof(float));
+    if (n == 0) return 0;
+    if (n > 255) {
+        ks_shuffle(uint16_t, n, bases);
+        n = 255;
+    }
+    ks_introsort(uint16_t, n, bases);
+    memset(w, 0, 32 * sizeof(int));
+    memset(&aux, 0, sizeof(call_aux_t));
+
+    for (j = n - 1; j >= 0; --j) {
+        uint16_t b = bases[j];
+        int qual = b>>5 < 4? 4 : b>>5;
+        if (qual > 63) qual = 63;
+        int basestrand = b&0x1f;
+        int base = b&0xf;
+        aux.fsum[base] += em->coef->fk[w[basestrand]];
+        aux.bsum[base] += em->coef->fk[w[basestrand]] * ref_beta[qual<<16|n<<8|aux.c[base]];
+        ++aux.c[base];
+        ++w[basestrand];
+    }
+
+    for (j = 0; j < m; ++j) {
+        float tmp1, tmp3;
+        int tmp2;
+        for (k = 0, tmp1 = tmp3 = 0.0, tmp2 = 0; k < m; ++k) {
+            if (k == j) continue;
+            tmp1 += aux.bsum[k]; tmp2 += aux.c[k]; tmp3 += aux.fsum[k];
+        }
+        if (tmp2) {
+            q[j*m+j] = tmp1;
+        }
+        for (k = j + 1; k < m; ++k) {
+            int cjk = aux.c[j] + aux.c[k];
+            for (i = 0, tmp2 = 0, tmp1 = tmp3 = 0.0; i < m; ++i) {
+                if (i == j || i == k) continue;
+                tmp1 += aux.bsum[i]; tmp2 += aux.c[i]; tmp3 += aux.fsum[i];
+            }
+            if (tmp2) {
+                q[j*m+k] = q[k*m+j] = -4.343 * em->coef->lhet[cjk<<8|aux.c[k]] + tmp1;
+            } else q[j*m+k] = q[k*m+j] = -4.343 * em->coef->lhet[cjk<<8|aux.c[k]];
+        }
+        for (k = 0; k < m; ++k) if (q[j*m+k] < 0.0) q[j*m+k] = 0.0;
+    }
+    return 0;
+}
+
+typedef struct {
+    int n_col, n_bad, verbose;
+    long n_bases;
+} result_t;
+
+/* runs both implementations on a copy of col, m = 4 and 5 as the callers do */
+static void check(const errmod_t *em, const uint16_t *col, int n, result_t *res)
+{
+    uint16_t *b0 = malloc(n * 2 + 2), *b1 = malloc(n * 2 + 2);
+    float q0[25], q1[25];
+    int m;
+    for (m = 4; m <= 5; ++m) {
+        long seed = res->n_col * 10 + m;
+        memcpy(b0, col, n * 2); memcpy(b1, col, n * 2);
+        srand48(seed); ref_errmod_cal(em, n, m, b0, q0);
+        srand48(seed); errmod_cal(em, n, m, b1, q1);
+        if (memcmp(q0, q1, m * m * sizeof(float)) != 0) {
+            ++res->n_bad;
+            if (res->verbose) {
+                int i;
+                printf("column %d, %d bases, m=%d:", res->n_col, n, m);
+                for (i = 0; i < m * m; ++i) printf(" %g/%g", q0[i], q1[i]);
+                putchar('\n');
+            }
+        }
+    }
+    ++res->n_col; res->n_bases += n;
+    free(b0); free(b1);
+}
+
+typedef struct {
+    int pos;
+    uint16_t b;
+} obs_t;
+
+static int obs_cmp(const void *a, const void *b)
+{
+    const obs_t *x = a, *y = b;
+    return x->pos != y->pos? (x->pos > y->pos) - (x->pos < y->pos) : (int)x->b - (int)y->b;
+}
+
+static int nt4(int c)
+{
+    switch (c) {
+    case 'A': case 'a': return 0;
+    case 'C': case 'c': return 1;
+    case 'G': case 'g': return 2;
+    case 'T': case 't': return 3;
+    default: return 4;
+    }
+}
+
+/*
+ * Appends an observation for every aligned base of the SAM records in fn,
+ * encoded as in bam2bcf.c with the base quality capped by the mapping
+ * quality.  Returns the number of reads, or -1 on error.
+ */
+static int load_sam(const char *fn, obs_t **obs, int *n, int *m)
+{
+    char line[8192];
+    int n_reads = 0;
+    FILE *fp = fopen(fn, "r");
+    if (fp == 0) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        char *f[11], *p = line, *cig;
+        int i, flag, pos, mapq, qpos = 0;
+        if (line[0] == '@') continue;
+        for (i = 0; i < 11; ++i) {
+            f[i] = p;
+            if ((p = strchr(p, '\t')) == 0) break;
+            *p++ = 0;
+        }
+        if (i < 10) continue;
+        flag = atoi(f[1]), pos = atoi(f[3]) - 1, mapq = atoi(f[4]);
+        if ((flag & 4) || f[5][0] == '*' || f[10][0] == '*') continue;
+        if (mapq == 255) mapq = 20;
+        ++n_reads;
+        for (cig = f[5]; *cig; ) {
+            int len = strtol(cig, &cig, 10), op = *cig++;
+            if (op == 'M' || op == '=' || op == 'X') {
+                for (i = 0; i < len; ++i, ++qpos, ++pos) {
+                    int q = f[10][qpos] - 33;
+                    if (q > mapq) q = mapq;
+                    if (q > 63) q = 63;
+                    if (q < 4) q = 4;
+                    if (*n == *m) *m = *m? *m * 2 : 1024, *obs = realloc(*obs, *m * sizeof(obs_t));
+                    (*obs)[*n].pos = pos;
+                    (*obs)[(*n)++].b = q<<5 | ((flag & 16)? 1 : 0)<<4 | nt4(f[9][qpos]);
+                }
+            } else if (op == 'I' || op == 'S') qpos += len;
+            else if (op == 'D' || op == 'N') pos += len;
+        }
+    }
+    fclose(fp);
+    return n_reads;
+}
+
+static void check_pileup(const errmod_t *em, obs_t *obs, int n, result_t *res)
+{
+    uint16_t *col = malloc(n * 2 + 2);
+    int i, j, k;
+    qsort(obs, n, sizeof(obs_t), obs_cmp);
+    for (i = 0; i < n; i = j) {
+        for (j = i, k = 0; j < n && obs[j].pos == obs[i].pos; ++j) col[k++] = obs[j].b;
+        check(em, col, k, res);
+    }
+    free(col);
+}
+
+int main(int argc, char **argv)
+{
+    obs_t *all = 0;
+    int c, i, j, n_all = 0, m_all = 0;
+    result_t res;
+    errmod_t *em;
+    uint16_t col[600];
+
+    memset(&res, 0, sizeof(result_t));
+    while ((c = getopt(argc, argv, "v")) != -1) {
+        switch (c) {
+        case 'v': ++res.verbose; break;
+        default:
+            printf("usage: test_errmod_cal [-v] [in.sam ...]\n");
+            return 1;
+        }
+    }
+    em = errmod_init(1. - 0.83);
+    ref_init();
+
+    for (i = optind; i < argc; ++i) {
+        obs_t *obs = 0;
+        int n = 0, m = 0;
+        if (load_sam(argv[i], &obs, &n, &m) <= 0) {
+            fprintf(stderr, "test_errmod_cal: no reads in %s\n", argv[i]);
+            return 1;
+        }
+        check_pileup(em, obs, n, &res);
+        if (n_all + n > m_all) m_all = n_all + n, all = realloc(all, m_all * sizeof(obs_t));
+        memcpy(all + n_all, obs, n * sizeof(obs_t));
+        n_all += n;
+        free(obs);
+    }
+    if (argc - optind > 1) check_pileup(em, all, n_all, &res); // all samples as one
+    free(all);
+
+    // random columns, deep enough to be subsampled, and a few with qualities above 63
+    srand48(11);
+    for (i = 0; i < 20000; ++i) {
+        int n = i % 10? 1 + lrand48() % 64 : 1 + lrand48() % 600, max_q = i % 100? 64 : 128;
+        for (j = 0; j < n; ++j)
+            col[j] = (lrand48() % max_q)<<5 | (lrand48() & 1)<<4 | lrand48() % 5;
+        check(em, col, n, &res);
+    }
+
+    if (res.n_bad || res.verbose)
+        printf("%s: %d columns, %ld bases, %d likelihood sets differ\n",
+               res.n_bad? "FAIL" : "ok", res.n_col, res.n_bases, res.n_bad);
+    errmod_destroy(em);
+    free(ref_beta);
+    return res.n_bad? EXIT_FAILURE : EXIT_SUCCESS;
+}
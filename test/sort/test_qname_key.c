@@ -0,0 +1,115 @@
+/*  test/sort/test_qname_key.c -- qname_key() and sort_by_name() test.
+
+    Copyright (C) 2015 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Compares random read names, rich in digit runs, leading zeros and long
+ * numbers, with both key_cmp() on their qname_key() and bam1_lt() by name,
+ * and checks that sort_by_name() orders blocks of records exactly as the
+ * ks_mergesort() on bam1_lt() that it replaces.
+ */
+
+#include "../../bam_sort.c"
+
+static void set_name(bam1_t *b)
+{
+    static const char other[] = "~!AZaz:_-#/";
+    char name[64];
+    int i, l = 1 + lrand48() % 12;
+    for (i = 0; i < l; ++i) {
+        int r = lrand48() % 10;
+        if (r < 5) name[i] = '0' + lrand48() % 10;
+        else if (r < 6) name[i] = '0';
+        else name[i] = other[lrand48() % (sizeof(other) - 1)];
+    }
+    if (lrand48() % 20 == 0) // a number of more than nine digits
+        for (; i < l + 12; ++i) name[i] = '1' + lrand48() % 9;
+    name[i++] = '\0';
+    b->core.l_qname = i;
+    b->core.flag = (lrand48() % 4) << 6;
+    b->l_data = b->m_data = i;
+    b->data = (uint8_t*)realloc(b->data, i);
+    memcpy(b->data, name, i);
+}
+
+int main(int argc, char**argv)
+{
+    int verbose = 0, n_bad = 0, getopt_char;
+    long it;
+    bam1_t x, y;
+    uint8_t kx[256], ky[256];
+    while ((getopt_char = getopt(argc, argv, "v")) != -1) {
+        switch (getopt_char) {
+            case 'v':
+                ++verbose;
+                break;
+            default:
+                break;
+        }
+    }
+    srand48(0x1234330e);
+    g_is_by_qname = 1;
+    memset(&x, 0, sizeof(bam1_t)); memset(&y, 0, sizeof(bam1_t));
+
+    for (it = 0; it < 1000000; ++it) {
+        int t, l_x, l_y;
+        set_name(&x);
+        if (lrand48() % 3) set_name(&y);
+        else { // the same name, possibly other flags
+            int flag = (lrand48() % 4) << 6;
+            bam_copy1(&y, &x);
+            y.core.flag = flag;
+        }
+        l_x = qname_key(&x, kx), l_y = qname_key(&y, ky);
+        t = key_cmp(kx, l_x, ky, l_y);
+        if (bam1_lt(&x, &y) != (t < 0) || bam1_lt(&y, &x) != (t > 0)) {
+            ++n_bad;
+            if (verbose) printf("%s/%d and %s/%d compare differently\n", bam_get_qname(&x), x.core.flag, bam_get_qname(&y), y.core.flag);
+        }
+    }
+    free(x.data); free(y.data);
+
+    for (it = 0; it < 50; ++it) {
+        size_t n = it < 10? it : (size_t)(lrand48() % 20000), i;
+        bam1_t *r = (bam1_t*)calloc(n + 1, sizeof(bam1_t));
+        bam1_p *a = (bam1_p*)malloc((n + 1) * sizeof(bam1_p));
+        bam1_p *b = (bam1_p*)malloc((n + 1) * sizeof(bam1_p));
+        for (i = 0; i < n; ++i) {
+            if (i > 0 && lrand48() % 4 == 0) bam_copy1(&r[i], &r[lrand48() % i]);
+            else set_name(&r[i]);
+            a[i] = b[i] = &r[i];
+        }
+        sort_by_name(n, a);
+        ks_mergesort(sort, n, b, 0);
+        for (i = 0; i < n; ++i)
+            if (a[i] != b[i]) break;
+        if (i < n) {
+            ++n_bad;
+            if (verbose) printf("block %ld of %zu records differs at %zu\n", it, n, i);
+        }
+        for (i = 0; i < n; ++i) free(r[i].data);
+        free(r); free(a); free(b);
+    }
+
+    if (n_bad || verbose)
+        printf("%s: %d differences\n", n_bad? "FAIL" : "ok", n_bad);
+    return n_bad? EXIT_FAILURE : EXIT_SUCCESS;
+}
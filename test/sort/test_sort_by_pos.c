@@ -0,0 +1,76 @@
+/*  test/sort/test_sort_by_pos.c -- sort_by_pos() differential test.
+
+    Copyright (C) 2015 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Sorts random blocks of records, with unmapped reads, many equal keys and
+ * positions beyond 2^30, with both sort_by_pos() and the ks_mergesort() on
+ * bam1_lt() that it replaces, and checks that the records come out in the
+ * same order, equal keys included.
+ */
+
+#include "../../bam_sort.c"
+
+int main(int argc, char**argv)
+{
+    int verbose = 0, n_bad = 0, it, getopt_char;
+    while ((getopt_char = getopt(argc, argv, "v")) != -1) {
+        switch (getopt_char) {
+            case 'v':
+                ++verbose;
+                break;
+            default:
+                break;
+        }
+    }
+    srand48(0x1234330e);
+    g_is_by_qname = 0;
+
+    for (it = 0; it < 200; ++it) {
+        size_t n = it < 40? it : (size_t)(lrand48() % 50000), i;
+        int n_tid = it % 3? 1 + lrand48() % 30 : 1;
+        bam1_t *r = (bam1_t*)calloc(n + 1, sizeof(bam1_t));
+        bam1_p *x = (bam1_p*)malloc((n + 1) * sizeof(bam1_p));
+        bam1_p *y = (bam1_p*)malloc((n + 1) * sizeof(bam1_p));
+        for (i = 0; i < n; ++i) {
+            bam1_core_t *c = &r[i].core;
+            c->tid = lrand48() % 10 == 0? -1 : lrand48() % n_tid;
+            if (c->tid < 0) c->pos = -1;
+            else if (it % 5 == 0) c->pos = lrand48() % 2000000000;
+            else c->pos = lrand48() % (it % 2? 1000 : 100000000);
+            c->flag = lrand48() & BAM_FREVERSE;
+            x[i] = y[i] = &r[i];
+        }
+        sort_by_pos(n, x);
+        ks_mergesort(sort, n, y, 0);
+        for (i = 0; i < n; ++i)
+            if (x[i] != y[i]) break;
+        if (i < n) {
+            ++n_bad;
+            if (verbose) printf("block %d of %zu records differs at %zu\n", it, n, i);
+        }
+        free(r); free(x); free(y);
+    }
+
+    if (n_bad || verbose)
+        printf("%s: %d blocks differ\n", n_bad? "FAIL" : "ok", n_bad);
+    return n_bad? EXIT_FAILURE : EXIT_SUCCESS;
+}
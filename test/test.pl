@@ -463,6 +463,78 @@ sub test_mpileup
     test_cmd($opts,out=>'dat/mpileup.out.2',cmd=>"$$opts{bin}/samtools mpileup -uvDV -b $$opts{tmp}/mpileup.cram.list -f $$opts{tmp}/mpileup.ref.fa.gz -r17:100-600| grep -v ^##samtools | grep -v ^##ref");
     test_cmd($opts,out=>'dat/mpileup.out.4',cmd=>"$$opts{bin}/samtools mpileup -uv -t DP,DPR,DV,DP4,INFO/DPR,SP -b $$opts{tmp}/mpileup.cram.list -f $$opts{tmp}/mpileup.ref.fa.gz -r17:100-600| grep -v ^##samtools | grep -v ^##ref");
     test_cmd($opts,out=>'dat/mpileup.out.4',cmd=>"$$opts{bin}/samtools mpileup -uv -t DP,DPR,DV,DP4,INFO/DPR,SP -b $$opts{tmp}/mpileup.cram.list -f $$opts{tmp}/mpileup.ref.fa.gz -r17:100-600| grep -v ^##samtools | grep -v ^##ref");
+    # the same samples read from a single file, their reads interleaved
+    open(my $fhm,'>',"$$opts{tmp}/mpileup.merged.sam") or error("$$opts{tmp}/mpileup.merged.sam: $!");
+    for my $file (@files)
+    {
+        open(my $in,'<',"$$opts{path}/dat/$file.sam") or error("$$opts{path}/dat/$file.sam: $!");
+        while (my $line = <$in>)
+        {
+            next if $line =~ /^\@(HD|SQ|PG)/ && $file ne $files[0];
+            print $fhm $line if $line =~ /^\@/;
+        }
+        close($in);
+    }
+    for my $file (@files)
+    {
+        open(my $in,'<',"$$opts{path}/dat/$file.sam") or error("$$opts{path}/dat/$file.sam: $!");
+        while (my $line = <$in>) { print $fhm $line unless $line =~ /^\@/; }
+        close($in);
+    }
+    close($fhm);
+    cmd("$$opts{bin}/samtools sort -T $$opts{tmp}/mpileup.merged -o $$opts{tmp}/mpileup.merged.bam $$opts{tmp}/mpileup.merged.sam");
+    cmd("$$opts{bin}/samtools index $$opts{tmp}/mpileup.merged.bam");
+    test_cmd($opts,out=>'dat/mpileup.out.2',cmd=>"$$opts{bin}/samtools mpileup -uvDV -f $$opts{tmp}/mpileup.ref.fa.gz -r17:100-600 $$opts{tmp}/mpileup.merged.bam | grep -v ^##samtools | grep -v ^##ref");
+    # -P: reads of another platform, interleaved with the others, add no
+    # indel candidates; only the fraction of reads with an indel, IMF, changes
+    open(my $in,'<',"$$opts{path}/dat/mpileup.1.sam") or error("$$opts{path}/dat/mpileup.1.sam: $!");
+    open(my $fhp,'>',"$$opts{tmp}/mpileup.platform.sam") or error("$$opts{tmp}/mpileup.platform.sam: $!");
+    while (my $line = <$in>)
+    {
+        if ($line =~ /^\@/)
+        {
+            print $fhp $line;
+            print $fhp "\@RG\tID:solid\tSM:HG00100\tPL:SOLID\n" if $line =~ /^\@HD/;
+            next;
+        }
+        print $fhp $line;
+        chomp($line);
+        my @col = split(/\t/, $line);
+        next if $col[5] eq '*' || $col[9] eq '*' || ($col[1] & 4);
+        print $fhp join("\t", "s_$col[0]", @col[1..4], length($col[9]) . 'M', @col[6..10], "RG:Z:solid") . "\n";
+    }
+    close($in);
+    close($fhp);
+    cmd("$$opts{bin}/samtools mpileup -uv -F0 -f $$opts{tmp}/mpileup.ref.fa.gz $$opts{tmp}/mpileup.platform.sam | grep -v ^## | sed 's/IMF=[^;]*;//' > $$opts{tmp}/mpileup.platform.out");
+    test_cmd($opts,out=>'dat/empty.expected',cmd=>"$$opts{bin}/samtools mpileup -uv -F0 -P ILLUMINA -f $$opts{tmp}/mpileup.ref.fa.gz $$opts{tmp}/mpileup.platform.sam | grep -v ^## | sed 's/IMF=[^;]*;//' | diff - $$opts{tmp}/mpileup.platform.out");
+    # nearby -l regions, each read with its own iterator, take the records they
+    # share from the --bamcachesize cache; the output must be the same without it
+    open(my $fhb,'>',"$$opts{tmp}/mpileup.near.bed") or error("$$opts{tmp}/mpileup.near.bed: $!");
+    print $fhb "17\t100\t200\n17\t250\t350\n17\t360\t600\n";
+    close($fhb);
+    cmd("$$opts{bin}/samtools mpileup -l $$opts{tmp}/mpileup.near.bed --region-gap 0 --plan seek --bamcachesize 0 -f $$opts{tmp}/mpileup.ref.fa.gz $$opts{tmp}/mpileup.1.bam > $$opts{tmp}/mpileup.near.out");
+    test_cmd($opts,out=>'dat/empty.expected',cmd=>"$$opts{bin}/samtools mpileup -l $$opts{tmp}/mpileup.near.bed --region-gap 0 --plan seek --bamcachesize 1 -f $$opts{tmp}/mpileup.ref.fa.gz $$opts{tmp}/mpileup.1.bam | diff - $$opts{tmp}/mpileup.near.out");
+    # worker threads must not change the output
+    test_cmd($opts,out=>'dat/mpileup.out.1',err=>'dat/mpileup.err.1',cmd=>"$$opts{bin}/samtools mpileup -@ 2 -b $$opts{tmp}/mpileup.bam.list -f $$opts{tmp}/mpileup.ref.fa.gz -r17:100-150");
+    test_cmd($opts,out=>'dat/mpileup.out.2',cmd=>"$$opts{bin}/samtools mpileup -@ 2 -uvDV -b $$opts{tmp}/mpileup.bam.list -f $$opts{tmp}/mpileup.ref.fa.gz -r17:100-600| grep -v ^##samtools | grep -v ^##ref");
+    # nor where a contig is cut into several pieces, here at sites deeper than -d:
+    # 400 samples allow -d 20, and 300 reads overlap the default cuts every 100kb
+    open(my $fh,'>',"$$opts{tmp}/mpileup.deep.sam") or error("$$opts{tmp}/mpileup.deep.sam: $!");
+    print $fh "\@HD\tVN:1.4\tSO:coordinate\n\@SQ\tSN:deep\tLN:350000\n";
+    for my $i (1..400) { print $fh "\@RG\tID:rg$i\tSM:s$i\n"; }
+    my $nread = 0;
+    for my $pos (1..349900)
+    {
+        my $n = abs(($pos + 50000) % 100000 - 50000) < 400 ? 3 : ($pos % 500 == 1 ? 1 : 0);
+        for (1..$n) { $nread++; print $fh "r$nread\t0\tdeep\t$pos\t60\t100M\t*\t0\t0\t" . ('ACGT' x 25) . "\t" . ('I' x 100) . "\tRG:Z:rg1\n"; }
+    }
+    close($fh);
+    cmd("$$opts{bin}/samtools view -b $$opts{tmp}/mpileup.deep.sam > $$opts{tmp}/mpileup.deep.bam");
+    cmd("$$opts{bin}/samtools index $$opts{tmp}/mpileup.deep.bam");
+    cmd("$$opts{bin}/samtools mpileup -d 20 $$opts{tmp}/mpileup.deep.bam > $$opts{tmp}/mpileup.deep.out");
+    cmd("$$opts{bin}/samtools mpileup -d 20 -r deep:100-320000 $$opts{tmp}/mpileup.deep.bam > $$opts{tmp}/mpileup.deep.r.out");
+    test_cmd($opts,out=>'dat/empty.expected',cmd=>"$$opts{bin}/samtools mpileup -@ 4 -d 20 $$opts{tmp}/mpileup.deep.bam | diff - $$opts{tmp}/mpileup.deep.out");
+    test_cmd($opts,out=>'dat/empty.expected',cmd=>"$$opts{bin}/samtools mpileup -@ 4 -d 20 -r deep:100-320000 $$opts{tmp}/mpileup.deep.bam | diff - $$opts{tmp}/mpileup.deep.r.out");
     # test that filter mask replaces (not just adds to) default mask
     test_cmd($opts,out=>'dat/mpileup.out.3',cmd=>"$$opts{bin}/samtools mpileup -B --ff 0x14 -f $$opts{tmp}/mpileup.ref.fa.gz -r17:1050-1060 $$opts{tmp}/mpileup.1.bam | grep -v mpileup");
     test_cmd($opts,out=>'dat/mpileup.out.3',cmd=>"$$opts{bin}/samtools mpileup -B --ff 0x14 -f $$opts{tmp}/mpileup.ref.fa.gz -r17:1050-1060 $$opts{tmp}/mpileup.1.cram | grep -v mpileup");
@@ -2194,6 +2266,8 @@ sub test_merge
     }
     close($tmpfile_fh);
     test_cmd($opts,out=>'merge/3.merge.expected.bam', err=>'merge/3.merge.expected.err',cmd=>"$$opts{bin}/samtools merge -s 1 -b $tmpfile_filename - $$opts{path}/dat/test_input_1_a.bam");
+    # Merge 4 - As merge 2, with the inputs read ahead in threads
+    test_cmd($opts,out=>'merge/2.merge.expected.bam',cmd=>"$$opts{bin}/samtools merge -s 1 -@ 2 - $$opts{path}/dat/test_input_1_a.bam $$opts{path}/dat/test_input_1_b.bam $$opts{path}/dat/test_input_1_c.bam");
 }
 
 sub test_fixmate